@@ -0,0 +1,155 @@
+/* This file is part of Equine Monitor
+ *
+ * Equine Monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Equine Monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Equine Monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Konke Radlow <koradlow@gmail.com>
+ */
+
+/* builds the awaitables of xbee_coro.h with -std=c++20, and runs a
+ * coroutine that is resumed by the messages of a replayed capture. Returns
+ * the number of failed checks */
+
+#include "xbee_coro.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define CORO_MSG_CNT 5
+
+/* resumes with the next message of the replay, right away if the replay
+ * delivered it before the coroutine asked for it */
+class Replay_Awaitable : public XBee_Awaitable<XBee_Message*> {
+public:
+	Replay_Awaitable(XBee &xbee) :
+		XBee_Awaitable<XBee_Message*>(xbee)
+	{}
+
+	static void deliver(XBee_Message *msg) {
+		Replay_Awaitable *awaitable = waiting;
+
+		if (!awaitable) {
+			buffered = msg;
+			return;
+		}
+		waiting = NULL;
+		awaitable->complete(msg);
+	}
+
+	static Replay_Awaitable *waiting;
+	static XBee_Message *buffered;
+protected:
+	void start() {
+		XBee_Message *msg = buffered;
+
+		if (msg) {
+			buffered = NULL;
+			complete(msg);
+			return;
+		}
+		waiting = this;
+	}
+};
+
+Replay_Awaitable *Replay_Awaitable::waiting = NULL;
+XBee_Message *Replay_Awaitable::buffered = NULL;
+
+static int received = 0;
+static int wrong = 0;
+
+/* takes the messages of the replay in order, message n carries n */
+static XBee_Task consume(XBee &xbee) {
+	for (int i = 1; i <= CORO_MSG_CNT; i++) {
+		XBee_Message *msg = co_await Replay_Awaitable(xbee);
+		uint16_t len;
+		uint8_t *payload = msg->get_payload(&len);
+
+		if (len != 1 || payload[0] != i)
+			wrong++;
+		received++;
+		delete msg;
+	}
+}
+
+/* writes a capture with single part messages from one source */
+static bool write_capture(const char *path) {
+	XBee_Capture_Header header;
+	XBee_Capture_Record record;
+	GBeeFrameData frame;
+	GBeeRxPacket *rx = (GBeeRxPacket*) &frame;
+	bool ok;
+	int fd;
+
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if (fd < 0)
+		return false;
+	memcpy(header.magic, XBEE_CAPTURE_MAGIC, 4);
+	header.version = XBEE_CAPTURE_VERSION;
+	header.record_header_len = sizeof(XBee_Capture_Record);
+	header.start = 0;
+	ok = write(fd, &header, sizeof(header)) == sizeof(header);
+	for (int i = 1; i <= CORO_MSG_CNT && ok; i++) {
+		memset(&frame, 0, sizeof(frame));
+		rx->ident = GBEE_RX_PACKET;
+		rx->data[MSG_TYPE] = DATA;
+		rx->data[MSG_PART] = 1;
+		rx->data[MSG_PART_CNT] = 1;
+		rx->data[MSG_SEQ + 1] = i;
+		rx->data[MSG_PAYLOAD_LENGTH] = 1;
+		rx->data[MSG_HEADER_LENGTH] = i;
+		record.timestamp = 0;
+		record.length = (rx->data - (uint8_t*) rx) + MSG_HEADER_LENGTH + 1;
+		record.direction = XBEE_CAPTURE_RX;
+		record.reserved = 0;
+		ok = write(fd, &record, sizeof(record)) == sizeof(record) &&
+			write(fd, &frame, record.length) == record.length;
+	}
+	close(fd);
+	return ok;
+}
+
+int main(int argc, char **argv) {
+	uint8_t pan_id[8] = {0};
+	/* the interface isn't initialized, no serial port is opened */
+	XBee_Config config("", "coro_test", true, 0, pan_id, 500, B115200, 1);
+	XBee xbee(config);
+	char path[] = "/tmp/xbee_coro_XXXXXX";
+	int fd = mkstemp(path);
+	int failed = 0;
+
+	if (fd < 0 || !write_capture(path)) {
+		printf("Error writing the capture %s\n", path);
+		return 1;
+	}
+	close(fd);
+
+	/* the coroutine starts with the first message buffered, so its first
+	 * await completes without suspending. The replay resumes it with each
+	 * further message */
+	xbee.xbee_replay_capture(path, [&xbee](XBee_Message *msg) {
+		Replay_Awaitable::deliver(msg);
+		if (received == 0 && !Replay_Awaitable::waiting)
+			consume(xbee);
+	}, NULL);
+	unlink(path);
+
+	if (received != CORO_MSG_CNT || wrong) {
+		printf("coroutine received %d of %d messages, %d wrong\n", received,
+		CORO_MSG_CNT, wrong);
+		failed++;
+	}
+	printf("%d checks, %d failed\n", 1, failed);
+	return failed;
+}
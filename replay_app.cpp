@@ -0,0 +1,62 @@
+/* This file is part of Equine Monitor
+ *
+ * Equine Monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Equine Monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Equine Monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Konke Radlow <koradlow@gmail.com>
+ */
+
+/* replays a frame capture created with XBee::xbee_capture_start through the
+ * receive path of the interface, without a radio attached. Usage:
+ *	replay <capture file> [iterations] */
+
+#include "xbee_if.h"
+#include <stdlib.h>
+#include <time.h>
+
+int main(int argc, char **argv) {
+	uint8_t pan_id[8] = {0x00, 0x00, 0x00, 0x00, 0x00, 0xAB, 0xBC, 0xCD};
+	struct timespec start, end;
+	XBee_Replay_Stats stats;
+	int iterations = 1;
+	double seconds;
+
+	if (argc < 2) {
+		printf("Usage: %s <capture file> [iterations]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		iterations = atoi(argv[2]);
+
+	/* the interface isn't initialized, no serial port is opened */
+	XBee_Config config("", "replay", true, 0, pan_id, 500, B115200, 1);
+	XBee interface(config);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < iterations; i++) {
+		if (interface.xbee_replay_capture(argv[1], NULL, &stats) < 0)
+			return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Frames: %u (skipped: %u), messages: %u, payload: %llu bytes\n",
+	stats.frames, stats.skipped, stats.messages, (unsigned long long)stats.payload_bytes);
+	printf("Elapsed time: %.3f s\n", seconds);
+	if (seconds > 0)
+		printf("Throughput: %.0f frames/s, %.0f messages/s, %.1f MB/s payload\n",
+		(stats.frames - stats.skipped) / seconds, stats.messages / seconds,
+		stats.payload_bytes / seconds / 1e6);
+
+	return 0;
+}
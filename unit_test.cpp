@@ -0,0 +1,1042 @@
+/* This file is part of Equine Monitor
+ *
+ * Equine Monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Equine Monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Equine Monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Konke Radlow <koradlow@gmail.com>
+ */
+
+/* tests of the parts of the interface that work without a radio. Returns
+ * the number of failed checks */
+
+#include "xbee_if.h"
+#include "xbee_schema.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+static int checks = 0;
+static int failed = 0;
+
+#define CHECK(cond) do { \
+	checks++; \
+	if (!(cond)) { \
+		failed++; \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+	} \
+} while (0)
+
+/* a timer in the slot of the cursor on a higher level belongs to the next
+ * round of that level, next_expiry must not report it as due */
+static void test_timer_next_round() {
+	XBee_Timer_Wheel wheel(100);
+	XBee_Timer timer;
+	uint64_t next;
+
+	/* 4160 >> 6 = 65, the level 1 slot of the cursor 100 >> 6 = 1 */
+	wheel.arm(&timer, 4160);
+	next = wheel.next_expiry();
+	CHECK(next > 100 && next <= 4160);
+	CHECK(wheel.expire(next - 1) == NULL);
+	CHECK(wheel.expire(4159) == NULL);
+	CHECK(wheel.expire(4160) == &timer);
+	CHECK(wheel.next_expiry() == UINT64_MAX);
+}
+
+/* drives the wheel like xbee_poll, sleeping until the next expiry. Every
+ * timer has to expire exactly at its deadline after cascading down the
+ * levels, and the poll loop must not spin */
+static void test_timer_cascade() {
+	const int cnt = 5000;
+	std::vector<XBee_Timer> timers(cnt);
+	uint64_t now = 123456789;
+	uint64_t next;
+	XBee_Timer_Wheel wheel(now);
+	XBee_Timer *timer;
+	int fired = 0;
+	int late = 0;
+	int cancelled = 0;
+	int wakeups = 0;
+
+	srand(1);
+	for (int i = 0; i < cnt; i++) {
+		/* mostly short deadlines, some on every level */
+		uint64_t delta = (rand() % 3) ? rand() % 100 : rand() % (XBEE_WHEEL_RANGE - 1);
+		wheel.arm(&timers[i], now + delta);
+	}
+	for (int i = 0; i < cnt; i += 7) {
+		wheel.cancel(&timers[i]);
+		cancelled++;
+	}
+	while ((next = wheel.next_expiry()) != UINT64_MAX) {
+		CHECK(next >= now);
+		if (next < now)
+			break;
+		now = next;
+		wakeups++;
+		while ((timer = wheel.expire(now))) {
+			fired++;
+			if (timer->expires != now)
+				late++;
+		}
+		now++;
+	}
+	CHECK(fired == cnt - cancelled);
+	CHECK(late == 0);
+	/* one wakeup per expiry, plus at most one per slot of a higher
+	 * level that cascades */
+	CHECK(wakeups <= fired + (XBEE_WHEEL_LEVELS - 1) * XBEE_WHEEL_SLOTS * 2);
+	for (int i = 0; i < cnt; i++)
+		CHECK(!timers[i].armed());
+}
+
+/* the window of received numbers, across the wrap of the 15-bit number
+ * space */
+static void test_dedup_window() {
+	XBee_Dedup dedup;
+
+	/* the first message of a source */
+	dedup.used = true;
+	dedup.last = 32760;
+	dedup.window = 1;
+	CHECK(dedup.duplicate(32760));
+	for (uint16_t seq = 32761; seq <= MSG_SEQ_MASK; seq++)
+		CHECK(!dedup.duplicate(seq));
+	CHECK(!dedup.duplicate(0));
+	CHECK(!dedup.duplicate(2));
+	CHECK(dedup.last == 2);
+	CHECK(dedup.duplicate(32767));
+	CHECK(dedup.duplicate(0));
+	/* a message that arrived out of order */
+	CHECK(!dedup.duplicate(1));
+	CHECK(dedup.duplicate(1));
+	CHECK(dedup.last == 2);
+
+	/* the oldest number inside the window is still tracked */
+	CHECK(!dedup.duplicate(10));
+	CHECK(!dedup.duplicate((10 - (XBEE_DEDUP_WINDOW - 1)) & MSG_SEQ_MASK));
+	CHECK(dedup.duplicate((10 - (XBEE_DEDUP_WINDOW - 1)) & MSG_SEQ_MASK));
+	/* older numbers are late retransmits, the sender went on */
+	CHECK(dedup.duplicate((10 - XBEE_DEDUP_WINDOW) & MSG_SEQ_MASK));
+	CHECK(dedup.last == 10);
+
+	/* a jump beyond the window starts a new window */
+	CHECK(!dedup.duplicate(10 + XBEE_DEDUP_WINDOW));
+	CHECK(dedup.window == 1);
+	CHECK(!dedup.duplicate(10 + XBEE_DEDUP_WINDOW - 1));
+
+	/* far behind: only a sender that restarted its numbering sets the
+	 * sync flag, the window follows it */
+	CHECK(dedup.duplicate(20000));
+	CHECK(dedup.last == 10 + XBEE_DEDUP_WINDOW);
+	CHECK(!dedup.duplicate(20000 | MSG_SEQ_SYNC));
+	CHECK(dedup.last == 20000);
+	CHECK(dedup.duplicate(20000));
+	CHECK(!dedup.duplicate(20001));
+}
+
+/* the sync flag restarts the window, also for a number inside it, but not
+ * for the further sync messages of the same run */
+static void test_dedup_sync() {
+	XBee_Dedup dedup;
+
+	dedup.used = true;
+	dedup.last = 100;
+	dedup.window = ~(uint64_t)0;
+	dedup.sync = 0;
+	CHECK(dedup.duplicate(50));
+	/* a sender that restarted with a number it used before */
+	CHECK(!dedup.duplicate(50 | MSG_SEQ_SYNC));
+	CHECK(dedup.last == 50);
+	CHECK(dedup.window == 1);
+	CHECK(dedup.duplicate(50 | MSG_SEQ_SYNC));
+	/* the run continues, also out of order */
+	CHECK(!dedup.duplicate(53 | MSG_SEQ_SYNC));
+	CHECK(!dedup.duplicate(51 | MSG_SEQ_SYNC));
+	CHECK(dedup.last == 53);
+	CHECK(dedup.duplicate(51 | MSG_SEQ_SYNC));
+	CHECK(dedup.duplicate(53 | MSG_SEQ_SYNC));
+	CHECK(!dedup.duplicate(52 | MSG_SEQ_SYNC));
+	/* the first delivery ends the run on the sender */
+	CHECK(!dedup.duplicate(54));
+	CHECK(dedup.duplicate(54));
+	CHECK(dedup.duplicate(52 | MSG_SEQ_SYNC));
+	/* a number of the run that arrives without the flag is the same
+	 * message */
+	CHECK(dedup.duplicate(53));
+	/* the number of a message without the flag is a new numbering */
+	CHECK(!dedup.duplicate(54 | MSG_SEQ_SYNC));
+	CHECK(dedup.last == 54);
+	CHECK(dedup.window == 1);
+	CHECK(dedup.duplicate(54 | MSG_SEQ_SYNC));
+	/* a restart far behind the window */
+	CHECK(!dedup.duplicate(20000 | MSG_SEQ_SYNC));
+	CHECK(dedup.last == 20000);
+	CHECK(dedup.duplicate(20000 | MSG_SEQ_SYNC));
+}
+
+/* a sender that repeats messages up to three times, with the copies
+ * reordered by less than the window. Every message has to be delivered
+ * exactly once, over several wraps of the number space */
+static void test_dedup_reorder() {
+	const int cnt = 100000;
+	std::vector<std::pair<int, int> > events;
+	std::vector<int> delivered(cnt, 0);
+	XBee_Dedup dedup;
+	int wrong = 0;
+
+	srand(2);
+	for (int i = 0; i < cnt; i++) {
+		int copies = 1 + rand() % 3;
+		for (int j = 0; j < copies; j++)
+			events.push_back(std::make_pair(i + rand() % (XBEE_DEDUP_WINDOW / 2), i));
+	}
+	std::stable_sort(events.begin(), events.end());
+
+	dedup.used = true;
+	dedup.last = events[0].second & MSG_SEQ_MASK;
+	dedup.window = 1;
+	delivered[events[0].second]++;
+	for (size_t i = 1; i < events.size(); i++) {
+		if (!dedup.duplicate(events[i].second & MSG_SEQ_MASK))
+			delivered[events[i].second]++;
+	}
+	for (int i = 0; i < cnt; i++) {
+		if (delivered[i] != 1)
+			wrong++;
+	}
+	CHECK(wrong == 0);
+}
+
+/* writes received frames into a capture file, which xbee_replay_capture
+ * passes through the receive path of the interface */
+class Capture_Writer {
+public:
+	Capture_Writer() {
+		XBee_Capture_Header header;
+
+		strcpy(path, "/tmp/xbee_unit_XXXXXX");
+		fd = mkstemp(path);
+		memcpy(header.magic, XBEE_CAPTURE_MAGIC, 4);
+		header.version = XBEE_CAPTURE_VERSION;
+		header.record_header_len = sizeof(XBee_Capture_Record);
+		header.start = 0;
+		if (fd >= 0 && write(fd, &header, sizeof(header)) != sizeof(header)) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	~Capture_Writer() {
+		if (fd >= 0)
+			close(fd);
+		unlink(path);
+	}
+
+	/* an rx packet with a message part from the source with the lower
+	 * 32 bits of the 64-bit address */
+	void add_part(const uint8_t *header, const uint8_t *payload, uint16_t length,
+			uint32_t source = 0) {
+		GBeeFrameData frame;
+		GBeeRxPacket *rx = (GBeeRxPacket*) &frame;
+
+		memset(&frame, 0, sizeof(frame));
+		rx->ident = GBEE_RX_PACKET;
+		rx->srcAddr64l = GBEE_ULONG(source);
+		memcpy(rx->data, header, MSG_HEADER_LENGTH);
+		memcpy(&rx->data[MSG_HEADER_LENGTH], payload, length);
+		add_frame((uint8_t*) &frame, (rx->data - (uint8_t*) rx) + MSG_HEADER_LENGTH + length);
+	}
+
+	/* a received frame, starting with the frame type */
+	void add_frame(const uint8_t *frame, uint16_t length) {
+		XBee_Capture_Record record;
+
+		record.timestamp = 0;
+		record.length = length;
+		record.direction = XBEE_CAPTURE_RX;
+		record.reserved = 0;
+		if (fd < 0 || write(fd, &record, sizeof(record)) != sizeof(record) ||
+		write(fd, frame, length) != length) {
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	int fd;
+	char path[32];
+};
+
+/* a message part with the number seq and a payload of one byte */
+static void add_small_part(Capture_Writer &capture, uint16_t seq, uint8_t part,
+		uint8_t cnt, uint32_t source) {
+	uint8_t header[MSG_HEADER_LENGTH];
+	uint8_t payload = part;
+
+	header[MSG_TYPE] = DATA;
+	header[MSG_PART] = part;
+	header[MSG_PART_CNT] = cnt;
+	header[MSG_SEQ] = seq >> 8;
+	header[MSG_SEQ + 1] = seq;
+	header[MSG_PAYLOAD_LENGTH] = 1;
+	capture.add_part(header, &payload, 1, source);
+}
+
+/* replays the capture, returns the number of completed messages */
+static int replay_count(XBee &xbee, Capture_Writer &capture) {
+	int complete = 0;
+
+	if (capture.fd < 0)
+		return -1;
+	xbee.xbee_replay_capture(capture.path, [&](XBee_Message *msg) {
+		complete++;
+		delete msg;
+	}, NULL);
+	return complete;
+}
+
+/* late retransmits of completed messages neither open a reassembly nor
+ * replace one, and a full table keeps the messages of active sources */
+static void test_reassembly_retransmit(XBee &xbee) {
+	{
+		Capture_Writer capture;
+
+		add_small_part(capture, 5, 1, 2, 1);
+		add_small_part(capture, 5, 2, 2, 1);
+		add_small_part(capture, 6, 1, 2, 1);
+		/* the second part of 5 again, while 6 is reassembled */
+		add_small_part(capture, 5, 2, 2, 1);
+		add_small_part(capture, 6, 2, 2, 1);
+		CHECK(replay_count(xbee, capture) == 2);
+	}
+	{
+		Capture_Writer capture;
+
+		for (uint32_t source = 1; source <= XBEE_REASSEMBLY_SIZE; source++) {
+			add_small_part(capture, 7, 1, 2, source);
+			add_small_part(capture, 7, 2, 2, source);
+			add_small_part(capture, 8, 1, 2, source);
+		}
+		/* retransmits from every source, and a new source, while the
+		 * table is full */
+		for (uint32_t source = 1; source <= XBEE_REASSEMBLY_SIZE; source++)
+			add_small_part(capture, 7, 2, 2, source);
+		add_small_part(capture, 1, 1, 2, 100);
+		add_small_part(capture, 1, 2, 2, 100);
+		for (uint32_t source = 1; source <= XBEE_REASSEMBLY_SIZE; source++)
+			add_small_part(capture, 8, 2, 2, source);
+		CHECK(replay_count(xbee, capture) == 2 * XBEE_REASSEMBLY_SIZE);
+	}
+}
+
+/* a coalesced frame with records of 1, 2, ... bytes whose bytes are the
+ * record number, cut off after frame_len payload bytes. The header claims
+ * the payload of all records */
+static void add_coalesced(Capture_Writer &capture, uint8_t records, uint16_t frame_len) {
+	uint8_t header[MSG_HEADER_LENGTH];
+	uint8_t payload[XBEE_MSG_LENGTH];
+	uint16_t length = 0;
+
+	for (uint8_t i = 1; i <= records; i++) {
+		payload[length + COALESCE_SUB_TYPE] = DATA;
+		payload[length + COALESCE_SUB_LENGTH] = i;
+		memset(&payload[length + COALESCE_SUB_HEADER_LENGTH], i, i);
+		length += COALESCE_SUB_HEADER_LENGTH + i;
+	}
+	header[MSG_TYPE] = MSG_TYPE_COALESCED;
+	header[MSG_PART] = 1;
+	header[MSG_PART_CNT] = 1;
+	header[MSG_SEQ] = 0;
+	header[MSG_SEQ + 1] = 9;
+	header[MSG_PAYLOAD_LENGTH] = length;
+	capture.add_part(header, payload, std::min(length, frame_len));
+}
+
+/* replays a coalesced frame, returns the number of records that were
+ * delivered in order, or -1 if a record was delivered with a wrong payload */
+static int replay_coalesced(XBee &xbee, uint8_t records, uint16_t frame_len) {
+	Capture_Writer capture;
+	int delivered = 0;
+	bool wrong = false;
+
+	add_coalesced(capture, records, frame_len);
+	if (capture.fd < 0)
+		return -1;
+	xbee.xbee_replay_capture(capture.path, [&](XBee_Message *msg) {
+		uint16_t len;
+		uint8_t *payload = msg->get_payload(&len);
+
+		delivered++;
+		if (len != delivered || payload[0] != delivered || payload[len - 1] != delivered)
+			wrong = true;
+		delete msg;
+	}, NULL);
+	return wrong ? -1 : delivered;
+}
+
+/* the records of a coalesced frame become single messages, records that
+ * aren't completely inside the received frame are dropped */
+static void test_coalesced_split(XBee &xbee) {
+	CHECK(replay_coalesced(xbee, 1, 100) == 1);
+	CHECK(replay_coalesced(xbee, 5, 100) == 5);
+	/* record n takes 2 + n bytes, the frame ends inside the sub-header or
+	 * the payload of record 3 */
+	CHECK(replay_coalesced(xbee, 5, 3 + 4 + 1) == 2);
+	CHECK(replay_coalesced(xbee, 5, 3 + 4 + 4) == 2);
+	CHECK(replay_coalesced(xbee, 5, 3 + 4 + 5) == 3);
+	/* nothing but the header */
+	CHECK(replay_coalesced(xbee, 5, 0) == 0);
+}
+
+struct Schema_Record {
+	uint8_t samples[100];
+};
+
+typedef XBee_Schema<DATA, uint32_t, int16_t, double, uint8_t, Schema_Record> Schema_Test;
+
+/* a message of the schema is sent in parts of part_size bytes, and read
+ * from the reassembled message */
+static void replay_schema(XBee &xbee, XBee_Message &msg, uint8_t part_size) {
+	uint16_t length;
+	uint8_t *payload = msg.get_payload(&length);
+	uint16_t cnt = (length + part_size - 1) / part_size;
+	uint8_t header[MSG_HEADER_LENGTH];
+	Capture_Writer capture;
+	int complete = 0;
+
+	header[MSG_TYPE] = msg.get_type();
+	header[MSG_PART_CNT] = cnt;
+	header[MSG_SEQ] = 0;
+	header[MSG_SEQ + 1] = 1;
+	for (uint16_t part = 1; part <= cnt; part++) {
+		uint16_t len = (part < cnt) ? part_size : length - (cnt - 1) * part_size;
+		header[MSG_PART] = part;
+		header[MSG_PAYLOAD_LENGTH] = len;
+		capture.add_part(header, &payload[(part - 1) * part_size], len);
+	}
+	CHECK(capture.fd >= 0);
+	xbee.xbee_replay_capture(capture.path, [&](XBee_Message *received) {
+		XBee_View<Schema_Test> view(received);
+		Schema_Record record;
+
+		complete++;
+		CHECK(view.valid());
+		if (view.valid()) {
+			CHECK(view.get<0>() == 0x12345678);
+			CHECK(view.get<1>() == -1234);
+			CHECK(view.get<2>() == 2.5);
+			CHECK(view.get<3>() == 0xAB);
+			record = view.get<4>();
+			for (int i = 0; i < 100; i++)
+				CHECK(record.samples[i] == i);
+		}
+		delete received;
+	}, NULL);
+	CHECK(complete == 1);
+}
+
+/* the fields written into a message of a schema are read back in place,
+ * after the message was split into the part sizes of good and poor links */
+static void test_schema_round_trip(XBee &xbee) {
+	XBee_Writer<Schema_Test> writer;
+	Schema_Record record;
+	uint16_t length;
+
+	CHECK(Schema_Test::size == 4 + 2 + 8 + 1 + 100);
+	CHECK((Schema_Test::field<4>::offset == 15));
+	for (int i = 0; i < 100; i++)
+		record.samples[i] = i;
+	writer.set<0>(0x12345678);
+	writer.set<1>(-1234);
+	writer.set<2>(2.5);
+	writer.set<3>(0xAB);
+	writer.set<4>(record);
+	/* integers are stored in little-endian */
+	CHECK(writer.message().get_payload(&length)[0] == 0x78);
+	CHECK(length == Schema_Test::size);
+
+	replay_schema(xbee, writer.message(), XBEE_MSG_LENGTH - MSG_HEADER_LENGTH);
+	replay_schema(xbee, writer.message(), (XBEE_MSG_LENGTH - MSG_HEADER_LENGTH) / 2);
+
+	/* other types and short messages aren't read */
+	XBee_Message other(CONFIG, Schema_Test::size);
+	XBee_Message short_msg(DATA, Schema_Test::size - 1);
+	CHECK(!XBee_View<Schema_Test>(&other).valid());
+	CHECK(!XBee_View<Schema_Test>(&short_msg).valid());
+	CHECK(!XBee_View<Schema_Test>(NULL).valid());
+}
+
+/* sends a message of length bytes in data parts of part_size bytes and
+ * group * parity parity parts per group, without the lost data parts.
+ * Returns the number of messages that were completed with the original
+ * payload, or -1 if a message was completed with a different payload */
+static int replay_parity(XBee &xbee, const uint8_t *data, uint16_t length,
+		uint8_t part_size, uint8_t group, uint8_t parity,
+		const std::vector<bool> &lost) {
+	uint16_t cnt = (length + part_size - 1) / part_size;
+	uint16_t groups = (cnt + group - 1) / group;
+	uint8_t header[MSG_HEADER_LENGTH];
+	uint8_t payload[FEC_HEADER_LENGTH + FEC_MAX_PART_SIZE];
+	Capture_Writer capture;
+	int complete = 0;
+
+	header[MSG_TYPE] = DATA;
+	header[MSG_PART_CNT] = cnt;
+	header[MSG_SEQ] = 0x12;
+	header[MSG_SEQ + 1] = 0x34;
+	for (uint16_t part = 1; part <= cnt; part++) {
+		uint16_t len = (part < cnt) ? part_size : length - (cnt - 1) * part_size;
+		if (lost[part - 1])
+			continue;
+		header[MSG_PART] = part;
+		header[MSG_PAYLOAD_LENGTH] = len;
+		capture.add_part(header, &data[(part - 1) * part_size], len);
+	}
+	/* parity part j of a group covers every parity-th data part of the
+	 * group, starting with part j */
+	for (uint16_t index = 0; index < groups * parity; index++) {
+		uint16_t first = (index / parity) * group + index % parity + 1;
+		uint16_t last = std::min((index / parity + 1) * group, (int) cnt);
+
+		memset(payload, 0, sizeof(payload));
+		payload[FEC_GROUP] = group;
+		payload[FEC_PARITY] = parity;
+		for (uint16_t part = first; part <= last; part += parity) {
+			uint16_t len = (part < cnt) ? part_size : length - (cnt - 1) * part_size;
+			for (int i = 0; i < len; i++)
+				payload[FEC_HEADER_LENGTH + i] ^= data[(part - 1) * part_size + i];
+			payload[FEC_LENGTH] ^= len;
+		}
+		header[MSG_PART] = cnt + index + 1;
+		header[MSG_PAYLOAD_LENGTH] = FEC_HEADER_LENGTH + part_size;
+		capture.add_part(header, payload, FEC_HEADER_LENGTH + part_size);
+	}
+	if (capture.fd < 0)
+		return -1;
+
+	xbee.xbee_replay_capture(capture.path, [&](XBee_Message *msg) {
+		uint16_t len;
+		uint8_t *received = msg->get_payload(&len);
+
+		if (complete >= 0 && len == length && !memcmp(received, data, length))
+			complete++;
+		else
+			complete = -1;
+		delete msg;
+	}, NULL);
+	return complete;
+}
+
+/* lost data parts are rebuilt from the parity parts as long as at most one
+ * part covered by each parity part is lost, including a last part that is
+ * shorter than the others or exactly fills its part */
+static void test_parity_rebuild(XBee &xbee) {
+	const uint16_t lengths[] = {76, 150, 151, 300, 301, 1000};
+	const uint8_t part_sizes[] = {FEC_MAX_PART_SIZE, 50};
+	const uint8_t fec[][2] = {{1, 1}, {2, 1}, {4, 1}, {4, 2}, {8, 3}};
+	uint8_t data[1000];
+
+	srand(3);
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = rand();
+	for (uint16_t length : lengths) {
+		for (uint8_t part_size : part_sizes) {
+			for (size_t f = 0; f < sizeof(fec) / sizeof(fec[0]); f++) {
+				uint8_t group = fec[f][0];
+				uint8_t parity = fec[f][1];
+				uint16_t cnt = (length + part_size - 1) / part_size;
+				std::vector<bool> lost(cnt, false);
+
+				/* nothing lost */
+				CHECK(replay_parity(xbee, data, length, part_size, group, parity, lost) == 1);
+				/* the first part of every parity class */
+				for (uint16_t part = 0; part < cnt; part++)
+					lost[part] = part % group < parity;
+				CHECK(replay_parity(xbee, data, length, part_size, group, parity, lost) == 1);
+				/* the last part alone */
+				lost.assign(cnt, false);
+				lost[cnt - 1] = true;
+				CHECK(replay_parity(xbee, data, length, part_size, group, parity, lost) == 1);
+				/* two parts of the same class can't be rebuilt */
+				if (group > parity && cnt > parity) {
+					lost.assign(cnt, false);
+					lost[0] = lost[parity] = true;
+					CHECK(replay_parity(xbee, data, length, part_size, group, parity, lost) == 0);
+				}
+			}
+		}
+	}
+}
+
+/* a batch on an interface without a radio: every command fails to be sent,
+ * no "AC" is sent to a node with a failed command, and the batch still
+ * finishes for more nodes than fit into a window */
+static void test_remote_at_batch(uint8_t window) {
+	uint8_t pan_id[8] = {0};
+	XBee_Config config("", "unit_test", true, 0, pan_id, 500, B115200, 1);
+	const uint16_t cnt = 40;
+	std::vector<XBee_At_Command> cmds;
+	std::vector<XBee_Address> addrs(cnt);
+	uint8_t channel = 0x0F;
+
+	config.remote_at_window = window;
+	XBee xbee(config);
+	for (uint16_t i = 0; i < cnt; i++) {
+		cmds.push_back(XBee_At_Command("CH", &channel, 1));
+		cmds[i].status = 0x00;
+		/* two commands for each node */
+		addrs[i].addr64l = i / 2 + 1;
+		addrs[i].addr16 = 0xFFFE;
+	}
+	CHECK(xbee.xbee_send_remote_at_commands(cmds.data(), addrs.data(), cnt, true) == cnt);
+	for (uint16_t i = 0; i < cnt; i++)
+		CHECK(cmds[i].status == XBEE_AT_TX_FAILURE);
+	CHECK(xbee.xbee_send_remote_at_commands(cmds.data(), addrs.data(), 0, true) == 0);
+}
+
+/* milliseconds of the monotonic clock */
+static uint64_t now_ms() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* transmit flow control on an interface without a radio, where every
+ * transmission fails: failed parts back off before they are retried, a
+ * full queue is reported to try sends and fails async sends after the
+ * queue timeout, and sends to uncached nodes report the failed lookup */
+static void test_tx_queue() {
+	uint8_t pan_id[8] = {0};
+	XBee_Config config("", "unit_test", true, 0, pan_id, 500, B115200, 1);
+	uint8_t data[4] = {1, 2, 3, 4};
+	XBee_Message msg(DATA, data, sizeof(data));
+	uint64_t start;
+	int status = -1;
+	int full = -1;
+	int accepted = 0;
+
+	config.queue_timeout = 100;
+	{
+		XBee xbee(config);
+
+		/* each retry waits for the backoff of the destination */
+		start = now_ms();
+		xbee.xbee_send_to_coordinator_async(msg, [&](uint8_t s) { status = s; });
+		while (status < 0 && now_ms() - start < 10000)
+			xbee.xbee_poll(10);
+		CHECK(status == 0xFF);
+		CHECK(now_ms() - start >= XBEE_BACKOFF_BASE * 3);
+	}
+	{
+		XBee xbee(config);
+
+		/* two slots stay free for the flushes of coalescing buffers */
+		while (accepted <= XBEE_TX_QUEUE_SIZE &&
+		xbee.xbee_try_send_to_coordinator(msg) == GBEE_NO_ERROR)
+			accepted++;
+		CHECK(accepted == XBEE_TX_QUEUE_SIZE - 1);
+		CHECK(xbee.xbee_try_send_to_coordinator(msg) == XBEE_TX_QUEUE_FULL);
+		/* an async send waits for a slot up to the queue timeout */
+		start = now_ms();
+		xbee.xbee_send_to_coordinator_async(msg, [&](uint8_t s) { full = s; });
+		CHECK(full == -1);
+		while (full < 0 && now_ms() - start < 10000)
+			xbee.xbee_poll(10);
+		CHECK(full == XBEE_TX_QUEUE_FULL);
+		CHECK(now_ms() - start >= config.queue_timeout);
+
+		/* the message waits for the lookup, which fails */
+		status = -1;
+		CHECK(xbee.xbee_try_send_to_node(msg, "unknown", [&](uint8_t s) { status = s; }) ==
+			XBEE_ADDRESS_UNKNOWN);
+		while (status < 0 && now_ms() - start < 10000)
+			xbee.xbee_poll(10);
+		CHECK(status == GBEE_TIMEOUT_ERROR);
+	}
+}
+
+#define MPSC_PRODUCER_CNT 4
+#define MPSC_NODE_CNT 2000
+#define MPSC_SUBMIT_CNT 20
+
+class Mpsc_Test_Node : public XBee_Queue_Node {
+public:
+	int producer;
+	int seq;
+};
+
+/* producers push concurrently while the consumer pops: every node arrives
+ * once, in the order of its producer */
+static void test_mpsc_queue() {
+	XBee_Mpsc_Queue<Mpsc_Test_Node> queue;
+	std::vector<Mpsc_Test_Node> nodes(MPSC_PRODUCER_CNT * MPSC_NODE_CNT);
+	std::vector<std::thread> producers;
+	int last[MPSC_PRODUCER_CNT];
+	int received = 0;
+	int wrong = 0;
+	uint64_t start = now_ms();
+
+	for (int p = 0; p < MPSC_PRODUCER_CNT; p++) {
+		last[p] = -1;
+		producers.push_back(std::thread([&queue, &nodes, p]() {
+			for (int i = 0; i < MPSC_NODE_CNT; i++) {
+				Mpsc_Test_Node *node = &nodes[p * MPSC_NODE_CNT + i];
+				node->producer = p;
+				node->seq = i;
+				queue.push(node);
+			}
+		}));
+	}
+	while (received < MPSC_PRODUCER_CNT * MPSC_NODE_CNT && now_ms() - start < 10000) {
+		Mpsc_Test_Node *node = queue.pop();
+		if (!node) {
+			std::this_thread::yield();
+			continue;
+		}
+		if (node->seq != last[node->producer] + 1)
+			wrong++;
+		last[node->producer] = node->seq;
+		received++;
+	}
+	for (size_t i = 0; i < producers.size(); i++)
+		producers[i].join();
+	CHECK(received == MPSC_PRODUCER_CNT * MPSC_NODE_CNT);
+	CHECK(wrong == 0);
+	CHECK(queue.pop() == NULL);
+}
+
+/* AT commands submitted from several threads are started by the thread
+ * polling the interface, in the order of each producer. Without a radio
+ * every command fails right away. More commands are submitted than the
+ * submission pool of the heap-free build holds */
+static void test_submissions() {
+	uint8_t pan_id[8] = {0};
+	XBee_Config config("", "unit_test", true, 0, pan_id, 500, B115200, 1);
+	std::vector<XBee_At_Command> cmds(MPSC_PRODUCER_CNT * MPSC_SUBMIT_CNT,
+		XBee_At_Command("CH"));
+	std::vector<std::thread> producers;
+	int last[MPSC_PRODUCER_CNT];
+	int completed = 0;
+	int wrong = 0;
+	uint64_t start;
+
+	config.thread_safe = true;
+	XBee xbee(config);
+
+	for (int p = 0; p < MPSC_PRODUCER_CNT; p++) {
+		last[p] = -1;
+		producers.push_back(std::thread([&, p]() {
+			for (int i = 0; i < MPSC_SUBMIT_CNT; i++) {
+				xbee.xbee_submit_at_command(cmds[p * MPSC_SUBMIT_CNT + i],
+				[&, p, i](uint8_t status) {
+					if (i != last[p] + 1 || status == GBEE_NO_ERROR)
+						wrong++;
+					last[p] = i;
+					completed++;
+				});
+			}
+		}));
+	}
+	start = now_ms();
+	while (completed < MPSC_PRODUCER_CNT * MPSC_SUBMIT_CNT && now_ms() - start < 10000)
+		xbee.xbee_poll(10);
+	for (size_t i = 0; i < producers.size(); i++)
+		producers[i].join();
+	CHECK(completed == MPSC_PRODUCER_CNT * MPSC_SUBMIT_CNT);
+	CHECK(wrong == 0);
+}
+
+/* route record of the node 0013a200 01020304 / 1234 over two hops */
+static const uint8_t route_record[] = {
+	XBEE_ROUTE_RECORD, 0x00, 0x13, 0xA2, 0x00, 0x01, 0x02, 0x03, 0x04,
+	0x12, 0x34, 0x01, 0x02, 0xAA, 0xBB, 0xCC, 0xDD
+};
+
+/* route records are parsed into the create source route frame with the
+ * hops in the order of the record. Malformed records are rejected, and
+ * routes that are too long only keep their hop count */
+static void test_source_route() {
+	const uint8_t expected[] = {
+		XBEE_CREATE_SOURCE_ROUTE, 0x00, 0x00, 0x13, 0xA2, 0x00, 0x01, 0x02,
+		0x03, 0x04, 0x12, 0x34, 0x00, 0x02, 0xAA, 0xBB, 0xCC, 0xDD
+	};
+	uint8_t record[13 + 2 * (XBEE_ROUTE_MAX_HOPS + 1)];
+	uint8_t frame[XBEE_SOURCE_ROUTE_LENGTH];
+	XBee_Route route;
+	XBee_Route other;
+
+	/* the frame data follows the frame type */
+	CHECK(route.parse_record(&route_record[1], sizeof(route_record)));
+	CHECK(route.addr64h == 0x0013A200 && route.addr64l == 0x01020304);
+	CHECK(route.addr16 == 0x1234 && route.hop_cnt == 2);
+	CHECK(route.get_frame(frame) == sizeof(expected));
+	CHECK(memcmp(frame, expected, sizeof(expected)) == 0);
+
+	/* a record of the same route doesn't change it, a different hop does */
+	CHECK(other.parse_record(&route_record[1], sizeof(route_record)));
+	CHECK(route.same_route(other));
+	other.hops[1] = 0xCCDE;
+	CHECK(!route.same_route(other));
+
+	/* cut off in the header or in the hops */
+	CHECK(!other.parse_record(&route_record[1], 12));
+	CHECK(!other.parse_record(&route_record[1], sizeof(route_record) - 1));
+
+	memset(record, 0, sizeof(record));
+	memcpy(record, &route_record[1], 11);
+	record[11] = XBEE_ROUTE_MAX_HOPS + 1;
+	CHECK(other.parse_record(record, sizeof(record) + 1));
+	CHECK(other.hop_cnt == XBEE_ROUTE_MAX_HOPS + 1);
+}
+
+/* route records pass through the receive path of a replay between the
+ * messages of the node, malformed ones are dropped on their own */
+static void test_route_record_replay(XBee &xbee) {
+	Capture_Writer capture;
+	XBee_Replay_Stats stats;
+	int messages = 0;
+
+	add_small_part(capture, 1, 1, 1, 0x01020304);
+	capture.add_frame(route_record, sizeof(route_record));
+	capture.add_frame(route_record, 10);
+	add_small_part(capture, 2, 1, 1, 0x01020304);
+	CHECK(capture.fd >= 0);
+	CHECK(xbee.xbee_replay_capture(capture.path, [&](XBee_Message *msg) {
+		messages++;
+		delete msg;
+	}, &stats) == 4);
+	CHECK(stats.skipped == 0);
+	CHECK(messages == 2);
+}
+
+#define SPSC_RING_SIZE 16
+#define SPSC_ITEM_CNT 100000
+
+/* the ring holds SIZE items, and passes items from the producer thread to
+ * the consumer thread in order */
+static void test_spsc_ring() {
+	XBee_Spsc_Ring<uint32_t, SPSC_RING_SIZE> ring;
+	uint32_t item = 0;
+	uint32_t expected = 0;
+	std::atomic<bool> stop(false);
+	int wrong = 0;
+	uint64_t start;
+
+	CHECK(!ring.pop(&item));
+	for (uint32_t i = 0; i < SPSC_RING_SIZE; i++)
+		CHECK(ring.push(i));
+	CHECK(!ring.push(SPSC_RING_SIZE));
+	CHECK(ring.size() == SPSC_RING_SIZE);
+	for (uint32_t i = 0; i < SPSC_RING_SIZE; i++)
+		CHECK(ring.pop(&item) && item == i);
+	CHECK(!ring.pop(&item));
+	CHECK(ring.size() == 0);
+
+	/* the indices wrap around the slots many times. Both sides yield, the
+	 * test may run on a single core */
+	std::thread producer([&ring, &stop]() {
+		for (uint32_t i = 0; i < SPSC_ITEM_CNT && !stop.load(); i++) {
+			while (!ring.push(i) && !stop.load())
+				std::this_thread::yield();
+		}
+	});
+	start = now_ms();
+	while (expected < SPSC_ITEM_CNT && now_ms() - start < 10000) {
+		if (!ring.pop(&item)) {
+			std::this_thread::yield();
+			continue;
+		}
+		if (item != expected)
+			wrong++;
+		expected = item + 1;
+	}
+	stop.store(true);
+	producer.join();
+	CHECK(expected == SPSC_ITEM_CNT);
+	CHECK(wrong == 0);
+}
+
+/* pools are started once per type within the worker limit, report the
+ * stats of their own workers only, and can be started again after they
+ * were stopped. The heap-free build refuses them */
+static void test_worker_pools() {
+	uint8_t pan_id[8] = {0};
+	XBee_Config config("", "unit_test", true, 0, pan_id, 500, B115200, 1);
+	XBee xbee(config);
+	xbee_message_cb handler = [](XBee_Message *msg) { delete msg; };
+	XBee_Worker_Stats stats;
+
+#ifdef XBEE_STATIC_ALLOC
+	CHECK(!xbee.xbee_start_workers(DATA, 1, handler));
+	CHECK(!xbee.xbee_get_worker_stats(DATA, 0, &stats));
+#else
+	CHECK(!xbee.xbee_start_workers(DATA, 0, handler));
+	CHECK(!xbee.xbee_start_workers((enum xbee_msg_type) XBEE_RX_POOL_CNT, 1, handler));
+	CHECK(xbee.xbee_start_workers(DATA, 2, handler));
+	CHECK(!xbee.xbee_start_workers(DATA, 1, handler));
+	CHECK(!xbee.xbee_start_workers(CONFIG, XBEE_RX_WORKER_MAX - 1, handler));
+	CHECK(xbee.xbee_start_workers(CONFIG, XBEE_RX_WORKER_MAX - 2, handler));
+
+	CHECK(xbee.xbee_get_worker_stats(DATA, 1, &stats));
+	CHECK(stats.depth == 0 && stats.processed == 0 && stats.drops == 0);
+	CHECK(!xbee.xbee_get_worker_stats(DATA, 2, &stats));
+	CHECK(!xbee.xbee_get_worker_stats(TEST, 0, &stats));
+
+	xbee.xbee_stop_workers();
+	CHECK(!xbee.xbee_get_worker_stats(DATA, 0, &stats));
+	CHECK(xbee.xbee_start_workers(TEST, XBEE_RX_WORKER_MAX, handler));
+	CHECK(xbee.xbee_get_worker_stats(TEST, XBEE_RX_WORKER_MAX - 1, &stats));
+#endif
+}
+
+#define CHANNEL_PART_SIZE 50
+#define CHANNEL_PART_CNT 3
+
+/* an explicit rx frame with a message part for the endpoint and cluster
+ * from the source with the lower 32 bits of the 64-bit address */
+static void add_explicit_part(Capture_Writer &capture, uint8_t endpoint, uint16_t cluster,
+		uint32_t source, uint8_t part, uint8_t cnt, const uint8_t *payload, uint8_t length) {
+	uint8_t frame[1 + XBEE_EXPLICIT_RX_HEADER + MSG_HEADER_LENGTH + CHANNEL_PART_SIZE];
+	uint8_t *data = &frame[1];
+	uint8_t *header = &data[XBEE_EXPLICIT_RX_HEADER];
+
+	memset(frame, 0, sizeof(frame));
+	frame[0] = XBEE_EXPLICIT_RX;
+	for (int i = 0; i <= 3; i++)
+		data[i+4] = source >> (3-i)*8;
+	data[10] = endpoint;
+	data[11] = endpoint;
+	data[12] = cluster >> 8;
+	data[13] = cluster;
+	data[14] = XBEE_DIGI_PROFILE >> 8;
+	data[15] = XBEE_DIGI_PROFILE & 0xFF;
+	header[MSG_TYPE] = DATA;
+	header[MSG_PART] = part;
+	header[MSG_PART_CNT] = cnt;
+	header[MSG_SEQ + 1] = 1;
+	header[MSG_PAYLOAD_LENGTH] = length;
+	memcpy(&header[MSG_HEADER_LENGTH], payload, length);
+	capture.add_frame(frame, 1 + XBEE_EXPLICIT_RX_HEADER + MSG_HEADER_LENGTH + length);
+}
+
+/* the parts of messages on a channel are reassembled per source and
+ * separately from the default stream, which the data endpoint of explicit
+ * frames leads to. Frames for unknown channels are dropped on their own.
+ * The replay passes the messages on channels to its handler */
+static void test_channel_dispatch() {
+	uint8_t pan_id[8] = {0};
+	XBee_Config config("", "unit_test", true, 0, pan_id, 500, B115200, 1);
+	XBee xbee(config);
+	xbee_message_cb handler = [](XBee_Message *msg) { delete msg; };
+	uint8_t payload[CHANNEL_PART_SIZE * CHANNEL_PART_CNT];
+	uint8_t channel;
+	int channel_msgs;
+	int default_msgs;
+	int wrong;
+
+	/* the ZDO and the endpoints reserved by Digi aren't available */
+	CHECK(xbee.xbee_open_channel(0, 0x0100, 1, handler) == XBEE_NO_CHANNEL);
+	CHECK(xbee.xbee_open_channel(XBEE_DATA_ENDPOINT, 0x0100, 1, handler) == XBEE_NO_CHANNEL);
+	CHECK(xbee.xbee_open_channel(0x10, 0x0100, 1, nullptr) == XBEE_NO_CHANNEL);
+	channel = xbee.xbee_open_channel(0x10, 0x0100, 2, [](XBee_Message *msg) {
+		/* the replay doesn't call the channel handlers */
+		CHECK(false);
+		delete msg;
+	});
+	CHECK(channel != XBEE_NO_CHANNEL);
+	CHECK(xbee.xbee_open_channel(0x10, 0x0100, 1, handler) == XBEE_NO_CHANNEL);
+
+	for (int i = 0; i < (int) sizeof(payload); i++)
+		payload[i] = i;
+	for (int round = 0; round < 2; round++) {
+		Capture_Writer capture;
+
+		/* the parts of two sources interleave with the default stream
+		 * and a channel that isn't open */
+		for (uint8_t part = 1; part <= CHANNEL_PART_CNT; part++) {
+			const uint8_t *data = &payload[(part - 1) * CHANNEL_PART_SIZE];
+			add_explicit_part(capture, 0x10, 0x0100, 1, part, CHANNEL_PART_CNT, data,
+				CHANNEL_PART_SIZE);
+			add_explicit_part(capture, 0x11, 0x0100, 1, part, CHANNEL_PART_CNT, data,
+				CHANNEL_PART_SIZE);
+			add_explicit_part(capture, XBEE_DATA_ENDPOINT, XBEE_DATA_CLUSTER, 3, 1, 1,
+				data, 1);
+			add_explicit_part(capture, 0x10, 0x0100, 2, part, CHANNEL_PART_CNT, data,
+				CHANNEL_PART_SIZE);
+		}
+		CHECK(capture.fd >= 0);
+		channel_msgs = 0;
+		default_msgs = 0;
+		wrong = 0;
+		xbee.xbee_replay_capture(capture.path, [&](XBee_Message *msg) {
+			uint16_t length;
+			uint8_t *data = msg->get_payload(&length);
+
+			if (length == sizeof(payload)) {
+				channel_msgs++;
+				wrong += memcmp(data, payload, length) != 0;
+			} else {
+				default_msgs++;
+				wrong += msg->get_source()->addr64l != 3;
+			}
+			delete msg;
+		}, NULL);
+		/* the default stream messages share their number, the
+		 * repeats are duplicates */
+		CHECK(default_msgs == 1);
+		CHECK(wrong == 0);
+		if (round == 0) {
+			CHECK(channel_msgs == 2);
+			/* frames of a closed channel are dropped */
+			xbee.xbee_close_channel(channel);
+		} else {
+			CHECK(channel_msgs == 0);
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	uint8_t pan_id[8] = {0};
+	/* the interface isn't initialized, no serial port is opened */
+	XBee_Config config("", "unit_test", true, 0, pan_id, 500, B115200, 1);
+	XBee xbee(config);
+
+	test_timer_next_round();
+	test_timer_cascade();
+	test_dedup_window();
+	test_dedup_reorder();
+	test_dedup_sync();
+	test_parity_rebuild(xbee);
+	test_reassembly_retransmit(xbee);
+	test_coalesced_split(xbee);
+	test_schema_round_trip(xbee);
+	test_remote_at_batch(XBEE_REMOTE_AT_WINDOW);
+	test_remote_at_batch(0);
+	test_remote_at_batch(255);
+	test_tx_queue();
+	test_mpsc_queue();
+	test_submissions();
+	test_source_route();
+	test_route_record_replay(xbee);
+	test_spsc_ring();
+	test_worker_pools();
+	test_channel_dispatch();
+
+	printf("%d checks, %d failed\n", checks, failed);
+	return failed;
+}
@@ -0,0 +1,214 @@
+/* This file is part of Equine Monitor
+ *
+ * Equine Monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Equine Monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Equine Monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Konke Radlow <koradlow@gmail.com>
+ */
+
+/* awaitable versions of the XBee operations for C++20 coroutines. They are
+ * built on the asynchronous functions of the XBee class, so the coroutines
+ * are resumed from within XBee::xbee_poll. A single thread that keeps
+ * polling the interface can drive any number of coroutines:
+ *
+ *	XBee_Task conversation(XBee &xbee, std::string node) {
+ *		XBee_Message request(CONFIG, data, length);
+ *		if (co_await xbee_co_send_to_node(xbee, request, node) != 0x00)
+ *			co_return;
+ *		XBee_Address addr;
+ *		if (!co_await xbee_co_get_address(xbee, node, &addr))
+ *			co_return;
+ *		XBee_Message *reply = co_await xbee_co_receive(xbee, &addr, 1000);
+ *		...
+ *	}
+ *
+ * The awaits may be started from any thread if the interface is thread
+ * safe. This header requires -std=c++20, the library itself doesn't, see
+ * the coro_check target of the makefile */
+
+#ifndef XBEE_CORO
+#define XBEE_CORO
+
+#include "xbee_if.h"
+#include <atomic>
+#include <coroutine>
+#include <exception>
+
+/* return type for coroutines that are started and left running on their
+ * own, the coroutine frame is freed when the coroutine finishes */
+class XBee_Task {
+public:
+	class promise_type {
+	public:
+		XBee_Task get_return_object() { return XBee_Task(); }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+/* common part of the awaitables: the operation is started when the
+ * coroutine suspends, and its completion callback resumes the coroutine.
+ * Operations that complete right away don't suspend the coroutine */
+template <typename T>
+class XBee_Awaitable {
+public:
+	XBee_Awaitable(XBee &xbee) :
+		xbee(xbee),
+		result(),
+		state(STARTING)
+	{}
+	virtual ~XBee_Awaitable() {}
+
+	bool await_ready() { return false; }
+	bool await_suspend(std::coroutine_handle<> handle) {
+		this->handle = handle;
+		state = STARTING;
+		start();
+		/* after the exchange the coroutine may already run on the
+		 * polling thread, the awaitable isn't touched anymore */
+		return state.exchange(SUSPENDED) != DONE;
+	}
+	T await_resume() { return result; }
+
+protected:
+	virtual void start() = 0;
+	void complete(T value) {
+		result = value;
+		if (state.exchange(DONE) == SUSPENDED)
+			handle.resume();
+	}
+
+	XBee &xbee;
+private:
+	/* with XBee_Config::thread_safe the callback may run on the polling
+	 * thread while await_suspend is still running, whichever of them
+	 * comes second resumes the coroutine */
+	enum { STARTING, SUSPENDED, DONE };
+
+	std::coroutine_handle<> handle;
+	T result;
+	std::atomic<uint8_t> state;
+};
+
+/* resumes with the transmission status (0x00 = success) */
+class XBee_Send_Awaitable : public XBee_Awaitable<uint8_t> {
+public:
+	XBee_Send_Awaitable(XBee &xbee, XBee_Message &msg, const std::string *node) :
+		XBee_Awaitable<uint8_t>(xbee),
+		msg(msg),
+		node(node ? *node : ""),
+		to_coordinator(node == NULL)
+	{}
+protected:
+	void start() {
+		xbee_status_cb callback = xbee_small_cb([this](uint8_t status) {
+			complete(status);
+		});
+		if (to_coordinator)
+			xbee.xbee_send_to_coordinator_async(msg, callback);
+		else
+			xbee.xbee_send_to_node_async(msg, node, callback);
+	}
+private:
+	XBee_Message &msg;
+	std::string node;
+	bool to_coordinator;
+};
+
+/* resumes with GBEE_NO_ERROR once the response is stored in the command */
+class XBee_At_Awaitable : public XBee_Awaitable<uint8_t> {
+public:
+	XBee_At_Awaitable(XBee &xbee, XBee_At_Command &cmd) :
+		XBee_Awaitable<uint8_t>(xbee),
+		cmd(cmd)
+	{}
+protected:
+	void start() {
+		xbee.xbee_send_at_command_async(cmd, xbee_small_cb([this](uint8_t status) {
+			complete(status);
+		}));
+	}
+private:
+	XBee_At_Command &cmd;
+};
+
+/* resumes with the received message, which is owned by the coroutine, or
+ * NULL after the timeout */
+class XBee_Receive_Awaitable : public XBee_Awaitable<XBee_Message*> {
+public:
+	XBee_Receive_Awaitable(XBee &xbee, const XBee_Address *source, uint32_t timeout) :
+		XBee_Awaitable<XBee_Message*>(xbee),
+		any_source(source == NULL),
+		source(source ? *source : XBee_Address()),
+		timeout(timeout)
+	{}
+protected:
+	void start() {
+		xbee.xbee_receive_message_async(any_source ? NULL : &source, timeout,
+		xbee_small_cb([this](XBee_Message *msg) { complete(msg); }));
+	}
+private:
+	bool any_source;
+	XBee_Address source;
+	uint32_t timeout;
+};
+
+/* copies the address of the node to addr, and resumes with false if the
+ * node couldn't be found */
+class XBee_Address_Awaitable : public XBee_Awaitable<bool> {
+public:
+	XBee_Address_Awaitable(XBee &xbee, const std::string &node, XBee_Address *addr) :
+		XBee_Awaitable<bool>(xbee),
+		node(node),
+		addr(addr)
+	{}
+protected:
+	void start() {
+		xbee.xbee_get_address_async(node, xbee_small_cb([this](const XBee_Address *found) {
+			if (found)
+				*addr = *found;
+			complete(found != NULL);
+		}));
+	}
+private:
+	std::string node;
+	XBee_Address *addr;
+};
+
+inline XBee_Send_Awaitable xbee_co_send_to_coordinator(XBee &xbee, XBee_Message &msg) {
+	return XBee_Send_Awaitable(xbee, msg, NULL);
+}
+
+inline XBee_Send_Awaitable xbee_co_send_to_node(XBee &xbee, XBee_Message &msg,
+		const std::string &node) {
+	return XBee_Send_Awaitable(xbee, msg, &node);
+}
+
+inline XBee_At_Awaitable xbee_co_send_at_command(XBee &xbee, XBee_At_Command &cmd) {
+	return XBee_At_Awaitable(xbee, cmd);
+}
+
+/* source = NULL accepts messages from all nodes, timeout = 0 waits forever */
+inline XBee_Receive_Awaitable xbee_co_receive(XBee &xbee, const XBee_Address *source,
+		uint32_t timeout) {
+	return XBee_Receive_Awaitable(xbee, source, timeout);
+}
+
+inline XBee_Address_Awaitable xbee_co_get_address(XBee &xbee, const std::string &node,
+		XBee_Address *addr) {
+	return XBee_Address_Awaitable(xbee, node, addr);
+}
+
+#endif
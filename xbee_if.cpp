@@ -20,8 +20,92 @@
 #include <gbee.h>
 #include <gbee-util.h>
 #include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <new>
+#include <type_traits>
 
+/* returns a monotonic timestamp in ms, used for deadlines */
+static uint64_t xbee_time_ms() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* locks the interface for the lifetime of the object in thread-safe mode.
+ * The lock is recursive, so public functions can call each other */
+class XBee_Guard {
+public:
+	XBee_Guard(std::recursive_mutex &lock, bool enabled) :
+		lock(lock),
+		enabled(enabled)
+	{
+		if (enabled)
+			lock.lock();
+	}
+	~XBee_Guard() {
+		if (enabled)
+			lock.unlock();
+	}
+private:
+	std::recursive_mutex &lock;
+	bool enabled;
+};
+
+/* returns a monotonic timestamp in ns, used for frame captures */
+static uint64_t xbee_time_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* XORs len bytes of src into dst, used for the parity parts. The bytes are
+ * processed 16 at a time with the vector extension of the compiler, the
+ * buffers don't have to be aligned */
+typedef uint8_t xbee_vec __attribute__((vector_size(16)));
+
+static inline void xbee_xor(uint8_t *dst, const uint8_t *src, uint16_t len) {
+	xbee_vec a, b;
+	uint16_t i = 0;
+
+	for (; i + sizeof(xbee_vec) <= len; i += sizeof(xbee_vec)) {
+		memcpy(&a, &dst[i], sizeof(a));
+		memcpy(&b, &src[i], sizeof(b));
+		a ^= b;
+		memcpy(&dst[i], &a, sizeof(a));
+	}
+	for (; i < len; i++)
+		dst[i] ^= src[i];
+}
+
+/* bitmaps of parts, part numbers start with 1 */
+static inline bool xbee_test_part(const uint64_t *mask, uint16_t part) {
+	return mask[(part - 1) / 64] & ((uint64_t)1 << ((part - 1) % 64));
+}
+
+static inline void xbee_mark_part(uint64_t *mask, uint16_t part) {
+	mask[(part - 1) / 64] |= (uint64_t)1 << ((part - 1) % 64);
+}
+
+/* returns the number of parts of the given size needed for the payload. A
+ * payload that fills its last part exactly doesn't get an empty part after
+ * it, an empty payload is still sent in one part */
+static inline uint16_t xbee_part_count(uint16_t length, uint16_t size) {
+	if (length == 0)
+		return 1;
+	return (length + size - 1) / size;
+}
+
+/* compares the network addresses of two address objects */
+static bool xbee_same_address(const XBee_Address *a, const XBee_Address *b) {
+	return a->addr64h == b->addr64h && a->addr64l == b->addr64l &&
+		a->addr16 == b->addr16;
+}
 
 /** XBee_Address Class implementation */
 /* default constructor of XBee_Address, creating an empty object */
@@ -33,7 +117,7 @@ XBee_Address::XBee_Address() :
 {}
 
 /* constructor of XBee_Address */
-XBee_Address::XBee_Address(const std::string &node, uint16_t addr16, uint32_t addr64h, uint32_t addr64l) :
+XBee_Address::XBee_Address(const xbee_string &node, uint16_t addr16, uint32_t addr64h, uint32_t addr64l) :
 	node(""),
 	addr16(addr16),
 	addr64h(addr64h),
@@ -50,7 +134,7 @@ XBee_Address::XBee_Address(const GBeeRxPacket *rx) :
 
 /* constructor that decodes the data returned as an reply to the AT "DN"
  * command by an XBee device */
-XBee_Address::XBee_Address(const std::string &node, const uint8_t *payload) :
+XBee_Address::XBee_Address(const xbee_string &node, const uint8_t *payload) :
 	node(node),
 	addr16(0),
 	addr64h(0),
@@ -72,7 +156,7 @@ XBee_Address::XBee_Address(const std::string &node, const uint8_t *payload) :
 /* constructor of the XBee_config class, which is used to provide access
  * to configuration options. It is a raw data container at the moment */
  /* TODO: find a good way to set baud rate for xbees */ 
-XBee_Config::XBee_Config(const std::string &port, const std::string &node, bool mode, 
+XBee_Config::XBee_Config(const xbee_path &port, const xbee_string &node, bool mode, 
 			uint8_t unique_id, const uint8_t *pan, uint32_t timeout,
 			enum xbee_baud_rate baud, uint8_t max_unicast_hops):
 		serial_port(port),
@@ -81,7 +165,19 @@ XBee_Config::XBee_Config(const std::string &port, const std::string &node, bool
 		unique_id(unique_id),
 		timeout(timeout),
 		baud(baud),
-		max_unicast_hops(max_unicast_hops)
+		max_unicast_hops(max_unicast_hops),
+		coalesce_delay(0),	/* coalescing is opt-in */
+		hw_flow_control(false),
+		thread_safe(false),
+		discovery_interval(0),	/* addresses are resolved on demand */
+		many_to_one_interval(0xFF),
+		store_and_forward(false),
+		hold_time(60000),
+		explicit_rx(false),
+		fec_group(0),		/* no parity parts */
+		fec_parity(1),
+		queue_timeout(5000),
+		remote_at_window(XBEE_REMOTE_AT_WINDOW)
 {
 	memcpy(pan_id, pan, 8);
 }
@@ -89,29 +185,29 @@ XBee_Config::XBee_Config(const std::string &port, const std::string &node, bool
 /** XBee_At_Command Class implementation */
 /* constructs a XBee_At_Command object, by copying the given values into
  * an internal memory space */
-XBee_At_Command::XBee_At_Command(const std::string &command, const uint8_t *cmd_data, uint8_t cmd_length) :
+XBee_At_Command::XBee_At_Command(const xbee_string &command, const uint8_t *cmd_data, uint8_t cmd_length) :
 		at_command(command),
 		length(cmd_length),
 		status(0x00)
 {
-	data = new uint8_t[cmd_length];
-	memcpy(data, cmd_data, cmd_length);
+	data = allocate_data(&length);
+	memcpy(data, cmd_data, length);
 }
 
 /* constructs a XBee_At_Command object, by translating the command string into
  * a byte array and copying it an internal memory space */
-XBee_At_Command::XBee_At_Command(const std::string &command, const std::string &cmd_data) :
+XBee_At_Command::XBee_At_Command(const xbee_string &command, const xbee_string &cmd_data) :
 		at_command(command),
 		length(cmd_data.length()),
 		status(0x00)
 {
-	data = new uint8_t[length];
+	data = allocate_data(&length);
 	memcpy(data, cmd_data.c_str(), length);
 }
 
 /* constructs a XBee_At_Command object that is empty except for the actual
  * AT command, and can be used to request values */
-XBee_At_Command::XBee_At_Command(const std::string &command) :
+XBee_At_Command::XBee_At_Command(const xbee_string &command) :
 		at_command(command),
 		data(NULL),
 		length(0),
@@ -124,63 +220,552 @@ XBee_At_Command::XBee_At_Command(const XBee_At_Command &cmd) :
 		length(cmd.length),
 		status(cmd.status)
 {
-	data = new uint8_t[length];
-	memcpy(data, cmd.data, length);
+	data = allocate_data(&length);
+	/* commands without a value have no data to copy */
+	if (length > 0)
+		memcpy(data, cmd.data, length);
 }
 
 /* assignment operator, performs deep copy for pointer members */
 XBee_At_Command& XBee_At_Command::operator=(const XBee_At_Command &cmd) {
+	if (this == &cmd)
+		return *this;
 	at_command = cmd.at_command;
 	length = cmd.length;
 	status = cmd.status;
 
 	/* free locally allocated memory, and copy memory content from cmd.data
 	 * address into new allocated memory space */
-	if (data)
-		delete[] data;
-	data = new uint8_t[length];
-	memcpy(data, cmd.data, length);
+	free_data();
+	data = allocate_data(&length);
+	if (length > 0)
+		memcpy(data, cmd.data, length);
 
 	return *this;
 }
 
 XBee_At_Command::~XBee_At_Command() {
+	free_data();
+}
+
+#ifdef XBEE_STATIC_ALLOC
+static XBee_Pool<XBee_At_Command, XBEE_AT_POOL_SIZE> xbee_at_pool;
+
+void* XBee_At_Command::operator new(size_t size) noexcept {
+	void *ptr = xbee_at_pool.alloc();
+	if (!ptr)
+		printf("Error: AT command pool exhausted\n");
+	return ptr;
+}
+
+void XBee_At_Command::operator delete(void *ptr) {
+	xbee_at_pool.release(ptr);
+}
+#endif
+
+/* allocates memory for the data. In the heap-free build the data is stored
+ * in the object, longer data is cut off */
+uint8_t* XBee_At_Command::allocate_data(uint8_t *length) {
+#ifdef XBEE_STATIC_ALLOC
+	if (*length > XBEE_AT_DATA_SIZE) {
+		printf("Error: AT data > %u bytes not supported\n", XBEE_AT_DATA_SIZE);
+		*length = XBEE_AT_DATA_SIZE;
+	}
+	return data_store;
+#else
+	return new uint8_t[*length];
+#endif
+}
+
+void XBee_At_Command::free_data() {
+#ifndef XBEE_STATIC_ALLOC
 	if (data)
 		delete[] data;
+#endif
+	data = NULL;
 }
 
 /* frees the memory space allocated for the data, and copies the given 
  * data into the object by allocating new memory space */
 void XBee_At_Command::set_data(const uint8_t *cmd_data, uint8_t cmd_length, uint8_t cmd_status) {
-	if (data)
-		delete[] data;
+	free_data();
 	length = cmd_length;
-	data = new uint8_t[cmd_length];
-	memcpy(data, cmd_data, cmd_length);
+	data = allocate_data(&length);
+	memcpy(data, cmd_data, length);
 	status = cmd_status; 
 }
 
 /* appends the data chunk to the existing memory space in the object.
  * This is used for AT commands with a multi frame reply */
 void XBee_At_Command::append_data(const uint8_t *new_data, uint8_t cmd_length, uint8_t cmd_status) {
-	uint8_t *old_data = data;
-	
 	status = cmd_status;
+#ifdef XBEE_STATIC_ALLOC
+	/* the data grows in place */
+	if (length + cmd_length > XBEE_AT_DATA_SIZE) {
+		printf("Error: AT data > %u bytes not supported\n", XBEE_AT_DATA_SIZE);
+		cmd_length = XBEE_AT_DATA_SIZE - length;
+	}
+	data = data_store;
+#else
+	uint8_t *old_data = data;
+
 	/* allocate new memory, big enough to contain the existing data and
 	 * the additional new data, and copy the old data to the new memory space */
 	data = new uint8_t[length + cmd_length];
 	memcpy(data, old_data, length);
+#endif
 
 	/* append the new_data to the existing data, and update the length
 	 * of the data field */
 	memcpy(&data[length], new_data, cmd_length);
 	length += cmd_length;
 
+#ifndef XBEE_STATIC_ALLOC
 	/* free the old memory space */
 	if (old_data)
 		delete[] old_data;
+#endif
+}
+
+/** XBee_Coalesce_Buffer Class implementation */
+/* constructs an empty buffer, that is not assigned to a destination */
+XBee_Coalesce_Buffer::XBee_Coalesce_Buffer() :
+		length(0),
+		msg_cnt(0)
+{}
+
+/** XBee_Tx_Entry Class implementation */
+/* constructs a free slot of the transmit queue */
+XBee_Tx_Entry::XBee_Tx_Entry() :
+		msg(NULL),
+		state(TX_FREE),
+		seq(0),
+		part(1),
+		frame_id(0),
+		retry_cnt(0),
+		tx_status(0xFF),
+		detached(false),
+		channel(XBEE_NO_CHANNEL)
+{
+	memset(fec_lost, 0, sizeof(fec_lost));
+}
+
+/** XBee_At_Request Class implementation */
+/* constructs a free slot for a pending AT command */
+XBee_At_Request::XBee_At_Request() :
+		used(false),
+		cmd(NULL),
+		frame_id(0),
+		multi(false),
+		remote(false),
+		response_cnt(0)
+{}
+
+/** XBee_Rx_Waiter Class implementation */
+XBee_Rx_Waiter::XBee_Rx_Waiter() :
+		used(false),
+		any_source(true)
+{}
+
+/** XBee_Wait_Entry Class implementation */
+XBee_Wait_Entry::XBee_Wait_Entry(enum xbee_wait_type type) :
+		type(type),
+		msg(NULL),
+		any_addr(true),
+		channel(XBEE_NO_CHANNEL),
+		cmd(NULL),
+		options(0),
+		timeout(0)
+{}
+
+XBee_Wait_Entry::~XBee_Wait_Entry() {
+	if (msg)
+		delete msg;
+}
+
+#ifdef XBEE_STATIC_ALLOC
+static XBee_Pool<XBee_Wait_Entry, XBEE_WAIT_POOL_SIZE> xbee_wait_pool;
+
+void* XBee_Wait_Entry::operator new(size_t size) noexcept {
+	void *ptr = xbee_wait_pool.alloc();
+	if (!ptr)
+		printf("Error: wait pool exhausted\n");
+	return ptr;
+}
+
+void XBee_Wait_Entry::operator delete(void *ptr) {
+	xbee_wait_pool.release(ptr);
+}
+#endif
+
+/** XBee_Address_Lookup Class implementation */
+XBee_Address_Lookup::XBee_Address_Lookup(const xbee_string &node,
+		xbee_address_cb callback) :
+		cmd("DN", node),
+		node(node),
+		callback(callback)
+{}
+
+#ifdef XBEE_STATIC_ALLOC
+static XBee_Pool<XBee_Address_Lookup, XBEE_LOOKUP_POOL_SIZE> xbee_lookup_pool;
+
+void* XBee_Address_Lookup::operator new(size_t size) noexcept {
+	void *ptr = xbee_lookup_pool.alloc();
+	if (!ptr)
+		printf("Error: address lookup pool exhausted\n");
+	return ptr;
+}
+
+void XBee_Address_Lookup::operator delete(void *ptr) {
+	xbee_lookup_pool.release(ptr);
+}
+#endif
+
+/** XBee_Send_Request Class implementation */
+XBee_Send_Request::XBee_Send_Request(uint8_t channel, xbee_status_cb callback) :
+		msg(NULL),
+		channel(channel),
+		callback(callback)
+{}
+
+XBee_Send_Request::~XBee_Send_Request() {
+	if (msg)
+		delete msg;
+}
+
+#ifdef XBEE_STATIC_ALLOC
+static XBee_Pool<XBee_Send_Request, XBEE_SEND_POOL_SIZE> xbee_send_pool;
+
+void* XBee_Send_Request::operator new(size_t size) noexcept {
+	void *ptr = xbee_send_pool.alloc();
+	if (!ptr)
+		printf("Error: send request pool exhausted\n");
+	return ptr;
+}
+
+void XBee_Send_Request::operator delete(void *ptr) {
+	xbee_send_pool.release(ptr);
+}
+#endif
+
+/** XBee_At_Batch Class implementation */
+XBee_At_Batch::XBee_At_Batch(XBee_At_Command *cmds, const XBee_Address *addrs,
+		uint16_t cnt) :
+		cmds(cmds),
+		addrs(addrs),
+		cnt(cnt),
+		in_flight(0),
+		done(0)
+{}
+
+/* marks all commands for the node as failed, the node starts with the
+ * command at index node */
+void XBee_At_Batch::fail_node(uint16_t node) {
+	for (uint16_t j = node; j < cnt; j++) {
+		if (xbee_same_address(&addrs[j], &addrs[node]))
+			cmds[j].status = XBEE_AT_TX_FAILURE;
+	}
+}
+
+/** XBee_Apply_Request Class implementation */
+XBee_Apply_Request::XBee_Apply_Request(XBee_At_Batch *batch, uint16_t node) :
+		cmd("AC"),
+		batch(batch),
+		node(node)
+{}
+
+#ifdef XBEE_STATIC_ALLOC
+/* one "AC" per command in flight, see XBee_Config::remote_at_window */
+static XBee_Pool<XBee_Apply_Request, XBEE_AT_PENDING_SIZE> xbee_apply_pool;
+
+void* XBee_Apply_Request::operator new(size_t size) noexcept {
+	return xbee_apply_pool.alloc();
+}
+
+void XBee_Apply_Request::operator delete(void *ptr) {
+	xbee_apply_pool.release(ptr);
+}
+#endif
+
+/** XBee_Submission Class implementation */
+XBee_Submission::XBee_Submission(enum xbee_submission_type type) :
+		type(type),
+		msg(NULL),
+		cmd(NULL)
+{}
+
+XBee_Submission::~XBee_Submission() {
+	if (msg)
+		delete msg;
+}
+
+#ifdef XBEE_STATIC_ALLOC
+static XBee_Pool<XBee_Submission, XBEE_SUBMISSION_POOL_SIZE> xbee_submission_pool;
+
+void* XBee_Submission::operator new(size_t size) noexcept {
+	return xbee_submission_pool.alloc();
+}
+
+void XBee_Submission::operator delete(void *ptr) {
+	xbee_submission_pool.release(ptr);
+}
+#endif
+
+/** XBee_Replay_Stats Class implementation */
+XBee_Replay_Stats::XBee_Replay_Stats() :
+		frames(0),
+		skipped(0),
+		messages(0),
+		payload_bytes(0)
+{}
+
+/** XBee_Destination Class implementation */
+XBee_Destination::XBee_Destination() :
+		used(false),
+		last_used(0),
+		failure_cnt(0),
+		backoff_until(0),
+		link_class(LINK_GOOD),
+		rssi(0),
+		delivery_rate(1000),
+		retries(0),
+		rssi_time(0),
+		retry_budget(XBEE_TX_RETRIES),
+		backoff_base(XBEE_BACKOFF_BASE),
+		part_size(XBEE_MSG_LENGTH - MSG_HEADER_LENGTH),
+		window(XBEE_TX_WINDOW),
+		tx_seq(0),
+		seq_synced(false)
+{}
+
+/** XBee_Dedup Class implementation */
+XBee_Dedup::XBee_Dedup() :
+		used(false),
+		addr64h(0),
+		addr64l(0),
+		last(0),
+		window(0),
+		sync(0)
+{}
+
+/* distance of a number to the highest one received in the 15-bit number
+ * space, positive for newer messages */
+static int32_t xbee_seq_delta(uint16_t number, uint16_t last) {
+	int32_t delta = (number - last) & MSG_SEQ_MASK;
+
+	if (delta > MSG_SEQ_MASK / 2)
+		delta -= MSG_SEQ_MASK + 1;
+	return delta;
+}
+
+/* returns true if the message was received before, without recording its
+ * number. A message with the sync flag is only known if it was received
+ * with the flag, otherwise it starts a new numbering of the source */
+bool XBee_Dedup::received(uint16_t seq) const {
+	int32_t delta = xbee_seq_delta(seq & MSG_SEQ_MASK, last);
+	uint64_t bit;
+
+	if (delta > 0)
+		return false;
+	/* older than the window: the sender went on with its numbering, only
+	 * a sender that restarted it sets the sync flag */
+	if (-delta >= XBEE_DEDUP_WINDOW)
+		return !(seq & MSG_SEQ_SYNC);
+	bit = (uint64_t)1 << -delta;
+	if (seq & MSG_SEQ_SYNC)
+		return (window & sync & bit) != 0;
+	return (window & bit) != 0;
+}
+
+/* records the number of a message of the source, returns true if the
+ * message was received before and has to be dropped. Numbers up to
+ * XBEE_DEDUP_WINDOW behind the highest one are tracked */
+bool XBee_Dedup::duplicate(uint16_t seq) {
+	uint16_t number = seq & MSG_SEQ_MASK;
+	uint64_t flag = (seq & MSG_SEQ_SYNC) ? 1 : 0;
+	int32_t delta;
+	uint64_t bit;
+
+	if (received(seq))
+		return true;
+	delta = xbee_seq_delta(number, last);
+	/* a sync message restarts the window, unless it belongs to the run of
+	 * sync messages the window already follows */
+	if (flag && (!sync || -delta >= XBEE_DEDUP_WINDOW ||
+	(delta <= 0 && (window & ((uint64_t)1 << -delta))))) {
+		last = number;
+		window = 1;
+		sync = 1;
+		return false;
+	}
+	if (delta > 0) {
+		if (delta >= XBEE_DEDUP_WINDOW) {
+			window = 1;
+			sync = flag;
+		} else {
+			window = (window << delta) | 1;
+			sync = (sync << delta) | flag;
+		}
+		last = number;
+		return false;
+	}
+	bit = (uint64_t)1 << -delta;
+	window |= bit;
+	if (flag)
+		sync |= bit;
+	return false;
+}
+
+/** XBee_Link_Quality Class implementation */
+XBee_Link_Quality::XBee_Link_Quality() :
+		link_class(LINK_GOOD),
+		rssi(0),
+		delivery_rate(0),
+		retries(0),
+		retry_budget(0),
+		backoff_base(0),
+		part_size(0),
+		window(0)
+{}
+
+/** XBee_Channel Class implementation */
+/* constructs a closed channel */
+XBee_Channel::XBee_Channel() :
+		used(false),
+		endpoint(0),
+		cluster(0),
+		window(0),
+		in_flight(0),
+		pending_head(0),
+		pending_cnt(0),
+		drops(0)
+{
+	for (int i = 0; i < XBEE_CHANNEL_PARTIAL_SIZE; i++)
+		partial[i] = NULL;
+}
+
+/** XBee_Route Class implementation */
+XBee_Route::XBee_Route() :
+		used(false),
+		addr64h(0),
+		addr64l(0),
+		addr16(0),
+		hop_cnt(0),
+		sent(false)
+{}
+
+/* reads the route of a route record indicator frame: the 64 and 16-bit
+ * address of the node, the receive options, the number of hops and their
+ * 16-bit addresses, all in big-endian. The length includes the frame type.
+ * Routes with more than XBEE_ROUTE_MAX_HOPS hops only keep their hop count.
+ * Returns false if the frame is malformed */
+bool XBee_Route::parse_record(const uint8_t *data, uint16_t length) {
+	if (length < 13 || length < 13 + 2 * data[11])
+		return false;
+	addr64h = 0;
+	addr64l = 0;
+	for (int i = 0; i <= 3; i++) {
+		addr64h |= (uint32_t)data[i] << (3-i)*8;
+		addr64l |= (uint32_t)data[i+4] << (3-i)*8;
+	}
+	addr16 = data[8] << 8 | data[9];
+	hop_cnt = data[11];
+	/* the hops are kept in the order of the record, which is the order
+	 * the create source route frame expects */
+	for (int i = 0; i < hop_cnt && i < XBEE_ROUTE_MAX_HOPS; i++)
+		hops[i] = data[12 + 2*i] << 8 | data[13 + 2*i];
+	return true;
+}
+
+/* returns true if both routes lead to the same node over the same hops */
+bool XBee_Route::same_route(const XBee_Route &route) const {
+	if (route.addr64h != addr64h || route.addr64l != addr64l ||
+	route.addr16 != addr16 || route.hop_cnt != hop_cnt)
+		return false;
+	for (int i = 0; i < hop_cnt && i < XBEE_ROUTE_MAX_HOPS; i++) {
+		if (route.hops[i] != hops[i])
+			return false;
+	}
+	return true;
+}
+
+/* writes the create source route frame for the route to frame, which holds
+ * XBEE_SOURCE_ROUTE_LENGTH bytes: frame id (0 = no response), 64 and 16-bit
+ * destination address, options, number of hops and the hops. Returns the
+ * length of the frame */
+uint16_t XBee_Route::get_frame(uint8_t *frame) const {
+	frame[0] = XBEE_CREATE_SOURCE_ROUTE;
+	frame[1] = 0x00;
+	for (int i = 0; i <= 3; i++) {
+		frame[i+2] = addr64h >> (3-i)*8;
+		frame[i+6] = addr64l >> (3-i)*8;
+	}
+	frame[10] = addr16 >> 8;
+	frame[11] = addr16;
+	frame[12] = 0x00;
+	frame[13] = hop_cnt;
+	for (int i = 0; i < hop_cnt; i++) {
+		frame[14 + 2*i] = hops[i] >> 8;
+		frame[15 + 2*i] = hops[i];
+	}
+	return 14 + 2 * hop_cnt;
+}
+
+/** XBee_Held_Message Class implementation */
+/* constructs a free slot for a held message */
+XBee_Held_Message::XBee_Held_Message() :
+		msg(NULL),
+		seq(0)
+{}
+
+/** XBee_Sleep_Node Class implementation */
+XBee_Sleep_Node::XBee_Sleep_Node() :
+		used(false),
+		asleep(false)
+{}
+
+/** XBee_Rx_Worker Class implementation */
+XBee_Rx_Worker::XBee_Rx_Worker() :
+		sleeping(false),
+		running(false),
+		processed(0),
+		drops(0),
+		max_depth(0)
+{}
+
+/* passes the messages in the ring to the handler, and sleeps while the ring
+ * is empty. The queued messages are processed before the worker stops */
+void XBee_Rx_Worker::run() {
+	XBee_Message *msg;
+
+	while (true) {
+		if (ring.pop(&msg)) {
+			handler(msg);
+			processed.fetch_add(1, std::memory_order_relaxed);
+			continue;
+		}
+		std::unique_lock<std::mutex> guard(lock);
+		sleeping.store(true);
+		/* pairs with the fence in XBee::xbee_push_worker, either the
+		 * producer sees the worker sleeping or the worker sees the message */
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (ring.size() == 0) {
+			if (!running.load())
+				break;
+			wakeup.wait(guard);
+		}
+		sleeping.store(false);
+	}
 }
 
+/** XBee_Worker_Stats Class implementation */
+XBee_Worker_Stats::XBee_Worker_Stats() :
+		depth(0),
+		max_depth(0),
+		processed(0),
+		drops(0)
+{}
+
 /** XBee_Message Class implementation */
 /* constructor for a XBee message - used to create messages for transmission */
 // TODO: Make message part in Header 2 bytes long
@@ -188,30 +773,67 @@ XBee_Message::XBee_Message(enum xbee_msg_type type, const uint8_t *msg_payload,
 		type(type),
 		payload_len(msg_length),
 		message_part(1),	/* message part numbers start with 1 */
-		message_complete(true)	/* messages created by this constructor
+		part_size(XBEE_MSG_LENGTH - MSG_HEADER_LENGTH),
+		seq(0),
+		fec_group(0),
+		fec_parity(0),
+		message_complete(true),	/* messages created by this constructor
 					 * are complete at construction time */
+		gaps(false),
+		received_cnt(0),
+		last_len(0)
 {
+	/* allocate memory to copy the payload into the object */
+	payload = allocate_payload(&payload_len);
+	memcpy(payload, msg_payload, payload_len);
 	/* calculate the number of parts required to transmit this message */
-	message_part_cnt = payload_len / (XBEE_MSG_LENGTH - MSG_HEADER_LENGTH) + 1;
+	message_part_cnt = xbee_part_count(payload_len, part_size);
 	if (message_part_cnt > 255)
 		printf("Error: Message size > 20kB not supported\n");
-	/* allocate memory to copy the payload into the object */
-	payload = new uint8_t[payload_len];
-	memcpy(payload, msg_payload, payload_len);
 	/* allocate memory for the message buffer */
 	message_buffer = allocate_msg_buffer(payload_len);
 }
 
+/* constructor for a XBee message with a payload of the given length, that
+ * is filled in through get_payload before the message is sent. The payload
+ * isn't initialized */
+XBee_Message::XBee_Message(enum xbee_msg_type type, uint16_t msg_length):
+		type(type),
+		payload_len(msg_length),
+		message_part(1),
+		part_size(XBEE_MSG_LENGTH - MSG_HEADER_LENGTH),
+		seq(0),
+		fec_group(0),
+		fec_parity(0),
+		message_complete(true),
+		gaps(false),
+		received_cnt(0),
+		last_len(0)
+{
+	payload = allocate_payload(&payload_len);
+	message_part_cnt = xbee_part_count(payload_len, part_size);
+	if (message_part_cnt > 255)
+		printf("Error: Message size > 20kB not supported\n");
+	message_buffer = allocate_msg_buffer(payload_len);
+}
+
 /* constructor for XBee_messages - used to deserialize objects after reception */
 XBee_Message::XBee_Message(const uint8_t *message):
 		message_buffer(NULL),	/* this message type will not use the buffer */
 		type(static_cast<xbee_msg_type>(message[MSG_TYPE])),
 		payload_len(message[MSG_PAYLOAD_LENGTH]),
 		message_part(message[MSG_PART]),
-		message_part_cnt(message[MSG_PART_CNT])
+		message_part_cnt(message[MSG_PART_CNT]),
+		part_size(XBEE_MSG_LENGTH - MSG_HEADER_LENGTH),
+		seq(message[MSG_SEQ] << 8 | message[MSG_SEQ + 1]),
+		fec_group(0),
+		fec_parity(0),
+		gaps(false),
+		received_cnt(0),
+		last_len(0)
 {
 	/* allocate memory to copy the payload into the object */
-	payload = new uint8_t[payload_len];
+	payload = allocate_payload(&payload_len);
 	memcpy(payload, &message[MSG_HEADER_LENGTH], payload_len);
 
 	/* determine if the message is complete, or just a part of a longer
@@ -229,7 +851,14 @@ XBee_Message::XBee_Message():
 	payload_len(0),
 	message_part(0),
 	message_part_cnt(0),
-	message_complete(false)
+	part_size(XBEE_MSG_LENGTH - MSG_HEADER_LENGTH),
+	seq(0),
+	fec_group(0),
+	fec_parity(0),
+	message_complete(false),
+	gaps(false),
+	received_cnt(0),
+	last_len(0)
 {}
 
 /* copy constructor, performs a deep copy */
@@ -238,10 +867,18 @@ XBee_Message::XBee_Message(const XBee_Message& msg) :
 	payload_len(msg.payload_len),
 	message_part(msg.message_part),
 	message_part_cnt(msg.message_part_cnt),
-	message_complete(msg.message_complete)
+	part_size(msg.part_size),
+	seq(msg.seq),
+	fec_group(msg.fec_group),
+	fec_parity(msg.fec_parity),
+	message_complete(msg.message_complete),
+	source(msg.source),
+	gaps(false),	/* messages are copied before or after reassembly */
+	received_cnt(0),
+	last_len(0)
 {
 	/* allocate memory space for the payload and copy the data from msg */
-	payload = new uint8_t[payload_len];
+	payload = allocate_payload(&payload_len);
 	memcpy(payload, msg.payload, payload_len);
 	/* allocate memory for the message buffer */
 	message_buffer = allocate_msg_buffer(payload_len);
@@ -249,20 +886,26 @@ XBee_Message::XBee_Message(const XBee_Message& msg) :
 
 /* assignment operator, performs deep copy for pointer members */
 XBee_Message& XBee_Message::operator=(const XBee_Message& msg) {
+	type = msg.type;
+	source = msg.source;
 	payload_len = msg.payload_len;
 	message_part = msg.message_part;
 	message_part_cnt = msg.message_part_cnt;
+	part_size = msg.part_size;
+	seq = msg.seq;
+	fec_group = msg.fec_group;
+	fec_parity = msg.fec_parity;
 	message_complete = msg.message_complete;
+	gaps = false;
+	received_cnt = 0;
+	last_len = 0;
 
 	/* take care of pointer members */
 	/* if memory was allocated in the object, free the memory */
-	if (payload)
-		delete[] payload;
-	if (message_buffer)
-		delete[] message_buffer;
+	free_buffers();
 
 	/* allocate memory space for the payload and copy the data from msg */
-	payload = new uint8_t[payload_len];
+	payload = allocate_payload(&payload_len);
 	memcpy(payload, msg.payload, payload_len);
 	/* allocate memory for the message buffer */
 	message_buffer = allocate_msg_buffer(payload_len);
@@ -271,13 +914,27 @@ XBee_Message& XBee_Message::operator=(const XBee_Message& msg) {
 }
 
 XBee_Message::~XBee_Message() {
-	printf("del msg - pl: %u, part: %u, part_cnt: %u, pl_addr: %x, buf_add: %x\n",
-	payload_len, message_part, message_part_cnt, (uint)payload, (uint)message_buffer);
-	if (payload)
-		delete[] payload;
-	if (message_buffer)
-		delete[] message_buffer;
+	free_buffers();
+}
+
+#ifdef XBEE_STATIC_ALLOC
+static_assert(XBEE_STATIC_PAYLOAD_SIZE >= XBEE_MSG_LENGTH - MSG_HEADER_LENGTH,
+	"XBEE_STATIC_PAYLOAD_SIZE has to hold at least one part");
+
+static XBee_Pool<XBee_Message, XBEE_MSG_POOL_SIZE> xbee_msg_pool;
+
+/* messages are taken from the pool, new returns NULL if it is exhausted */
+void* XBee_Message::operator new(size_t size) noexcept {
+	void *ptr = xbee_msg_pool.alloc();
+	if (!ptr)
+		printf("Error: message pool exhausted\n");
+	return ptr;
+}
+
+void XBee_Message::operator delete(void *ptr) {
+	xbee_msg_pool.release(ptr);
 }
+#endif
 
 uint8_t* XBee_Message::get_payload(uint16_t *length) {
 	*length = payload_len;
@@ -288,6 +945,12 @@ enum xbee_msg_type XBee_Message::get_type() {
 	return type;
 }
 
+/* returns the address of the node that sent the message, the address is
+ * empty for messages created for transmission */
+const XBee_Address* XBee_Message::get_source() {
+	return &source;
+}
+
 bool XBee_Message::is_complete() {
 	return message_complete;
 }
@@ -302,33 +965,49 @@ bool XBee_Message::append_msg(const XBee_Message &msg) {
 	/* check if it's possible to append the given message */
 	if (msg.message_part != message_part+1)
 		return false;
+	if (msg.message_part != 1 && msg.seq != seq)
+		return false;	/* part of a different message */
 	
 	/* if it's the first part of a message, copy the total part count */
-	if (msg.message_part == 1)
+	if (msg.message_part == 1) {
 		message_part_cnt = msg.message_part_cnt;
+		seq = msg.seq;
+	}
 
 	/* given message passed validity check -> allocate memory */
 	new_payload_len = payload_len + msg.payload_len;
+#ifdef XBEE_STATIC_ALLOC
+	/* the payload grows in place */
+	if (new_payload_len > XBEE_STATIC_PAYLOAD_SIZE) {
+		printf("Error: Message size > %u bytes not supported\n", XBEE_STATIC_PAYLOAD_SIZE);
+		return false;
+	}
+	new_payload = payload_store;
+	if (msg.payload_len)
+		memcpy(&new_payload[payload_len], msg.payload, msg.payload_len);
+#else
 	new_payload = new uint8_t[new_payload_len];
 	
-	/* copy the existing payload into the new memory space */
-	memcpy(new_payload, payload, payload_len);
+	/* copy the existing payload into the new memory space. An empty
+	 * message or part has no payload */
+	if (payload_len)
+		memcpy(new_payload, payload, payload_len);
 	/* append the new payload to the memory */
-	memcpy(&new_payload[payload_len], msg.payload, msg.payload_len);
+	if (msg.payload_len)
+		memcpy(&new_payload[payload_len], msg.payload, msg.payload_len);
 	
 	/* update internal variables to match new data */
 	if (payload)
 		delete[] payload;
+#endif
 	payload = new_payload;
 	payload_len += msg.payload_len;
 	message_part += 1;
 	type = msg.type;
 	
 	/* determine if the message is complete */
-	if (message_part == message_part_cnt) {
-		printf("Complete message received \n");
+	if (message_part == message_part_cnt)
 		message_complete = true;
-	}
 
 	return true;
 }
@@ -354,21 +1033,51 @@ uint8_t* XBee_Message::get_msg(uint16_t part = 1) {
 	 * to put received message back together */
 	if (!message_buffer)
 		return NULL;
+	if (part > message_part_cnt) {
+		uint16_t index = part - message_part_cnt - 1;
+		uint16_t first = (index / fec_parity) * fec_group + index % fec_parity + 1;
+		uint16_t last = (index / fec_parity + 1) * fec_group;
+		uint8_t *parity = &message_buffer[MSG_HEADER_LENGTH + FEC_HEADER_LENGTH];
+		uint8_t len_xor = 0;
+
+		/* parity part: XOR of the covered data parts, shorter parts
+		 * are padded with zeros */
+		if (last > message_part_cnt)
+			last = message_part_cnt;
+		memset(parity, 0, part_size);
+		for (uint16_t i = first; i <= last; i += fec_parity) {
+			length = get_part_len(i);
+			xbee_xor(parity, &payload[(i - 1) * part_size], length);
+			len_xor ^= length;
+		}
+		message_buffer[MSG_TYPE] = static_cast<uint8_t>(type);
+		message_buffer[MSG_PART] = part;
+		message_buffer[MSG_PART_CNT] = message_part_cnt;
+		message_buffer[MSG_PAYLOAD_LENGTH] = FEC_HEADER_LENGTH + part_size;
+		message_buffer[MSG_SEQ] = seq >> 8;
+		message_buffer[MSG_SEQ + 1] = seq & 0xFF;
+		message_buffer[MSG_HEADER_LENGTH + FEC_GROUP] = fec_group;
+		message_buffer[MSG_HEADER_LENGTH + FEC_PARITY] = fec_parity;
+		message_buffer[MSG_HEADER_LENGTH + FEC_LENGTH] = len_xor;
+		return message_buffer;
+	}
 	
 	if (message_part_cnt > 1) {
 		/* calculate the length of the payload in last message part */
-		overhead_len = length - (message_part_cnt - 1) * (XBEE_MSG_LENGTH - MSG_HEADER_LENGTH);
+		overhead_len = length - (message_part_cnt - 1) * part_size;
 		/* payload length depends on the part number of the message -> 
 		 * last message part is an exception */
-		length = (part == message_part_cnt)? overhead_len : (XBEE_MSG_LENGTH - MSG_HEADER_LENGTH);
+		length = (part == message_part_cnt)? overhead_len : part_size;
 		/* offset in the payload data based on message part */
-		offset = (part - 1) * (XBEE_MSG_LENGTH - MSG_HEADER_LENGTH);
+		offset = (part - 1) * part_size;
 	}
 	/* create the header of the message */
 	message_buffer[MSG_TYPE] = static_cast<uint8_t>(type);
 	message_buffer[MSG_PART] = part;
 	message_buffer[MSG_PART_CNT] = message_part_cnt;
 	message_buffer[MSG_PAYLOAD_LENGTH] = length;
+	message_buffer[MSG_SEQ] = seq >> 8;
+	message_buffer[MSG_SEQ + 1] = seq & 0xFF;
 	/* copy payload into message body */
 	memcpy(&message_buffer[MSG_HEADER_LENGTH], &payload[offset], length);
 
@@ -386,14 +1095,18 @@ uint16_t XBee_Message::get_msg_len(uint16_t part = 1) {
 	if (message_part_cnt == 1)
 		return (MSG_HEADER_LENGTH + payload_len);
 
+	/* parity parts have the part size and a sub-header */
+	if (part > message_part_cnt)
+		return MSG_HEADER_LENGTH + FEC_HEADER_LENGTH + part_size;
+
 	/* message consists of multiple parts, part in the middle requested.
-	 * Parts in the middle always have the maximal possible message length
-	 * to make best use of bandwidth */
+	 * Parts in the middle always have the part size, which is the maximal
+	 * possible message length unless the link to the destination is noisy */
 	if (message_part_cnt != part)
-		return XBEE_MSG_LENGTH;
+		return MSG_HEADER_LENGTH + part_size;
 
 	/* message consists of multiple parts, last part requested */
-	uint16_t transmitted_len = (message_part_cnt - 1) * (XBEE_MSG_LENGTH - MSG_HEADER_LENGTH);
+	uint16_t transmitted_len = (message_part_cnt - 1) * part_size;
 	return MSG_HEADER_LENGTH + payload_len - transmitted_len;
 }
 
@@ -403,9 +1116,14 @@ uint16_t XBee_Message::get_msg_len(uint16_t part = 1) {
 uint8_t* XBee_Message::allocate_msg_buffer(uint16_t payload_len) {
 	uint8_t *message_buffer;
 	uint16_t msg_part_cnt;
+
+#ifdef XBEE_STATIC_ALLOC
+	/* holds the longest part */
+	return buffer_store;
+#endif
 	
 	/* calculate the number of parts required to transmit this message */
-	msg_part_cnt = payload_len / (XBEE_MSG_LENGTH - MSG_HEADER_LENGTH) + 1;
+	msg_part_cnt = xbee_part_count(payload_len, XBEE_MSG_LENGTH - MSG_HEADER_LENGTH);
 	/* allocate memory for the message buffer */
 	if (msg_part_cnt > 1) {
 		/* message has to be split into multiple parts, but each
@@ -418,73 +1136,441 @@ uint8_t* XBee_Message::allocate_msg_buffer(uint16_t payload_len) {
 
 	return message_buffer;
 }
- 
-/** XBee Class implementation */
-XBee::XBee(XBee_Config& config) :
-	config(config),
-	address_cache_size(0)
-{}
 
-XBee::~XBee() {
-	gbeeDestroy(gbee_handle);
-	for (int i = 0; i < address_cache_size; i++)
-		delete address_cache[i];
+/* allocates memory for the payload. In the heap-free build the payload is
+ * stored in the object, longer payloads are cut off */
+uint8_t* XBee_Message::allocate_payload(uint16_t *length) {
+#ifdef XBEE_STATIC_ALLOC
+	if (*length > XBEE_STATIC_PAYLOAD_SIZE) {
+		printf("Error: Message size > %u bytes not supported\n", XBEE_STATIC_PAYLOAD_SIZE);
+		*length = XBEE_STATIC_PAYLOAD_SIZE;
+	}
+	return payload_store;
+#else
+	return new uint8_t[*length];
+#endif
 }
 
-/* the init function initializes the internally used libgbee library by creating
- * a handle for the xbee device */
-uint8_t XBee::xbee_init() {
-	gbee_handle = gbeeCreate(config.serial_port.c_str());
-	if (!gbee_handle) {
-		printf("Error creating handle for XBee device\n");
-		exit(-1);
-	}
+/* frees the memory of the payload and the message buffer */
+void XBee_Message::free_buffers() {
+#ifndef XBEE_STATIC_ALLOC
+	if (payload)
+		delete[] payload;
+	if (message_buffer)
+		delete[] message_buffer;
+#endif
+	payload = NULL;
+	message_buffer = NULL;
+}
 
-	/* TODO: check if device is operating in API mode: the functions provided by
-	 * libgbee (gbeeGetMode, gbeeSetMode) cannot be used, because they rely
-	 * on the AT mode of the devices which is not working with the current
-	 * Firmware version */
-	return xbee_configure_device();
+/* changes the number of payload bytes per part, the message buffer holds
+ * parts of any size. Sizes that would split the message into more than 255
+ * parts are ignored. Must not be called while the message is transmitted */
+void XBee_Message::set_part_size(uint8_t size) {
+	uint16_t part_cnt;
+
+	if (size == 0 || size > XBEE_MSG_LENGTH - MSG_HEADER_LENGTH)
+		return;
+	part_cnt = xbee_part_count(payload_len, size);
+	if (part_cnt > 255)
+		return;
+	part_size = size;
+	message_part_cnt = part_cnt;
 }
 
-/* the configure device function sets the basic parameters for the XBee modules,
- * according to the values found in the XBee_Config object.
- * It will read the register values from the device and compare them with the
- * desired values, updating them if a mismatch is detected. If a register was
- * updated the changes are written into the nonvolatile memory of the device */
- // TODO: Configure Sleep Mode for Coordinator / End Devices
-uint8_t XBee::xbee_configure_device() {
-	uint8_t error_code;
-	bool register_updated = false;
+/* adds parity parts to a multi part message, see FEC_HEADER_LENGTH. The
+ * part size is reduced to leave room for the sub-header. Messages that
+ * would need more than 255 parts, and messages whose buffer can't hold a
+ * parity part, are sent without. Must not be called while the message is
+ * transmitted */
+void XBee_Message::set_fec(uint8_t group, uint8_t parity) {
+	uint16_t groups;
 
-	printf("Validating device configuration \n"); 
+	fec_group = 0;
+	fec_parity = 0;
+	if (group == 0 || parity == 0 || message_part_cnt < 2)
+		return;
+	if (part_size > FEC_MAX_PART_SIZE)
+		set_part_size(FEC_MAX_PART_SIZE);
+	if (parity > group)
+		parity = group;
+	groups = (message_part_cnt + group - 1) / group;
+	if (message_part_cnt + groups * parity > 255)
+		return;
+	/* the buffer of a message that fits into one frame is sized for
+	 * its payload */
+	if (payload_len < XBEE_MSG_LENGTH - MSG_HEADER_LENGTH &&
+	payload_len < FEC_HEADER_LENGTH + part_size)
+		return;
+	fec_group = group;
+	fec_parity = parity;
+}
 
-	/* check the 64bit PAN ID */
-	XBee_At_Command cmd("ID");
-	error_code = xbee_send_at_command(cmd);
-	if (error_code != GBEE_NO_ERROR)
-		return error_code;
-	if (memcmp(cmd.data, config.pan_id, 8)) {
-		printf("Setting PAN ID\n");
-		XBee_At_Command cmd_pan("ID", config.pan_id, 8);
-		xbee_send_at_command(cmd_pan);
-		register_updated = true;
-	}
-	
-	/* check the Node Identifier */
-	cmd = XBee_At_Command("NI");
-	error_code = xbee_send_at_command(cmd);
-	if (error_code != GBEE_NO_ERROR)
-		return error_code;
-	if (memcmp(cmd.data, config.node.c_str(), config.node.length())) {
-		printf("Setting Node Identifier\n");
-		XBee_At_Command cmd_ni("NI", config.node);
-		xbee_send_at_command(cmd_ni);
-		register_updated = true;
-	}
+/* returns the number of data and parity parts */
+uint16_t XBee_Message::get_part_total() {
+	if (!fec_group)
+		return message_part_cnt;
+	return message_part_cnt + (message_part_cnt + fec_group - 1) / fec_group * fec_parity;
+}
 
-	/* check the Maximum Unicast Hops value */
-	cmd = XBee_At_Command("NH");
+/* returns the number of the parity part that covers the data part */
+uint16_t XBee_Message::get_parity_part(uint16_t part) {
+	uint16_t group = (part - 1) / fec_group;
+	uint16_t index = (part - 1) % fec_group % fec_parity;
+
+	return message_part_cnt + group * fec_parity + index + 1;
+}
+
+/* returns the payload length of a data part */
+uint16_t XBee_Message::get_part_len(uint16_t part) {
+	if (part < message_part_cnt)
+		return part_size;
+	if (gaps)
+		return last_len;
+	return payload_len - (message_part_cnt - 1) * part_size;
+}
+
+/* returns true if the data part was received, used during reassembly */
+bool XBee_Message::has_part(uint16_t part) {
+	if (part == 0 || part > message_part_cnt)
+		return false;	/* parity parts aren't kept */
+	if (!gaps)
+		return part <= message_part;
+	return xbee_test_part(received, part);
+}
+
+/* adds a received part to the message. Parts that arrive in order are
+ * appended, a missing part or a parity part switches to placing the parts
+ * at their offset. Returns false if the part doesn't belong to the message */
+bool XBee_Message::add_part(const XBee_Message &part) {
+	if (!gaps && part.message_part == message_part + 1 &&
+	part.message_part <= part.message_part_cnt)
+		return append_msg(part);
+	return insert_part(part);
+}
+
+/* switches to placing the parts at their offset in a payload with room for
+ * every part. The parts that were received in order are already there */
+bool XBee_Message::start_gaps(const XBee_Message &part) {
+	uint16_t size = 0;
+
+	if (message_part > 0) {
+		size = payload_len / message_part;
+	} else {
+		type = part.type;
+		seq = part.seq;
+		message_part_cnt = part.message_part_cnt;
+	}
+	memset(received, 0, sizeof(received));
+	for (int i = 1; i <= message_part; i++)
+		xbee_mark_part(received, i);
+	received_cnt = message_part;
+	/* the part size is unknown until a full part arrives */
+	part_size = 0;
+	if (size && !set_stride(size))
+		return false;
+#ifndef XBEE_STATIC_ALLOC
+	uint8_t *new_payload = new uint8_t[message_part_cnt * (XBEE_MSG_LENGTH - MSG_HEADER_LENGTH)];
+	if (payload) {
+		memcpy(new_payload, payload, payload_len);
+		delete[] payload;
+	}
+	payload = new_payload;
+#else
+	payload = payload_store;
+#endif
+	gaps = true;
+	return true;
+}
+
+/* sets the part size of a message that is reassembled out of order. A last
+ * part that arrived before the part size was known is kept at the start of
+ * the payload, and moved to its offset. Returns false if the size doesn't
+ * match the message */
+bool XBee_Message::set_stride(uint16_t size) {
+	if (part_size)
+		return size == part_size;
+	if (size == 0 || size > XBEE_MSG_LENGTH - MSG_HEADER_LENGTH)
+		return false;
+#ifdef XBEE_STATIC_ALLOC
+	/* the last part has at least one byte, the store has room to rebuild
+	 * it in full */
+	if ((message_part_cnt - 1) * size >= XBEE_STATIC_PAYLOAD_SIZE) {
+		printf("Error: Message size > %u bytes not supported\n", XBEE_STATIC_PAYLOAD_SIZE);
+		return false;
+	}
+#endif
+	if (gaps && has_part(message_part_cnt)) {
+		if (last_len > size)
+			return false;
+		memmove(&payload[(message_part_cnt - 1) * size], payload, last_len);
+	}
+	part_size = size;
+	return true;
+}
+
+/* places a data part at its offset, or rebuilds a missing part from a
+ * parity part, until all data parts are there */
+bool XBee_Message::insert_part(const XBee_Message &part) {
+	uint16_t number = part.message_part;
+	uint16_t offset = 0;
+
+	if (part.message_part_cnt < 2 || number == 0)
+		return false;
+	if (message_part > 0 || gaps) {
+		if (part.seq != seq || part.message_part_cnt != message_part_cnt)
+			return false;	/* part of a different message */
+	}
+	if (!gaps && !start_gaps(part))
+		return false;
+
+	if (number > message_part_cnt)
+		return rebuild_part(part);
+	if (has_part(number))
+		return true;
+	if (number < message_part_cnt) {
+		if (!set_stride(part.payload_len))
+			return false;
+		offset = (number - 1) * part_size;
+	} else {
+		if (part.payload_len > XBEE_MSG_LENGTH - MSG_HEADER_LENGTH ||
+		(part_size && part.payload_len > part_size))
+			return false;
+		last_len = part.payload_len;
+		if (part_size)
+			offset = (number - 1) * part_size;
+	}
+	memcpy(&payload[offset], part.payload, part.payload_len);
+	set_received(number);
+	return true;
+}
+
+/* rebuilds the data part covered by the parity part, if it is the only
+ * covered part that is missing. Returns false if the parity part doesn't
+ * match the message */
+bool XBee_Message::rebuild_part(const XBee_Message &parity) {
+	uint16_t index = parity.message_part - message_part_cnt - 1;
+	uint16_t first, last;
+	uint16_t lost = 0;
+	uint8_t group, parities, length;
+	uint8_t *data;
+
+	if (parity.payload_len <= FEC_HEADER_LENGTH ||
+	!set_stride(parity.payload_len - FEC_HEADER_LENGTH))
+		return false;
+	group = parity.payload[FEC_GROUP];
+	parities = parity.payload[FEC_PARITY];
+	if (group == 0 || parities == 0 || parities > group)
+		return false;
+	first = (index / parities) * group + index % parities + 1;
+	last = (index / parities + 1) * group;
+	if (last > message_part_cnt)
+		last = message_part_cnt;
+	for (uint16_t i = first; i <= last; i += parities) {
+		if (has_part(i))
+			continue;
+		if (lost)
+			return true;	/* more than one part of the class is lost */
+		lost = i;
+	}
+	if (!lost)
+		return true;
+
+	data = &payload[(lost - 1) * part_size];
+	memcpy(data, &parity.payload[FEC_HEADER_LENGTH], part_size);
+	length = parity.payload[FEC_LENGTH];
+	for (uint16_t i = first; i <= last; i += parities) {
+		if (i == lost)
+			continue;
+		xbee_xor(data, &payload[(i - 1) * part_size], get_part_len(i));
+		length ^= get_part_len(i);
+	}
+	if ((lost < message_part_cnt && length != part_size) ||
+	(lost == message_part_cnt && length > part_size))
+		return false;	/* corrupted parity part */
+	if (lost == message_part_cnt)
+		last_len = length;
+	set_received(lost);
+	return true;
+}
+
+/* marks the data part as received, and completes the message once all data
+ * parts are there */
+void XBee_Message::set_received(uint16_t part) {
+	xbee_mark_part(received, part);
+	if (++received_cnt < message_part_cnt || !part_size)
+		return;
+
+#ifdef XBEE_STATIC_ALLOC
+	/* the message is dropped when its reassembly times out */
+	if ((message_part_cnt - 1) * part_size + last_len > XBEE_STATIC_PAYLOAD_SIZE) {
+		printf("Error: Message size > %u bytes not supported\n", XBEE_STATIC_PAYLOAD_SIZE);
+		return;
+	}
+#endif
+	payload_len = (message_part_cnt - 1) * part_size + last_len;
+	message_part = message_part_cnt;
+	message_complete = true;
+	gaps = false;
+}
+ 
+/** XBee Class implementation */
+XBee::XBee(XBee_Config& config) :
+	config(config),
+	timers(xbee_time_ms()),
+	address_cache_size(0),
+	address_cache_next(0),
+	discovery_running(false),
+	discovered_cnt(0),
+	discovery_cmd("ND"),
+	rx_pending_cnt(0),
+	rx_worker_cnt(0),
+	rx_workers_stopping(false),
+	rx_part_cnt(0),
+	dedup_next(0),
+	rx_waiter_cnt(0),
+	tx_queue_cnt(0),
+	tx_in_flight(0),
+	tx_seq(0),
+	tx_frame_id(0),
+	tx_blocked_since(0),
+	network_up(true),
+	dest_clock(0),
+	rssi_pending(false),
+	rssi_cmd("DB"),
+	route_cache_next(0),
+	api_escaped(false),
+	held_seq(0),
+	rx_backlog_head(0),
+	rx_backlog_cnt(0),
+	capture_file(NULL),
+	gbee_handle(NULL)
+{
+	for (int i = 0; i < XBEE_REASSEMBLY_SIZE; i++)
+		rx_partial[i] = NULL;
+	for (int i = 0; i < XBEE_RX_POOL_CNT; i++) {
+		rx_pool_first[i] = 0;
+		rx_pool_size[i] = 0;
+	}
+#ifdef XBEE_STATIC_ALLOC
+	submit_waiters.store(0);
+#endif
+
+	/* in thread-safe mode, producers wake up the thread polling the
+	 * interface through a pipe */
+	wakeup_pipe[0] = wakeup_pipe[1] = -1;
+	if (config.thread_safe) {
+		if (pipe(wakeup_pipe) == 0) {
+			fcntl(wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+			fcntl(wakeup_pipe[1], F_SETFL, O_NONBLOCK);
+		} else {
+			printf("Error creating wakeup pipe\n");
+		}
+	}
+}
+
+XBee::~XBee() {
+	XBee_Wait_Entry *wait;
+
+	xbee_stop_workers();
+	for (int i = 0; i < XBEE_CHANNEL_CNT; i++)
+		xbee_close_channel(i);
+	xbee_capture_stop();
+	if (gbee_handle)
+		gbeeDestroy(gbee_handle);
+	for (int i = 0; i < rx_pending_cnt; i++)
+		delete rx_pending[i];
+	for (int type = WAIT_SEND; type <= WAIT_RECEIVE; type++) {
+		XBee_List<XBee_Wait_Entry> *list = xbee_wait_list((enum xbee_wait_type)type);
+		while ((wait = list->front())) {
+			list->remove(wait);
+			delete wait;
+		}
+	}
+	for (int i = 0; i < XBEE_REASSEMBLY_SIZE; i++) {
+		if (rx_partial[i])
+			delete rx_partial[i];
+	}
+	for (int i = 0; i < XBEE_TX_QUEUE_SIZE; i++) {
+		if (tx_queue[i].msg)
+			delete tx_queue[i].msg;
+	}
+	for (int i = 0; i < XBEE_SLEEP_NODE_CNT; i++) {
+		for (int j = 0; j < XBEE_HELD_MSG_CNT; j++) {
+			if (sleep_nodes[i].held[j].msg)
+				delete sleep_nodes[i].held[j].msg;
+		}
+	}
+	while (XBee_Submission *sub = submissions.pop())
+		delete sub;
+	if (wakeup_pipe[0] >= 0) {
+		close(wakeup_pipe[0]);
+		close(wakeup_pipe[1]);
+	}
+}
+
+/* the init function initializes the internally used libgbee library by creating
+ * a handle for the xbee device */
+uint8_t XBee::xbee_init() {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	uint8_t error_code;
+
+	gbee_handle = gbeeCreate(config.serial_port.c_str());
+	if (!gbee_handle) {
+		printf("Error creating handle for XBee device\n");
+		exit(-1);
+	}
+
+	/* TODO: check if device is operating in API mode: the functions provided by
+	 * libgbee (gbeeGetMode, gbeeSetMode) cannot be used, because they rely
+	 * on the AT mode of the devices which is not working with the current
+	 * Firmware version */
+	error_code = xbee_configure_device();
+
+	/* the first background discovery starts with the next poll */
+	if (error_code == GBEE_NO_ERROR && config.discovery_interval)
+		xbee_arm_timer(&discovery_timer, TIMER_DISCOVERY, NULL, xbee_time_ms());
+	return error_code;
+}
+
+/* the configure device function sets the basic parameters for the XBee modules,
+ * according to the values found in the XBee_Config object.
+ * It will read the register values from the device and compare them with the
+ * desired values, updating them if a mismatch is detected. If a register was
+ * updated the changes are written into the nonvolatile memory of the device */
+ // TODO: Configure Sleep Mode for Coordinator / End Devices
+uint8_t XBee::xbee_configure_device() {
+	uint8_t error_code;
+	bool register_updated = false;
+
+	printf("Validating device configuration \n"); 
+
+	/* check the 64bit PAN ID */
+	XBee_At_Command cmd("ID");
+	error_code = xbee_send_at_command(cmd);
+	if (error_code != GBEE_NO_ERROR)
+		return error_code;
+	if (memcmp(cmd.data, config.pan_id, 8)) {
+		printf("Setting PAN ID\n");
+		XBee_At_Command cmd_pan("ID", config.pan_id, 8);
+		xbee_send_at_command(cmd_pan);
+		register_updated = true;
+	}
+	
+	/* check the Node Identifier */
+	cmd = XBee_At_Command("NI");
+	error_code = xbee_send_at_command(cmd);
+	if (error_code != GBEE_NO_ERROR)
+		return error_code;
+	if (memcmp(cmd.data, config.node.c_str(), config.node.length())) {
+		printf("Setting Node Identifier\n");
+		XBee_At_Command cmd_ni("NI", config.node);
+		xbee_send_at_command(cmd_ni);
+		register_updated = true;
+	}
+
+	/* check the Maximum Unicast Hops value */
+	cmd = XBee_At_Command("NH");
 	error_code = xbee_send_at_command(cmd);
 	if (error_code != GBEE_NO_ERROR)
 		return error_code;
@@ -497,6 +1583,42 @@ uint8_t XBee::xbee_configure_device() {
 		register_updated = true;
 	}
 
+	/* check the many-to-one route broadcasts of the coordinator */
+	if (config.coordinator_mode) {
+		cmd = XBee_At_Command("AR");
+		error_code = xbee_send_at_command(cmd);
+		if (error_code != GBEE_NO_ERROR)
+			return error_code;
+		if (cmd.length < 1 || cmd.data[0] != config.many_to_one_interval) {
+			printf("Setting Many-to-One Route Broadcast Time to %02x\n",
+			config.many_to_one_interval);
+			XBee_At_Command cmd_ar("AR", &config.many_to_one_interval, 1);
+			xbee_send_at_command(cmd_ar);
+			register_updated = true;
+		}
+	}
+
+	/* frames that libgbee can't send are written by xbee_send_frame,
+	 * which has to know if the device escapes special bytes */
+	cmd = XBee_At_Command("AP");
+	error_code = xbee_send_at_command(cmd);
+	if (error_code != GBEE_NO_ERROR)
+		return error_code;
+	api_escaped = (cmd.length > 0 && cmd.data[cmd.length - 1] == 0x02);
+
+	/* check the API output mode, channels need explicit rx indicators */
+	cmd = XBee_At_Command("AO");
+	error_code = xbee_send_at_command(cmd);
+	if (error_code != GBEE_NO_ERROR)
+		return error_code;
+	uint8_t api_options = config.explicit_rx ? 0x01 : 0x00;
+	if (cmd.length < 1 || cmd.data[cmd.length - 1] != api_options) {
+		printf("Setting API Output Mode to %02x\n", api_options);
+		XBee_At_Command cmd_ao("AO", &api_options, 1);
+		xbee_send_at_command(cmd_ao);
+		register_updated = true;
+	}
+
 	/* check the Baud Rate */
 	cmd = XBee_At_Command("BD");
 	error_code = xbee_send_at_command(cmd);
@@ -529,26 +1651,20 @@ uint8_t XBee::xbee_configure_device() {
 
 /* xbee_status requests, decodes and prints the current status of the XBee module */
 uint8_t XBee::xbee_status() {
-	GBeeFrameData frame;
-	GBeeError error_code;
-	uint16_t length;
-	uint32_t timeout = config.timeout;
-	uint8_t frame_id = 3;	/* used to identify response frame */
+	XBee_Guard guard(io_lock, config.thread_safe);
+	XBee_At_Command cmd("AI");
+	uint8_t error_code;
 	uint8_t status = 0xFE;	/* Unknown Status */
 	
 	/* query the current network status and print the response in cleartext */
-	error_code = gbeeSendAtCommand(gbee_handle, frame_id, at_cmd_str("AI"), NULL, 0);
+	error_code = xbee_send_at_command(cmd);
 	if (error_code != GBEE_NO_ERROR) {
-		printf("Error requesting XBee status: %s\n", gbeeUtilCodeToString(error_code));
-		return status;
-	}
-	/* wait for the response to the command */
-	error_code = gbeeReceive(gbee_handle, &frame, &length, &timeout);
-	if (error_code != GBEE_NO_ERROR)
+		printf("Error requesting XBee status: %s\n",
+		gbeeUtilCodeToString((GBeeError)error_code));
 		return error_code;
-	if (frame.ident == GBEE_AT_COMMAND_RESPONSE) {
-		GBeeAtCommandResponse *at_frame = (GBeeAtCommandResponse*) &frame;
-		status = at_frame->value[0];
+	}
+	if (cmd.length > 0) {
+		status = cmd.data[0];
 		printf("Status: %s\n", gbeeUtilStatusCodeToString(status));
 	}
 
@@ -558,213 +1674,2987 @@ uint8_t XBee::xbee_status() {
 /* sends out the requested AT command, receives & stores the register value 
  * in the XBee_At_Command object */
 uint8_t XBee::xbee_send_at_command(XBee_At_Command& cmd){
-	GBeeFrameData frame;
-	GBeeError error_code;
-	uint8_t response_cnt = 0;
-	uint16_t length = 0;
-	uint32_t timeout = config.timeout;
-	static uint8_t frame_id;
-	
-	memset(&frame, 0, sizeof(frame));
+	XBee_Guard guard(io_lock, config.thread_safe);
+	uint8_t status = GBEE_TIMEOUT_ERROR;
+	bool done = false;
 
-	/* send the AT command & data to the device */
-	frame_id = (frame_id % 255) + 1;	/* give each frame a unique ID */
-	error_code = gbeeSendAtCommand(gbee_handle, frame_id, at_cmd_str(cmd.at_command), cmd.data, cmd.length);
-	if (error_code != GBEE_NO_ERROR) {
-		printf("Error sending XBee AT (%s) command : %s\n", cmd.at_command.c_str(),
-		gbeeUtilCodeToString(error_code));
-		return error_code;
-	}
-	/* try to receive the response and copy it into the XBee_At_Command object*/
-	do {
-		error_code = gbeeReceive(gbee_handle, &frame, &length, &timeout);
-		if (error_code != GBEE_NO_ERROR)
-			return error_code;
-		
-		/* check if the received frame is a AT Command Response frame */
-		if (frame.ident == GBEE_AT_COMMAND_RESPONSE) {
-			GBeeAtCommandResponse *at_frame = (GBeeAtCommandResponse*) &frame;
-			if (at_frame->frameId != frame_id) {
-				printf("Problem: Frame IDs not matching\n (%i : %i)\n",
-				frame_id, at_frame->frameId);
-				error_code = GBEE_RESPONSE_ERROR;
-				/* if the frameId is larger than expected nothing can be done */
-				if (frame_id < at_frame->frameId)
-					break;
-				/* if it's smaller, wait for a while and try again */
-				sleep(1);
-				continue;
-			}
-			/* copy the response payload into the XBee_At_Command object.
-			 * This frame type has an overhead of 5 bytes that are counted
-			 * as part of the length. */
-			if (response_cnt++ < 1)
-				cmd.set_data(at_frame->value, length - 5, at_frame->status);
-			else
-				cmd.append_data(at_frame->value, length - 5, at_frame->status);
-		/* Modem Status frames can be transmitted at arbitrary times,
-		 * as long as there's no message queue, we have to handle them here */
-		} else if (frame.ident == GBEE_MODEM_STATUS) {
-			GBeeModemStatus *status_frame = (GBeeModemStatus*) &frame;
-			printf("Received Modem status: %02x\n", status_frame->status);
-			sleep(1);
-		}
-	} while (xbee_bytes_available() > 0);
-	/* in case there was an unexpected error, the function returned early
-	 * the only way we get this far, is if everything */
-	return GBEE_NO_ERROR;
+	/* frames that arrive in the meantime are handled by xbee_poll, each
+	 * wait ends at the latest when the response times out */
+	xbee_send_at_command_async(cmd, xbee_small_cb([&status, &done](uint8_t error_code) {
+		status = error_code;
+		done = true;
+	}));
+	while (!done)
+		xbee_poll(config.timeout);
+
+	return status;
 }
 
 /* sends the data in the message object to the coordinator */
 uint8_t XBee::xbee_send_to_coordinator(XBee_Message& msg) {
+	XBee_Guard guard(io_lock, config.thread_safe);
 	/* coordinator can be addressed by setting the 64bit destination
 	 * address to all zeros and the 16bit address to 0xFFFE */
 	XBee_Address addr;
 	addr.addr16 = 0xFFFE;
+	xbee_flush_destination(&addr);
 	return xbee_send(msg, &addr);
 }
 
-/* sends the data in the message object to a Network Node */
-uint8_t XBee::xbee_send_to_node(XBee_Message& msg, const std::string &node) {
-	const XBee_Address *addr = xbee_get_address(node);
-	if (!addr)
+/* sends the data in the message object to a Network Node. Returns
+ * XBEE_MSG_HELD if the node is asleep and the message is held until it
+ * wakes up, see XBee_Config::store_and_forward */
+uint8_t XBee::xbee_send_to_node(XBee_Message& msg, const xbee_string &node) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	XBee_Address addr;
+	if (!xbee_get_address(node, &addr))
 		return GBEE_TIMEOUT_ERROR;	/* node couldn't be found in network */
-	return xbee_send(msg, addr);
+	if (xbee_hold(msg, &addr, nullptr))
+		return XBEE_MSG_HELD;
+	xbee_flush_destination(&addr);
+	return xbee_send(msg, &addr);
+}
+
+/* queues the message for transmission to the coordinator without blocking.
+ * Returns XBEE_TX_QUEUE_FULL if the transmit queue has no space left, the
+ * delivery status of queued messages is not reported */
+uint8_t XBee::xbee_try_send_to_coordinator(XBee_Message& msg) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	XBee_Address addr;
+	addr.addr16 = 0xFFFE;
+	return xbee_try_send(msg, &addr);
+}
+
+/* status callback of messages whose status isn't reported */
+static void xbee_ignore_status(uint8_t status) {}
+
+/* queues the message for transmission to a Network Node without blocking,
+ * see xbee_try_send_to_coordinator. The address of the node is taken from
+ * the address cache. For an uncached node the message is copied and waits
+ * for a lookup in the background, and XBEE_ADDRESS_UNKNOWN is returned. Its
+ * status is reported to callback once the lookup has finished and the
+ * message was sent, GBEE_TIMEOUT_ERROR if the node couldn't be found. The
+ * callback is optional, and not called for the other return values */
+uint8_t XBee::xbee_try_send_to_node(XBee_Message& msg, const xbee_string &node,
+		xbee_status_cb callback) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	XBee_Address addr;
+	XBee_Send_Request *req;
+
+	if (xbee_lookup_address(node, &addr))
+		return xbee_try_send(msg, &addr);
+
+	req = new XBee_Send_Request(XBEE_NO_CHANNEL,
+		callback ? callback : xbee_status_cb(xbee_ignore_status));
+	if (req)
+		req->msg = new XBee_Message(msg);
+	if (!req || !req->msg) {
+		delete req;
+		return XBEE_TX_QUEUE_FULL;
+	}
+	xbee_get_address_async(node, xbee_small_cb([this, req](const XBee_Address *addr) {
+		xbee_send_resolved(req, addr);
+	}));
+	return XBEE_ADDRESS_UNKNOWN;
 }
 
 /* checks the buffer for (parts of) messages, puts together a complete message
- * from the parts */
+ * from the parts. If no message could be completed, an incomplete message
+ * is returned. The function waits up to the configured timeout for the next
+ * part, as long as parts keep arriving */
 XBee_Message* XBee::xbee_receive_message() {
-	GBeeFrameData frame;
-	GBeeError error_code;
-	XBee_Message *msg = new XBee_Message;
-	XBee_Address src_addr;
-	uint16_t length = 0;
-	uint32_t timeout = config.timeout;
-	memset(&frame, 0, sizeof(frame));
-
-	/* try to receive a message, it might consist of several parts */
-	uint8_t retry_cnt = 3;
-	do {
-		while (--retry_cnt > 0 && !msg->is_complete()) {
-			error_code = gbeeReceive(gbee_handle, &frame, &length, &timeout);
-			if (error_code != GBEE_NO_ERROR) {
-				printf("Error receiving message: length=%d, error= %s\n",
-				length, gbeeUtilCodeToString(error_code));
-				continue;
-			}
-			/* check if the received frame is a RxPacket frame */
-			if (frame.ident == GBEE_RX_PACKET) {
-				GBeeRxPacket *rx_frame = (GBeeRxPacket*) &frame;
-				/* try to append the data to the message
-				 * if it fails, give up and assume an faulty transmission */
-				if (!msg->append_msg(rx_frame->data))
-					retry_cnt = 0;
-				else
-					retry_cnt = 3;
-				break;
-			}
-			else {
-				printf("Received unexpected message frame: ident=%02x\n",frame.ident);
-			}
-		}
-	} while (!msg->is_complete() && retry_cnt > 0);
+	XBee_Guard guard(io_lock, config.thread_safe);
+	uint64_t deadline = xbee_time_ms() + config.timeout;
+	uint64_t now;
+	uint32_t part_cnt;
 
-	return msg;
+	xbee_dispatch_received();
+	while (rx_pending_cnt == 0) {
+		now = xbee_time_ms();
+		if (now >= deadline)
+			break;
+		part_cnt = rx_part_cnt;
+		xbee_poll(deadline - now);
+		/* a part arrived, wait for the next one */
+		if (rx_part_cnt != part_cnt)
+			deadline = xbee_time_ms() + config.timeout;
+	}
+
+	/* hand out completed messages in the order they were completed */
+	if (rx_pending_cnt > 0)
+		return xbee_remove_pending(0);
+	return new XBee_Message;
 }
 
-/* returns a reference to an address object, that contains the current network 
- * address of the node identified by the string */
-const XBee_Address* XBee::xbee_get_address(const std::string &node) {
-	uint8_t error_code;
+/* sends the message to the coordinator without blocking, the callback
+ * receives the transmission status */
+void XBee::xbee_send_to_coordinator_async(XBee_Message& msg, xbee_status_cb callback) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	XBee_Address addr;
+	addr.addr16 = 0xFFFE;
+	xbee_send_async(msg, &addr, callback);
+}
 
-	/* check for cached addresses */
-	for (int i = 0; i < address_cache_size; i++) {
-		if (address_cache[i]->node == node) {
-			return address_cache[i];
-		}
-	}
-	/* address not cached -> do a destination node lookup */
-	XBee_At_Command cmd("DN", node); 
-	error_code = xbee_send_at_command(cmd);
-	if (error_code != GBEE_NO_ERROR) {
-		printf("Node discovery failed, error: %s\n", gbeeUtilCodeToString((gbeeError)error_code));
+/* sends the message to a Network Node without blocking, the callback
+ * receives the transmission status. The message is copied, so it doesn't
+ * have to outlive the call */
+void XBee::xbee_send_to_node_async(XBee_Message& msg, const xbee_string &node,
+		xbee_status_cb callback) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	XBee_Send_Request *req = xbee_new_send_request(msg, XBEE_NO_CHANNEL, callback);
+
+	if (!req)
+		return;
+	xbee_get_address_async(node, xbee_small_cb([this, req](const XBee_Address *addr) {
+		xbee_send_resolved(req, addr);
+	}));
+}
+
+/* copies the message into a request that waits for the address of its
+ * destination. Returns NULL after reporting a full queue to the callback
+ * if a pool is exhausted */
+XBee_Send_Request* XBee::xbee_new_send_request(XBee_Message& msg, uint8_t channel,
+		xbee_status_cb callback) {
+	XBee_Send_Request *req = new XBee_Send_Request(channel, callback);
+
+	if (req)
+		req->msg = new XBee_Message(msg);
+	if (!req || !req->msg) {
+		delete req;
+		callback(XBEE_TX_QUEUE_FULL);
 		return NULL;
 	}
-	/* decode the returned data and add the address to the cache */
-	XBee_Address *new_address = new XBee_Address(node, cmd.data);
-	address_cache[address_cache_size++] = new_address;
+	return req;
+}
 
-	return new_address;
+/* sends the message of the request once its destination was looked up,
+ * and frees the request. A NULL address fails the send */
+void XBee::xbee_send_resolved(XBee_Send_Request *req, const XBee_Address *addr) {
+	if (!addr)
+		req->callback(GBEE_TIMEOUT_ERROR);	/* node couldn't be found */
+	else if (req->channel == XBEE_NO_CHANNEL)
+		xbee_send_async(*req->msg, addr, req->callback);
+	else
+		xbee_send_or_wait(*req->msg, addr, req->channel, req->callback);
+	delete req;
 }
 
-/* checks the buffer of the serial device for available data, and returns the 
- * number of pending bytes */
-int XBee::xbee_bytes_available() {
-	int bytes_available;
-	ioctl(gbee_handle->serialDevice, FIONREAD, &bytes_available);
+/* queues the message and registers the callback for its completion */
+void XBee::xbee_send_async(XBee_Message& msg, const XBee_Address *addr,
+		xbee_status_cb callback) {
+	/* messages for sleeping nodes report their status once forwarded */
+	if (xbee_hold(msg, addr, callback))
+		return;
+	xbee_send_or_wait(msg, addr, XBEE_NO_CHANNEL, callback);
+}
 
-	return bytes_available;
+/* queues the message, or lets it wait for a slot in the transmit queue if
+ * the queue is full or earlier messages are waiting already. Flushing a
+ * coalescing buffer may take up to two queue slots */
+void XBee::xbee_send_or_wait(XBee_Message& msg, const XBee_Address *addr, uint8_t channel,
+		xbee_status_cb callback) {
+	XBee_Wait_Entry *wait;
+
+	if (tx_waiting.empty() && tx_queue_cnt + 2 <= XBEE_TX_QUEUE_SIZE) {
+		xbee_start_send(msg, addr, channel, callback);
+		return;
+	}
+	wait = new XBee_Wait_Entry(WAIT_SEND);
+	if (wait)
+		wait->msg = new XBee_Message(msg);
+	if (!wait || !wait->msg) {
+		delete wait;
+		callback(XBEE_TX_QUEUE_FULL);
+		return;
+	}
+	wait->addr = *addr;
+	wait->channel = channel;
+	wait->callback = callback;
+	xbee_wait_for_slot(wait);
 }
 
-uint8_t XBee::xbee_send(XBee_Message& msg, const XBee_Address *addr) {
-	GBeeFrameData frame;
-	GBeeError error_code;
-	const uint8_t bcast_radius = 0;	/* -> max hops for bcast transmission */
-	const uint8_t options = 0x00;	/* 0x01 = Disable ACK, 0x20 - Enable APS
-				 * encryption (if EE=1), 0x04 = Send packet
-				 * with Broadcast Pan ID.
-				 * All other bits must be set to 0. */
-	uint8_t tx_status = 0xFF;	/* -> Unknown Tx Status */
-	uint16_t length;
-	uint32_t timeout = config.timeout;
-	memset(&frame, 0, sizeof(frame));
-
-	/* send the message, by splitting it up into parts that have the 
-	 * correct length for transmission over ZigBee */
-	for (uint16_t i = 1; i <= msg.message_part_cnt; i++) {
-		/* send out one part of the message, use the message part as frame id */
-		error_code = gbeeSendTxRequest(gbee_handle, i, addr->addr64h, addr->addr64l,
-		addr->addr16, bcast_radius, options, msg.get_msg(i), msg.get_msg_len(i));
-		if (error_code != GBEE_NO_ERROR) {
-			printf("Error sending message part %u of %u: %s\n",
-			i, msg.message_part_cnt, gbeeUtilCodeToString(error_code));
-			tx_status = 0xFF;	/* -> Unknown Tx Status */
-			break;
-		}
-		
-		/* wait for the acknowledgement for the message frame */
-		uint8_t retry_cnt = 3;
-		while (--retry_cnt > 0) {
-			error_code = gbeeReceive(gbee_handle, &frame, &length, &timeout);
-			if (error_code != GBEE_NO_ERROR) {
-				printf("Error receiving transmission status, status message: error= %s\n",
-				gbeeUtilCodeToString(error_code));
-				tx_status = 0xFF;	/* -> Unknown Tx Status */
-			/* check if the received frame is a TxStatus frame */
-			} else if (frame.ident == GBEE_TX_STATUS_NEW) {
-				GBeeTxStatusNew *tx_frame = (GBeeTxStatusNew*) &frame;
-				tx_status = tx_frame->deliveryStatus;
-				if (tx_status != 0x00)	/* 0x00 = success */
-					continue;
-				break; 
-			}
-		}
-		/* reset timeout to initial value (it's modified by gbeeReceive fckt */
-		timeout = config.timeout;
-		if (retry_cnt == 0)
-			break;
+/* queues the message in a free slot of the transmit queue */
+void XBee::xbee_start_send(XBee_Message& msg, const XBee_Address *addr, uint8_t channel,
+		xbee_status_cb callback) {
+	XBee_Tx_Entry *entry;
+
+	/* coalesced messages are reported as sent once they are buffered.
+	 * Messages on channels are never coalesced */
+	if (channel == XBEE_NO_CHANNEL && xbee_coalesce(msg, addr)) {
+		callback(GBEE_NO_ERROR);
+		return;
 	}
+	entry = xbee_enqueue(msg, addr, true, channel);
+	if (!entry) {
+		callback(XBEE_TX_QUEUE_FULL);	/* message pool exhausted */
+		return;
+	}
+	entry->callback = callback;
+	xbee_transmit_queued();
+}
 
-	return tx_status;
+/* queues the message for transmission to the coordinator from any thread,
+ * without locking. The callback is called by the thread that polls the
+ * interface, see xbee_send_to_coordinator_async */
+void XBee::xbee_submit_to_coordinator(XBee_Message& msg, xbee_status_cb callback) {
+	XBee_Submission *sub = xbee_new_submission(SUBMIT_TO_COORDINATOR, &msg);
+
+	if (!sub) {
+		callback(XBEE_TX_QUEUE_FULL);
+		return;
+	}
+	sub->callback = callback;
+	xbee_submit(sub);
+}
+
+/* queues the message for transmission to a Network Node from any thread,
+ * see xbee_submit_to_coordinator */
+void XBee::xbee_submit_to_node(XBee_Message& msg, const xbee_string &node,
+		xbee_status_cb callback) {
+	XBee_Submission *sub = xbee_new_submission(SUBMIT_TO_NODE, &msg);
+
+	if (!sub) {
+		callback(XBEE_TX_QUEUE_FULL);
+		return;
+	}
+	sub->node = node;
+	sub->callback = callback;
+	xbee_submit(sub);
+}
+
+/* queues the AT command from any thread, see xbee_submit_to_coordinator.
+ * The command has to stay valid until the callback is called */
+void XBee::xbee_submit_at_command(XBee_At_Command& cmd, xbee_status_cb callback) {
+	XBee_Submission *sub = xbee_new_submission(SUBMIT_AT_COMMAND, NULL);
+
+	if (!sub) {
+		callback(XBEE_TX_QUEUE_FULL);
+		return;
+	}
+	sub->cmd = &cmd;
+	sub->callback = callback;
+	xbee_submit(sub);
+}
+
+/* allocates a submission with a copy of the message, if one is given. In
+ * the heap-free build the pools may be exhausted until the thread polling
+ * the interface has started earlier submissions, the producer waits up to
+ * the queue timeout for them. Returns NULL after it */
+XBee_Submission* XBee::xbee_new_submission(enum xbee_submission_type type,
+		const XBee_Message *msg) {
+	XBee_Submission *sub;
+#ifdef XBEE_STATIC_ALLOC
+	if (xbee_submission_pool.full() || (msg && xbee_msg_pool.full())) {
+		std::unique_lock<std::mutex> lock(submit_lock);
+
+		/* the poll thread is woken up to start the queued submissions,
+		 * and signals when it released their slots */
+		submit_waiters++;
+		xbee_wakeup();
+		submit_freed.wait_for(lock, std::chrono::milliseconds(config.queue_timeout),
+		[msg]() {
+			return !xbee_submission_pool.full() && !(msg && xbee_msg_pool.full());
+		});
+		submit_waiters--;
+	}
+#endif
+	sub = new XBee_Submission(type);
+	if (sub && msg)
+		sub->msg = new XBee_Message(*msg);
+	if (!sub || (msg && !sub->msg)) {
+		delete sub;
+		return NULL;
+	}
+	return sub;
+}
+
+/* appends the request to the submission queue and wakes up the thread
+ * polling the interface */
+void XBee::xbee_submit(XBee_Submission *sub) {
+	if (!sub->callback)
+		sub->callback = xbee_small_cb([](uint8_t) {});
+	submissions.push(sub);
+	xbee_wakeup();
+}
+
+/* wakes up the thread polling the interface, in thread-safe mode */
+void XBee::xbee_wakeup() {
+	const uint8_t wakeup = 1;
+
+	if (wakeup_pipe[1] >= 0 && write(wakeup_pipe[1], &wakeup, 1) < 0) {
+		/* the pipe is full, the poll thread is woken up already */
+	}
+}
+
+/* wakes up the producers that wait for pool slots, see xbee_new_submission */
+void XBee::xbee_notify_producers() {
+#ifdef XBEE_STATIC_ALLOC
+	if (submit_waiters.load() > 0) {
+		std::lock_guard<std::mutex> lock(submit_lock);
+		submit_freed.notify_all();
+	}
+#endif
+}
+
+/* starts the requests submitted by other threads */
+void XBee::xbee_drain_submissions() {
+	XBee_Submission *sub;
+
+	while ((sub = submissions.pop())) {
+		switch (sub->type) {
+		case SUBMIT_TO_COORDINATOR:
+			xbee_send_to_coordinator_async(*sub->msg, sub->callback);
+			break;
+		case SUBMIT_TO_NODE:
+			xbee_send_to_node_async(*sub->msg, sub->node, sub->callback);
+			break;
+		case SUBMIT_AT_COMMAND:
+			xbee_send_at_command_async(*sub->cmd, sub->callback);
+			break;
+		}
+		delete sub;
+	}
+	xbee_notify_producers();
+}
+
+/* sends the AT command without waiting for the response. The response is
+ * stored in cmd, which has to stay valid until the callback is called */
+void XBee::xbee_send_at_command_async(XBee_At_Command& cmd, xbee_status_cb callback) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	xbee_queue_at_command(cmd, config.timeout, nullptr, callback);
+}
+
+/* sends the AT command and registers the request for its response, which
+ * has to arrive within timeout ms. If response_cb is given, the responses of
+ * multi response commands are passed to it instead of being stored in cmd */
+void XBee::xbee_queue_at_command(XBee_At_Command& cmd, uint32_t timeout,
+		xbee_data_cb response_cb, xbee_status_cb callback) {
+	xbee_request_at(cmd, NULL, 0x00, timeout, response_cb, callback);
+}
+
+/* sends the AT command to the node at addr, or to the local radio if addr
+ * is NULL. If no request slot is free, or earlier commands are waiting
+ * already, the command waits for a slot */
+void XBee::xbee_request_at(XBee_At_Command& cmd, const XBee_Address *addr, uint8_t options,
+		uint32_t timeout, xbee_data_cb response_cb, xbee_status_cb callback) {
+	XBee_At_Request *req = at_waiting.empty() ? xbee_free_at_request() : NULL;
+	XBee_Wait_Entry *wait;
+
+	if (req) {
+		xbee_start_at(req, cmd, addr, options, timeout, response_cb, callback);
+		return;
+	}
+	wait = new XBee_Wait_Entry(WAIT_AT_COMMAND);
+	if (!wait) {
+		callback(XBEE_TX_QUEUE_FULL);
+		return;
+	}
+	wait->cmd = &cmd;
+	wait->any_addr = (addr == NULL);
+	if (addr)
+		wait->addr = *addr;
+	wait->options = options;
+	wait->timeout = timeout;
+	wait->response_cb = response_cb;
+	wait->callback = callback;
+	xbee_wait_for_slot(wait);
+}
+
+/* sends the AT command and registers it in the free request slot for its
+ * response, which has to arrive within timeout ms */
+void XBee::xbee_start_at(XBee_At_Request *req, XBee_At_Command& cmd, const XBee_Address *addr,
+		uint8_t options, uint32_t timeout, xbee_data_cb response_cb, xbee_status_cb callback) {
+	GBeeError error_code;
+	uint8_t frame_id;
+
+	frame_id = xbee_next_frame_id();
+	if (addr)
+		error_code = xbee_send_remote_at(frame_id, addr, options, cmd.at_command,
+			cmd.data, cmd.length);
+	else
+		error_code = xbee_send_at(frame_id, cmd.at_command, cmd.data, cmd.length);
+	if (error_code != GBEE_NO_ERROR) {
+		if (addr)
+			printf("Error sending remote AT (%s) command to %08x%08x: %s\n",
+			cmd.at_command.c_str(), addr->addr64h, addr->addr64l,
+			gbeeUtilCodeToString(error_code));
+		else
+			printf("Error sending XBee AT (%s) command : %s\n", cmd.at_command.c_str(),
+			gbeeUtilCodeToString(error_code));
+		callback(error_code);
+		return;
+	}
+	req->used = true;
+	req->cmd = &cmd;
+	req->frame_id = frame_id;
+	/* node discovery returns one response per node */
+	req->multi = (!addr && cmd.at_command == "ND");
+	req->remote = (addr != NULL);
+	req->response_cnt = 0;
+	req->response_cb = response_cb;
+	req->callback = callback;
+	xbee_arm_timer(&req->timer, TIMER_AT_RESPONSE, req, xbee_time_ms() + timeout);
+}
+
+/* returns a free AT request slot, or NULL */
+XBee_At_Request* XBee::xbee_free_at_request() {
+	for (int i = 0; i < XBEE_AT_PENDING_SIZE; i++) {
+		if (!at_pending[i].used)
+			return &at_pending[i];
+	}
+	return NULL;
+}
+
+/* stores an AT command response in the matching asynchronous request and
+ * completes it. Returns false if no request matches the frame id */
+bool XBee::xbee_at_response(GBeeAtCommandResponse *at_frame, uint16_t length) {
+	XBee_At_Request *req = NULL;
+
+	for (int i = 0; i < XBEE_AT_PENDING_SIZE && !req; i++) {
+		if (at_pending[i].used && !at_pending[i].remote &&
+		at_pending[i].frame_id == at_frame->frameId)
+			req = &at_pending[i];
+	}
+	if (!req)
+		return false;
+
+	/* this frame type has an overhead of 5 bytes that are counted as
+	 * part of the length. Commands with a response per node collect the
+	 * responses until an empty response or the timeout */
+	if (req->multi && length > 5) {
+		if (req->response_cb)
+			req->response_cb(at_frame->value, length - 5);
+		else if (req->response_cnt < 1)
+			req->cmd->set_data(at_frame->value, length - 5, at_frame->status);
+		else
+			req->cmd->append_data(at_frame->value, length - 5, at_frame->status);
+		req->response_cnt++;
+		return true;
+	}
+	if (!req->multi || req->response_cnt == 0)
+		req->cmd->set_data(at_frame->value, length - 5, at_frame->status);
+	xbee_at_complete(req, GBEE_NO_ERROR);
+	return true;
+}
+
+/* reads or sets a register of a Network Node, see xbee_send_at_command.
+ * With apply set the node applies the change right away, otherwise it is
+ * applied by a following "AC" or "WR" command */
+uint8_t XBee::xbee_send_remote_at_command(XBee_At_Command& cmd, const xbee_string &node,
+		bool apply) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	XBee_Address addr;
+	uint8_t status = GBEE_TIMEOUT_ERROR;
+	bool done = false;
+
+	if (!xbee_get_address(node, &addr))
+		return GBEE_TIMEOUT_ERROR;	/* node couldn't be found in network */
+	xbee_send_remote_at_command_async(cmd, &addr, apply,
+	xbee_small_cb([&status, &done](uint8_t error_code) {
+		status = error_code;
+		done = true;
+	}));
+	while (!done)
+		xbee_poll(config.timeout);
+
+	return status;
+}
+
+/* sends the AT command to the node without blocking. The response is stored
+ * in cmd, which has to stay valid until the callback is called */
+void XBee::xbee_send_remote_at_command_async(XBee_At_Command& cmd, const XBee_Address *addr,
+		bool apply, xbee_status_cb callback) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	xbee_request_at(cmd, addr, apply ? XBEE_REMOTE_AT_APPLY : 0x00, config.timeout,
+		nullptr, callback);
+}
+
+/* sends cmds[i] to the node at addrs[i] for all cnt commands, and waits
+ * until every node answered or timed out. Up to XBee_Config::remote_at_window
+ * commands are in flight at the same time, each with its own frame id, so
+ * the whole set takes about one round trip per window instead of one per
+ * node. The responses are stored in the commands as they arrive, commands
+ * without a response get the status XBEE_AT_TX_FAILURE.
+ * With apply set, the changes are staged on the nodes, and applied with
+ * "AC" on every node that accepted all of its commands once the last
+ * response is in, so the nodes switch over together. Returns the number of
+ * commands that failed */
+uint16_t XBee::xbee_send_remote_at_commands(XBee_At_Command *cmds, const XBee_Address *addrs,
+		uint16_t cnt, bool apply) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	/* the callbacks only capture the batch and their own command */
+	XBee_At_Batch batch(cmds, addrs, cnt);
+	XBee_At_Batch *state = &batch;
+	uint16_t window = config.remote_at_window;
+	uint16_t next = 0;
+	uint16_t nodes = 0;
+	uint16_t failed = 0;
+
+	if (window > XBEE_AT_PENDING_SIZE - 1)
+		window = XBEE_AT_PENDING_SIZE - 1;
+	if (window == 0)
+		window = 1;
+
+	for (uint16_t i = 0; i < cnt; i++)
+		cmds[i].status = XBEE_AT_TX_FAILURE;
+	while (batch.done < cnt) {
+		while (next < cnt && batch.in_flight < window) {
+			XBee_At_Command *cmd = &cmds[next];
+			batch.in_flight++;
+			xbee_send_remote_at_command_async(*cmd, &addrs[next++], false,
+			xbee_small_cb([state, cmd](uint8_t error_code) {
+				if (error_code != GBEE_NO_ERROR)
+					cmd->status = XBEE_AT_TX_FAILURE;
+				state->in_flight--;
+				state->done++;
+			}));
+		}
+		if (batch.done < cnt)
+			xbee_poll(config.timeout);
+	}
+
+	if (apply) {
+		/* one "AC" per node, nodes with a failed command keep their
+		 * current configuration */
+		next = 0;
+		batch.done = 0;
+		for (uint16_t i = 0; i < cnt; i++) {
+			bool first = true;
+			for (uint16_t j = 0; j < i && first; j++)
+				first = !xbee_same_address(&addrs[j], &addrs[i]);
+			if (first)
+				nodes++;
+		}
+		while (batch.done < nodes) {
+			while (next < cnt && batch.in_flight < window) {
+				uint16_t node = next++;
+				bool first = true;
+				bool accepted = true;
+				XBee_Apply_Request *req;
+
+				for (uint16_t j = 0; j < node && first; j++)
+					first = !xbee_same_address(&addrs[j], &addrs[node]);
+				if (!first)
+					continue;
+				for (uint16_t j = node; j < cnt && accepted; j++)
+					accepted = !xbee_same_address(&addrs[j], &addrs[node]) ||
+						cmds[j].status == 0x00;
+				if (!accepted) {
+					batch.done++;
+					continue;
+				}
+				/* every node gets its own command, it holds the
+				 * response until the callback reads it */
+				req = new XBee_Apply_Request(&batch, node);
+				if (!req) {
+					batch.fail_node(node);
+					batch.done++;
+					continue;
+				}
+				batch.in_flight++;
+				xbee_send_remote_at_command_async(req->cmd, &addrs[node], false,
+				xbee_small_cb([req](uint8_t error_code) {
+					/* the changes didn't take effect */
+					if (error_code != GBEE_NO_ERROR || req->cmd.status != 0x00)
+						req->batch->fail_node(req->node);
+					req->batch->in_flight--;
+					req->batch->done++;
+					delete req;
+				}));
+			}
+			if (batch.done < nodes)
+				xbee_poll(config.timeout);
+		}
+	}
+
+	for (uint16_t i = 0; i < cnt; i++) {
+		if (cmds[i].status != 0x00)
+			failed++;
+	}
+	return failed;
+}
+
+/* stores the response to a remote AT command in the matching request and
+ * completes it. Returns false if no request matches the frame id */
+bool XBee::xbee_remote_at_response(GBeeRemoteAtCommandResponse *at_frame, uint16_t length) {
+	XBee_At_Request *req = NULL;
+
+	for (int i = 0; i < XBEE_AT_PENDING_SIZE && !req; i++) {
+		if (at_pending[i].used && at_pending[i].remote &&
+		at_pending[i].frame_id == at_frame->frameId)
+			req = &at_pending[i];
+	}
+	if (!req)
+		return false;
+
+	/* this frame type has an overhead of 15 bytes that are counted as
+	 * part of the length: the addresses of the node in addition to the
+	 * fields of a local response */
+	req->cmd->set_data(at_frame->value, (length > 15) ? length - 15 : 0, at_frame->status);
+	xbee_at_complete(req, GBEE_NO_ERROR);
+	return true;
+}
+
+/* frees the slot of the AT command and reports the status */
+void XBee::xbee_at_complete(XBee_At_Request *req, uint8_t status) {
+	xbee_status_cb callback = req->callback;
+
+	/* free the slot before the callback, it may issue new commands */
+	timers.cancel(&req->timer);
+	req->used = false;
+	req->response_cb = nullptr;
+	req->callback = nullptr;
+	callback(status);
+}
+
+/* waits for the next message without blocking. If source is given, only
+ * messages from the node with the same 64-bit address are accepted. The
+ * callback takes ownership of the message, it receives NULL if no message
+ * arrived within timeout ms (0 = wait forever) */
+void XBee::xbee_receive_message_async(const XBee_Address *source, uint32_t timeout,
+		xbee_message_cb callback) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	XBee_Rx_Waiter *waiter = rx_waiting.empty() ? xbee_free_rx_waiter() : NULL;
+	XBee_Wait_Entry *wait;
+
+	if (waiter) {
+		xbee_start_receive(waiter, source, timeout, callback);
+		return;
+	}
+	/* too many receive operations pending, wait for a slot */
+	wait = new XBee_Wait_Entry(WAIT_RECEIVE);
+	if (!wait) {
+		callback(NULL);
+		return;
+	}
+	wait->any_addr = (source == NULL);
+	if (source)
+		wait->addr = *source;
+	wait->timeout = timeout;
+	wait->msg_callback = callback;
+	xbee_wait_for_slot(wait);
+}
+
+/* registers the receive operation in the free slot */
+void XBee::xbee_start_receive(XBee_Rx_Waiter *waiter, const XBee_Address *source,
+		uint32_t timeout, xbee_message_cb callback) {
+	waiter->used = true;
+	waiter->any_source = (source == NULL);
+	if (source)
+		waiter->source = *source;
+	waiter->callback = callback;
+	rx_waiter_cnt++;
+	if (timeout)
+		xbee_arm_timer(&waiter->timer, TIMER_RX_WAITER, waiter, xbee_time_ms() + timeout);
+
+	/* the message might be waiting already */
+	xbee_dispatch_received();
+}
+
+/* returns a free receive operation slot, or NULL */
+XBee_Rx_Waiter* XBee::xbee_free_rx_waiter() {
+	for (int i = 0; i < XBEE_RX_WAITER_SIZE; i++) {
+		if (!rx_waiters[i].used)
+			return &rx_waiters[i];
+	}
+	return NULL;
+}
+
+/* returns the list of the requests that wait for the same kind of slot */
+XBee_List<XBee_Wait_Entry>* XBee::xbee_wait_list(enum xbee_wait_type type) {
+	switch (type) {
+	case WAIT_SEND:
+		return &tx_waiting;
+	case WAIT_AT_COMMAND:
+		return &at_waiting;
+	default:
+		return &rx_waiting;
+	}
+}
+
+/* appends the request to its wait list. It fails if it isn't started within
+ * the queue timeout, all requests wait equally long so they time out in the
+ * order they were made */
+void XBee::xbee_wait_for_slot(XBee_Wait_Entry *wait) {
+	xbee_wait_list(wait->type)->push_back(wait);
+	xbee_arm_timer(&wait->timer, TIMER_WAIT, wait, xbee_time_ms() + config.queue_timeout);
+}
+
+/* starts the waiting requests in the order they were made, as far as slots
+ * are free. Called from xbee_poll, like the forwarding of held messages */
+void XBee::xbee_resume_waiting() {
+	XBee_Wait_Entry *wait;
+	XBee_At_Request *req;
+	XBee_Rx_Waiter *waiter;
+
+	while ((wait = tx_waiting.front()) && tx_queue_cnt + 2 <= XBEE_TX_QUEUE_SIZE) {
+		tx_waiting.remove(wait);
+		timers.cancel(&wait->timer);
+		xbee_start_send(*wait->msg, &wait->addr, wait->channel, wait->callback);
+		delete wait;
+	}
+	while ((wait = at_waiting.front()) && (req = xbee_free_at_request())) {
+		at_waiting.remove(wait);
+		timers.cancel(&wait->timer);
+		xbee_start_at(req, *wait->cmd, wait->any_addr ? NULL : &wait->addr, wait->options,
+			wait->timeout, wait->response_cb, wait->callback);
+		delete wait;
+	}
+	while ((wait = rx_waiting.front()) && (waiter = xbee_free_rx_waiter())) {
+		rx_waiting.remove(wait);
+		timers.cancel(&wait->timer);
+		xbee_start_receive(waiter, wait->any_addr ? NULL : &wait->addr, wait->timeout,
+			wait->msg_callback);
+		delete wait;
+	}
+}
+
+/* fails the request that didn't get a slot within the queue timeout */
+void XBee::xbee_wait_expired(XBee_Wait_Entry *wait) {
+	xbee_wait_list(wait->type)->remove(wait);
+	if (wait->type == WAIT_RECEIVE)
+		wait->msg_callback(NULL);
+	else
+		wait->callback(XBEE_TX_QUEUE_FULL);
+	delete wait;
+}
+
+/* resolves the address of the node without blocking, the callback receives
+ * NULL if the node couldn't be found */
+void XBee::xbee_get_address_async(const xbee_string &node, xbee_address_cb callback) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	XBee_Address_Lookup *lookup;
+	XBee_Address addr;
+
+	if (xbee_lookup_address(node, &addr)) {
+		callback(&addr);
+		return;
+	}
+	/* address not cached -> do a destination node lookup. The callback
+	 * only captures the lookup, which keeps it in the small buffer of
+	 * std::function */
+	lookup = new XBee_Address_Lookup(node, callback);
+	if (!lookup) {
+		callback(NULL);
+		return;
+	}
+	xbee_send_at_command_async(lookup->cmd, xbee_small_cb([this, lookup](uint8_t error_code) {
+		if (error_code == GBEE_NO_ERROR && lookup->cmd.length >= 10) {
+			XBee_Address addr(lookup->node, lookup->cmd.data);
+			xbee_cache_address(addr);
+			lookup->callback(&addr);
+		} else {
+			printf("Node discovery failed, error: %s\n",
+			gbeeUtilCodeToString((GBeeError)error_code));
+			lookup->callback(NULL);
+		}
+		delete lookup;
+	}));
+}
+
+/* discovers all nodes of the network with a single "ND" command and adds
+ * them to the address cache, so the first transmissions to the nodes don't
+ * need a lookup each. Blocks until the discovery time of the nodes ("NT")
+ * has elapsed */
+uint8_t XBee::xbee_discover_nodes() {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	uint8_t status = GBEE_TIMEOUT_ERROR;
+	bool done = false;
+
+	xbee_discover_nodes_async(xbee_small_cb([&status, &done](uint8_t error_code) {
+		status = error_code;
+		done = true;
+	}));
+	while (!done)
+		xbee_poll(config.timeout);
+
+	return status;
+}
+
+/* starts a network discovery without blocking, see xbee_discover_nodes.
+ * The responses are added to the address cache as they arrive, the
+ * callback is called once the discovery time has elapsed */
+void XBee::xbee_discover_nodes_async(xbee_status_cb callback) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+
+	if (discovery_running) {
+		callback(XBEE_DISCOVERY_RUNNING);
+		return;
+	}
+	/* one discovery runs at a time, its command and callback are kept
+	 * in the object */
+	discovery_running = true;
+	discovered_cnt = 0;
+	discovery_cb = callback;
+	/* nodes answer within the node discovery timeout, in units of 100 ms */
+	discovery_cmd = XBee_At_Command("NT");
+	xbee_send_at_command_async(discovery_cmd, xbee_small_cb([this](uint8_t error_code) {
+		uint32_t timeout = XBEE_DEFAULT_NT;
+
+		if (error_code == GBEE_NO_ERROR && discovery_cmd.status == 0x00 &&
+		discovery_cmd.length > 0) {
+			timeout = 0;
+			for (int i = 0; i < discovery_cmd.length; i++)
+				timeout = timeout << 8 | discovery_cmd.data[i];
+			timeout *= 100;
+		}
+
+		discovery_cmd = XBee_At_Command("ND");
+		xbee_queue_at_command(discovery_cmd, timeout + config.timeout,
+		xbee_small_cb([this](const uint8_t *data, uint16_t length) {
+			xbee_discovered_node(data, length);
+		}),
+		xbee_small_cb([this](uint8_t error_code) {
+			xbee_status_cb callback = discovery_cb;
+
+			printf("Network discovery found %u nodes\n", discovered_cnt);
+			discovery_running = false;
+			discovery_cb = nullptr;
+			callback(error_code);
+		}));
+	}));
+}
+
+/* adds the node of a node discovery response to the address cache */
+void XBee::xbee_discovered_node(const uint8_t *data, uint16_t length) {
+	size_t node_len;
+
+	if (length < ND_MIN_LENGTH) {
+		printf("Error: malformed node discovery response\n");
+		return;
+	}
+	node_len = strnlen((const char*) &data[ND_NODE_ID], length - ND_NODE_ID);
+	discovered_cnt++;
+	/* nodes without identifier can't be looked up */
+	if (node_len == 0)
+		return;
+	xbee_cache_address(XBee_Address(xbee_string((const char*) &data[ND_NODE_ID], node_len), data));
+}
+
+/* copies the current network address of the node identified by the string
+ * to addr. Returns false if the node couldn't be found in the network */
+bool XBee::xbee_get_address(const xbee_string &node, XBee_Address *addr) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	uint8_t error_code;
+
+	/* check for cached addresses */
+	if (xbee_lookup_address(node, addr))
+		return true;
+	/* address not cached -> do a destination node lookup */
+	XBee_At_Command cmd("DN", node); 
+	error_code = xbee_send_at_command(cmd);
+	if (error_code != GBEE_NO_ERROR) {
+		printf("Node discovery failed, error: %s\n", gbeeUtilCodeToString((gbeeError)error_code));
+		return false;
+	}
+	/* decode the returned data and add the address to the cache */
+	*addr = XBee_Address(node, cmd.data);
+	xbee_cache_address(*addr);
+	return true;
+}
+
+/* copies the cached address of the node to addr, returns false if the node
+ * isn't cached. The cache is copied from, because its entries are replaced
+ * by other nodes once it is full */
+bool XBee::xbee_lookup_address(const xbee_string &node, XBee_Address *addr) {
+	std::lock_guard<std::mutex> lock(address_cache_lock);
+
+	for (int i = 0; i < address_cache_size; i++) {
+		if (address_cache[i].node == node) {
+			*addr = address_cache[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+/* adds the address decoded from a "DN" or "ND" response to the cache.
+ * Cached nodes are updated in place. If the cache is full, the entries are
+ * replaced in a round robin manner */
+void XBee::xbee_cache_address(const XBee_Address &addr) {
+	std::lock_guard<std::mutex> lock(address_cache_lock);
+
+	for (int i = 0; i < address_cache_size; i++) {
+		if (address_cache[i].node == addr.node) {
+			address_cache[i] = addr;
+			return;
+		}
+	}
+	if (address_cache_size < XBEE_ADDR_CACHE_SIZE) {
+		address_cache[address_cache_size++] = addr;
+	} else {
+		address_cache[address_cache_next] = addr;
+		address_cache_next = (address_cache_next + 1) % XBEE_ADDR_CACHE_SIZE;
+	}
+}
+
+/* checks the buffer of the serial device for available data, and returns the 
+ * number of pending bytes */
+int XBee::xbee_bytes_available() {
+	int bytes_available;
+
+	/* not initialized, only the timers and the submissions are served */
+	if (!gbee_handle)
+		return 0;
+	ioctl(gbee_handle->serialDevice, FIONREAD, &bytes_available);
+
+	return bytes_available;
+}
+
+/* sends the message through the transmit queue and blocks until all parts
+ * are delivered or the retries are exhausted. Returns the transmission
+ * status of the last part (0x00 = success) */
+uint8_t XBee::xbee_send(XBee_Message& msg, const XBee_Address *addr) {
+	XBee_Tx_Entry *entry;
+	uint8_t tx_status;
+
+	/* wait for a free slot in the transmit queue */
+	while (!(entry = xbee_enqueue(msg, addr, false)))
+		xbee_poll(config.timeout);
+	while (entry->state != TX_DONE)
+		xbee_poll(config.timeout);
+
+	tx_status = entry->tx_status;
+	xbee_release(entry);
+	return tx_status;
+}
+
+/* queues the message without waiting for the transmission */
+uint8_t XBee::xbee_try_send(XBee_Message& msg, const XBee_Address *addr) {
+	if (xbee_hold(msg, addr, nullptr))
+		return XBEE_MSG_HELD;
+	/* flushing a coalescing buffer may take up to two queue slots */
+	if (tx_queue_cnt + 2 > XBEE_TX_QUEUE_SIZE)
+		return XBEE_TX_QUEUE_FULL;
+	if (xbee_coalesce(msg, addr) || xbee_enqueue(msg, addr, true)) {
+		xbee_transmit_queued();
+		return GBEE_NO_ERROR;
+	}
+	return XBEE_TX_QUEUE_FULL;
+}
+
+/* copies the message into a free slot of the transmit queue. Detached
+ * entries release their slot on completion, all others have to be released
+ * by the caller. Returns NULL if the queue is full */
+XBee_Tx_Entry* XBee::xbee_enqueue(const XBee_Message& msg, const XBee_Address *addr,
+		bool detached, uint8_t channel) {
+	XBee_Tx_Entry *entry = NULL;
+	XBee_Destination *dest;
+
+	for (int i = 0; i < XBEE_TX_QUEUE_SIZE && !entry; i++) {
+		if (tx_queue[i].state == TX_FREE)
+			entry = &tx_queue[i];
+	}
+	if (!entry)
+		return NULL;
+
+	entry->msg = new XBee_Message(msg);
+	if (!entry->msg)
+		return NULL;
+	entry->addr = *addr;
+	dest = xbee_get_destination(addr);
+	entry->msg->seq = dest->tx_seq | (dest->seq_synced ? 0 : MSG_SEQ_SYNC);
+	dest->tx_seq = (dest->tx_seq + 1) & MSG_SEQ_MASK;
+	entry->state = TX_QUEUED;
+	entry->seq = tx_seq++;
+	entry->part = 1;
+	entry->frame_id = 0;
+	entry->retry_cnt = 0;
+	entry->tx_status = 0xFF;	/* -> Unknown Tx Status */
+	entry->detached = detached;
+	entry->channel = channel;
+	memset(entry->fec_lost, 0, sizeof(entry->fec_lost));
+	tx_queue_cnt++;
+
+	return entry;
+}
+
+/* frees the slot of a completed transmission */
+void XBee::xbee_release(XBee_Tx_Entry *entry) {
+	timers.cancel(&entry->timer);
+	delete entry->msg;
+	entry->msg = NULL;
+	entry->callback = nullptr;
+	entry->state = TX_FREE;
+	tx_queue_cnt--;
+}
+
+/* drives the transmit queue: processes received frames, handles expired
+ * timers and sends queued message parts as far as flow control allows.
+ * Waits up to wait ms for incoming frames, but not beyond the next expiry
+ * of a timer. Returns the number of messages in the transmit queue */
+uint8_t XBee::xbee_poll(uint32_t wait) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	GBeeFrameData frame;
+	GBeeError error_code;
+	uint16_t length;
+	uint32_t timeout;
+	struct pollfd fds[2];
+	uint8_t wakeup[16];
+	bool rx_full;
+
+	xbee_drain_submissions();
+	xbee_run_timers();
+	xbee_resume_waiting();
+	xbee_transmit_queued();
+
+	/* sleep until the radio sends data, a producer submits a request or
+	 * the next timer expires. While the receive backlog is full, the
+	 * serial device isn't watched, see below */
+	rx_full = rx_backlog_cnt >= XBEE_RX_BACKLOG_SIZE;
+	if (rx_full || xbee_bytes_available() == 0) {
+		fds[0].fd = (rx_full || !gbee_handle) ? -1 : gbee_handle->serialDevice;
+		fds[0].events = POLLIN;
+		fds[1].fd = wakeup_pipe[0];
+		fds[1].events = POLLIN;
+		poll(fds, (wakeup_pipe[0] >= 0) ? 2 : 1, xbee_time_to_deadline(wait));
+	}
+	if (wakeup_pipe[0] >= 0) {
+		while (read(wakeup_pipe[0], wakeup, sizeof(wakeup)) > 0)
+			;
+		xbee_drain_submissions();
+	}
+	/* each frame is reassembled before the next one is read. If the
+	 * application doesn't take the received messages, the backlog fills
+	 * up and the frames are left in the buffer of the serial device */
+	while (rx_backlog_cnt < XBEE_RX_BACKLOG_SIZE && xbee_bytes_available() > 0) {
+		timeout = config.timeout;
+		error_code = xbee_receive_frame(&frame, &length, &timeout);
+		if (error_code != GBEE_NO_ERROR) {
+			printf("Error receiving frame: %s\n", gbeeUtilCodeToString(error_code));
+			break;
+		}
+		xbee_handle_frame(&frame, length);
+		xbee_dispatch_received();
+	}
+
+	xbee_dispatch_received();
+	xbee_run_timers();
+	/* forward held messages that didn't fit into the transmit queue */
+	for (int i = 0; i < XBEE_SLEEP_NODE_CNT && config.store_and_forward; i++) {
+		if (sleep_nodes[i].used && !sleep_nodes[i].asleep)
+			xbee_forward_held(&sleep_nodes[i]);
+	}
+	/* start the requests that wait for a slot that was freed */
+	xbee_resume_waiting();
+	xbee_transmit_queued();
+	/* completed transmissions released their messages */
+	xbee_notify_producers();
+
+	return tx_queue_cnt;
+}
+
+/* sends the next part of queued messages, as long as the radio accepts
+ * frames and the window of outstanding frames isn't exhausted. Parts for
+ * the same destination are sent one at a time and in order, destinations
+ * that are backing off after delivery failures are skipped. Destinations
+ * with a noisy link only use a part of the window, so they don't fill the
+ * radio buffer with frames that are retried for a long time */
+void XBee::xbee_transmit_queued() {
+	GBeeError error_code;
+	XBee_Tx_Entry *entry;
+	XBee_Route *route;
+	const uint8_t bcast_radius = 0;	/* -> max hops for bcast transmission */
+	const uint8_t options = 0x00;	/* 0x01 = Disable ACK, 0x20 - Enable APS
+				 * encryption (if EE=1), 0x04 = Send packet
+				 * with Broadcast Pan ID.
+				 * All other bits must be set to 0. */
+	uint64_t now = xbee_time_ms();
+
+	if (tx_queue_cnt == 0)
+		return;
+
+	/* fail the queued messages if the radio doesn't accept frames for
+	 * longer than the configured timeout */
+	if (!xbee_radio_ready()) {
+		if (!tx_blocked_since) {
+			tx_blocked_since = now;
+		} else if (now - tx_blocked_since > config.timeout) {
+			for (int i = 0; i < XBEE_TX_QUEUE_SIZE; i++) {
+				if (tx_queue[i].state == TX_QUEUED)
+					xbee_tx_complete(&tx_queue[i], 0xFF);
+			}
+		}
+		return;
+	}
+	tx_blocked_since = 0;
+
+	while (tx_in_flight < XBEE_TX_WINDOW) {
+		/* find the oldest queued message, that isn't blocked by an older
+		 * message for the same destination or a backoff */
+		entry = NULL;
+		for (int i = 0; i < XBEE_TX_QUEUE_SIZE; i++) {
+			XBee_Tx_Entry *cur = &tx_queue[i];
+			XBee_Destination *dest;
+			bool blocked = false;
+
+			if (cur->state != TX_QUEUED || (entry && entry->seq < cur->seq))
+				continue;
+			/* channels keep their own order */
+			for (int j = 0; j < XBEE_TX_QUEUE_SIZE && !blocked; j++) {
+				XBee_Tx_Entry *other = &tx_queue[j];
+				blocked = (other->state == TX_QUEUED || other->state == TX_IN_FLIGHT) &&
+					other->seq < cur->seq && other->channel == cur->channel &&
+					xbee_same_address(&other->addr, &cur->addr);
+			}
+			if (blocked)
+				continue;
+			if (cur->channel != XBEE_NO_CHANNEL && channels[cur->channel].used &&
+			channels[cur->channel].in_flight >= channels[cur->channel].window)
+				continue;
+			dest = xbee_get_destination(&cur->addr);
+			if (dest->backoff_until > now || tx_in_flight >= dest->window)
+				continue;
+			entry = cur;
+		}
+		if (!entry)
+			break;
+		if (entry->channel != XBEE_NO_CHANNEL && !channels[entry->channel].used) {
+			xbee_tx_complete(entry, 0xFF);	/* channel was closed */
+			continue;
+		}
+
+		/* the part size and the parity parts are chosen before the
+		 * first part is sent, and kept for the rest of the message.
+		 * Coalesced messages have to fit into a single frame */
+		if (entry->part == 1 && entry->msg->type != MSG_TYPE_COALESCED) {
+			entry->msg->set_part_size(xbee_get_destination(&entry->addr)->part_size);
+			entry->msg->set_fec(config.fec_group, config.fec_parity);
+		}
+
+		/* nodes that sent a route record are addressed through their
+		 * source route. The device keeps the route for the destination,
+		 * so it's only sent before the first part after a change */
+		route = xbee_lookup_route(&entry->addr);
+		if (route && route->hop_cnt > 0 && !route->sent)
+			route->sent = xbee_send_source_route(route) == GBEE_NO_ERROR;
+
+		/* send out one part of the message */
+		entry->frame_id = xbee_next_frame_id();
+		if (entry->channel == XBEE_NO_CHANNEL)
+			error_code = xbee_send_tx_request(entry->frame_id, &entry->addr, bcast_radius,
+			options, entry->msg->get_msg(entry->part), entry->msg->get_msg_len(entry->part));
+		else
+			error_code = xbee_send_explicit(entry->frame_id, &entry->addr,
+			&channels[entry->channel], entry->msg->get_msg(entry->part),
+			entry->msg->get_msg_len(entry->part));
+		if (error_code != GBEE_NO_ERROR) {
+			printf("Error sending message part %u of %u: %s\n", entry->part,
+			entry->msg->get_part_total(), gbeeUtilCodeToString(error_code));
+			xbee_tx_failed(entry, 0xFF);
+			continue;
+		}
+		entry->state = TX_IN_FLIGHT;
+		xbee_arm_timer(&entry->timer, TIMER_TX_STATUS, entry, now + config.timeout);
+		tx_in_flight++;
+		if (entry->channel != XBEE_NO_CHANNEL)
+			channels[entry->channel].in_flight++;
+	}
+}
+
+/* matches a transmission status frame to the part in flight */
+void XBee::xbee_tx_status(uint8_t frame_id, uint8_t status, uint8_t retries) {
+	XBee_Tx_Entry *entry = NULL;
+	XBee_Destination *dest;
+
+	for (int i = 0; i < XBEE_TX_QUEUE_SIZE && !entry; i++) {
+		if (tx_queue[i].state == TX_IN_FLIGHT && tx_queue[i].frame_id == frame_id)
+			entry = &tx_queue[i];
+	}
+	/* status for a part that already timed out */
+	if (!entry)
+		return;
+
+	timers.cancel(&entry->timer);
+	tx_in_flight--;
+	if (entry->channel != XBEE_NO_CHANNEL && channels[entry->channel].in_flight > 0)
+		channels[entry->channel].in_flight--;
+	/* the delivery itself is accounted for in xbee_tx_failed, only the
+	 * retries are taken from failed frames */
+	dest = xbee_get_destination(&entry->addr);
+	xbee_link_update(dest, (status == 0x00) ? 1 : 0, retries);
+	/* the source route is broken -> fall back to route discovery until
+	 * the node sends a new route record */
+	if (status == TX_STATUS_NETWORK_ACK_FAILURE || status == TX_STATUS_ROUTE_NOT_FOUND) {
+		XBee_Route *route = xbee_lookup_route(&entry->addr);
+		if (route) {
+			printf("Route to %08x%08x failed: %02x\n", route->addr64h,
+			route->addr64l, status);
+			route->used = false;
+		}
+	}
+	if (status != 0x00) {	/* 0x00 = success */
+		xbee_tx_failed(entry, status);
+		return;
+	}
+
+	/* part delivered -> clear the backoff of the destination */
+	dest->seq_synced = true;
+	dest->failure_cnt = 0;
+	dest->backoff_until = 0;
+	timers.cancel(&dest->timer);
+
+	entry->state = TX_QUEUED;
+	xbee_next_part(entry, status);
+}
+
+/* moves on to the next part of the message, or completes the message after
+ * its last part. Parity parts are only sent for the parity classes that
+ * lost a data part, the other data parts were confirmed by the radio of the
+ * destination */
+void XBee::xbee_next_part(XBee_Tx_Entry *entry, uint8_t status) {
+	XBee_Message *msg = entry->msg;
+	uint16_t total = msg->get_part_total();
+
+	entry->retry_cnt = 0;
+	entry->part++;
+	while (entry->part > msg->message_part_cnt && entry->part <= total &&
+	!xbee_test_part(entry->fec_lost, entry->part))
+		entry->part++;
+	if (entry->part > total)
+		xbee_tx_complete(entry, status);
+}
+
+/* a lost data part of a message with parity parts is left to the receiver
+ * to rebuild, as long as it's the only lost part of its parity class.
+ * Returns true if the part is skipped */
+bool XBee::xbee_fec_skip(XBee_Tx_Entry *entry) {
+	XBee_Message *msg = entry->msg;
+	uint16_t parity;
+
+	if (!msg->fec_group || entry->part > msg->message_part_cnt)
+		return false;
+	parity = msg->get_parity_part(entry->part);
+	if (xbee_test_part(entry->fec_lost, parity))
+		return false;
+	xbee_mark_part(entry->fec_lost, parity);
+	return true;
+}
+
+/* schedules the retransmission of a part after an exponential backoff, or
+ * completes the message once the retries are exhausted */
+void XBee::xbee_tx_failed(XBee_Tx_Entry *entry, uint8_t status) {
+	XBee_Destination *dest = xbee_get_destination(&entry->addr);
+	uint32_t backoff;
+
+	xbee_link_update(dest, -1, -1);
+	/* no backoff, the next part is sent right away */
+	if (xbee_fec_skip(entry)) {
+		entry->state = TX_QUEUED;
+		xbee_next_part(entry, 0x00);
+		return;
+	}
+	if (dest->failure_cnt < 16)
+		dest->failure_cnt++;
+	backoff = (uint32_t)dest->backoff_base << (dest->failure_cnt - 1);
+	if (backoff > XBEE_BACKOFF_MAX)
+		backoff = XBEE_BACKOFF_MAX;
+	dest->backoff_until = xbee_time_ms() + backoff;
+	xbee_arm_timer(&dest->timer, TIMER_BACKOFF, dest, dest->backoff_until);
+
+	entry->state = TX_QUEUED;
+	entry->tx_status = status;
+	if (++entry->retry_cnt > dest->retry_budget && !xbee_hold_unreachable(entry))
+		xbee_tx_complete(entry, status);
+}
+
+/* marks the message as done, detached entries are released right away and
+ * report the status to their callback */
+void XBee::xbee_tx_complete(XBee_Tx_Entry *entry, uint8_t status) {
+	xbee_status_cb callback;
+
+	entry->state = TX_DONE;
+	entry->tx_status = status;
+	if (!entry->detached)
+		return;
+	if (status != 0x00 && !entry->callback)
+		printf("Error sending message of type %02x: %02x\n",
+		(uint8_t)entry->msg->type, status);
+	/* free the slot before the callback, it may queue new messages */
+	callback = entry->callback;
+	xbee_release(entry);
+	if (callback)
+		callback(status);
+}
+
+/* a node that doesn't answer is assumed to be asleep: the message is held
+ * until the node wakes up, as well as the queued messages for the node.
+ * Returns true if the entry was held and released */
+bool XBee::xbee_hold_unreachable(XBee_Tx_Entry *entry) {
+	XBee_Sleep_Node *node;
+	bool held = false;
+
+	if (!config.store_and_forward || (entry->addr.addr64h == 0 &&
+	entry->addr.addr64l == 0 && entry->addr.addr16 == 0xFFFE))
+		return false;	/* the coordinator never sleeps */
+	/* held messages are forwarded on the default stream */
+	if (entry->channel != XBEE_NO_CHANNEL)
+		return false;
+	node = xbee_sleep_node(&entry->addr, true);
+	if (!node)
+		return false;
+
+	node->asleep = true;
+	/* messages that were sent in part are restarted from the first part */
+	if (entry->detached && xbee_hold(*entry->msg, &entry->addr, entry->callback)) {
+		xbee_release(entry);
+		held = true;
+	}
+	xbee_node_asleep(node);
+	return held;
+}
+
+/* checks if the radio accepts frames: it has to be joined to a network, and
+ * if hardware flow control is used it has to assert CTS */
+bool XBee::xbee_radio_ready() {
+	int line_status;
+
+	if (!network_up)
+		return false;
+	if (config.hw_flow_control) {
+		if (ioctl(gbee_handle->serialDevice, TIOCMGET, &line_status) == 0 &&
+		!(line_status & TIOCM_CTS))
+			return false;
+	}
+	return true;
+}
+
+static_assert(XBEE_DEST_CACHE_SIZE > XBEE_TX_QUEUE_SIZE,
+	"every queued message needs its destination, and one more has to be free");
+
+/* returns the backoff state of a destination. Unknown destinations replace
+ * the least recently used one that has no message in the transmit queue, so
+ * the backoff and the numbering of queued messages are kept */
+XBee_Destination* XBee::xbee_get_destination(const XBee_Address *addr) {
+	XBee_Destination *dest = NULL;
+
+	dest_clock++;
+	for (int i = 0; i < XBEE_DEST_CACHE_SIZE; i++) {
+		if (dest_cache[i].used && xbee_same_address(&dest_cache[i].addr, addr)) {
+			dest_cache[i].last_used = dest_clock;
+			return &dest_cache[i];
+		}
+	}
+	for (int i = 0; i < XBEE_DEST_CACHE_SIZE; i++) {
+		if (!dest_cache[i].used) {
+			dest = &dest_cache[i];
+			break;
+		}
+		if ((!dest || dest_clock - dest_cache[i].last_used > dest_clock - dest->last_used) &&
+		!xbee_destination_busy(&dest_cache[i]))
+			dest = &dest_cache[i];
+	}
+	timers.cancel(&dest->timer);
+	dest->addr = *addr;
+	dest->used = true;
+	dest->last_used = dest_clock;
+	dest->failure_cnt = 0;
+	dest->backoff_until = 0;
+	/* new destinations start at full speed */
+	dest->rssi = 0;
+	dest->delivery_rate = 1000;
+	dest->retries = 0;
+	dest->rssi_time = 0;
+	xbee_link_update(dest, 0, -1);
+	/* a random start makes it unlikely that the receiver still has the
+	 * new numbers in its window from an earlier numbering */
+	dest->tx_seq = (xbee_time_ns() >> 10) & MSG_SEQ_MASK;
+	dest->seq_synced = false;
+	return dest;
+}
+
+/* returns true if a message to the destination is queued or in flight */
+bool XBee::xbee_destination_busy(const XBee_Destination *dest) {
+	for (int i = 0; i < XBEE_TX_QUEUE_SIZE; i++) {
+		if (tx_queue[i].state != TX_FREE && xbee_same_address(&tx_queue[i].addr, &dest->addr))
+			return true;
+	}
+	return false;
+}
+
+/* returns the destination a packet was received from, or NULL if nothing
+ * was sent to the node. Packets of the coordinator carry its 64-bit
+ * address, while the coordinator is addressed with 0 and 0xFFFE */
+XBee_Destination* XBee::xbee_find_destination(const XBee_Address *source) {
+	for (int i = 0; i < XBEE_DEST_CACHE_SIZE; i++) {
+		XBee_Destination *dest = &dest_cache[i];
+
+		if (!dest->used)
+			continue;
+		if (source->addr16 == 0x0000) {
+			if (dest->addr.addr64h == 0 && dest->addr.addr64l == 0 &&
+			dest->addr.addr16 == 0xFFFE)
+				return dest;
+		} else if (dest->addr.addr64h == source->addr64h &&
+		dest->addr.addr64l == source->addr64l) {
+			return dest;
+		}
+	}
+	return NULL;
+}
+
+/* transmission parameters of the link classes: noisy links retry more often
+ * with a longer backoff, use smaller parts which are less likely to be hit
+ * by an error, and only a part of the transmit window. Poor links have a
+ * lower retry budget, so they don't use up the air time */
+static const struct {
+	uint8_t retry_budget;
+	uint16_t backoff_base;
+	uint8_t part_size;
+	uint8_t window;
+} xbee_link_params[] = {
+	/* LINK_GOOD */
+	{XBEE_TX_RETRIES, XBEE_BACKOFF_BASE, XBEE_MSG_LENGTH - MSG_HEADER_LENGTH, XBEE_TX_WINDOW},
+	/* LINK_FAIR */
+	{XBEE_TX_RETRIES + 1, XBEE_BACKOFF_BASE * 2, (XBEE_MSG_LENGTH - MSG_HEADER_LENGTH) * 3 / 4,
+		XBEE_TX_WINDOW / 2},
+	/* LINK_POOR */
+	{XBEE_TX_RETRIES - 1, XBEE_BACKOFF_BASE * 4, (XBEE_MSG_LENGTH - MSG_HEADER_LENGTH) / 2, 1}
+};
+
+/* feeds a transmission result into the moving averages of the destination
+ * and adapts its transmission parameters. delivered is 1 for a delivered
+ * part, -1 for a failed part and 0 if there is no delivery to account for,
+ * retries is -1 if the status didn't report the MAC retries */
+void XBee::xbee_link_update(XBee_Destination *dest, int8_t delivered, int16_t retries) {
+	enum xbee_link_class link_class;
+
+	/* moving averages with a weight of 1/8 for the new sample */
+	if (delivered > 0)
+		dest->delivery_rate += (1000 - dest->delivery_rate + 7) / 8;
+	else if (delivered < 0)
+		dest->delivery_rate -= (dest->delivery_rate + 7) / 8;
+	if (retries >= 0)
+		dest->retries = (int32_t)dest->retries + ((int32_t)retries * 16 - dest->retries) / 8;
+
+	if (dest->delivery_rate < XBEE_LINK_POOR_RATE || dest->retries >= XBEE_LINK_POOR_RETRIES ||
+	dest->rssi > XBEE_LINK_POOR_RSSI)
+		link_class = LINK_POOR;
+	else if (dest->delivery_rate >= XBEE_LINK_GOOD_RATE && dest->retries < XBEE_LINK_GOOD_RETRIES &&
+	dest->rssi <= XBEE_LINK_GOOD_RSSI)
+		link_class = LINK_GOOD;
+	else
+		link_class = LINK_FAIR;
+
+	dest->link_class = link_class;
+	dest->retry_budget = xbee_link_params[link_class].retry_budget;
+	dest->backoff_base = xbee_link_params[link_class].backoff_base;
+	dest->part_size = xbee_link_params[link_class].part_size;
+	dest->window = xbee_link_params[link_class].window;
+}
+
+/* reads the RSSI of the packet that was just received with a "DB" command,
+ * for destinations that weren't measured for a while. Another packet may
+ * arrive before the command is processed, so the value is an estimate */
+void XBee::xbee_query_rssi(const XBee_Address *source) {
+	XBee_Destination *dest;
+	uint64_t now;
+
+	if (rssi_pending || !gbee_handle)
+		return;
+	dest = xbee_find_destination(source);
+	now = xbee_time_ms();
+	if (!dest || (dest->rssi_time && now - dest->rssi_time < XBEE_RSSI_INTERVAL))
+		return;
+	dest->rssi_time = now;
+	rssi_pending = true;
+
+	/* only one query runs at a time, so the command and the destination
+	 * are kept in members and the callback only captures this */
+	rssi_addr = dest->addr;
+	rssi_cmd = XBee_At_Command("DB");
+	xbee_send_at_command_async(rssi_cmd, xbee_small_cb([this](uint8_t error_code) {
+		rssi_pending = false;
+		if (error_code == GBEE_NO_ERROR && rssi_cmd.status == 0x00 && rssi_cmd.length > 0) {
+			/* the destination may have been replaced in the meantime */
+			for (int i = 0; i < XBEE_DEST_CACHE_SIZE; i++) {
+				XBee_Destination *dest = &dest_cache[i];
+				if (dest->used && xbee_same_address(&dest->addr, &rssi_addr)) {
+					dest->rssi = rssi_cmd.data[rssi_cmd.length - 1];
+					xbee_link_update(dest, 0, -1);
+				}
+			}
+		}
+	}));
+}
+
+/* copies the link quality estimates and the transmission parameters of the
+ * node, an empty node name selects the coordinator. Returns false if
+ * nothing was sent to the node yet */
+bool XBee::xbee_get_link_quality(const xbee_string &node, XBee_Link_Quality *quality) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	XBee_Destination *dest = NULL;
+	XBee_Address node_addr;
+	const XBee_Address *addr = NULL;
+
+	if (!node.empty()) {
+		if (!xbee_lookup_address(node, &node_addr))
+			return false;
+		addr = &node_addr;
+	}
+	for (int i = 0; i < XBEE_DEST_CACHE_SIZE && !dest; i++) {
+		XBee_Destination *cur = &dest_cache[i];
+		if (!cur->used)
+			continue;
+		if (addr ? xbee_same_address(&cur->addr, addr) : (cur->addr.addr64h == 0 &&
+		cur->addr.addr64l == 0 && cur->addr.addr16 == 0xFFFE))
+			dest = cur;
+	}
+	if (!dest)
+		return false;
+
+	quality->link_class = dest->link_class;
+	quality->rssi = dest->rssi;
+	quality->delivery_rate = dest->delivery_rate;
+	quality->retries = dest->retries;
+	quality->retry_budget = dest->retry_budget;
+	quality->backoff_base = dest->backoff_base;
+	quality->part_size = dest->part_size;
+	quality->window = dest->window;
+	return true;
+}
+
+/* limits the wait time in ms to the next expiry of a timer */
+uint32_t XBee::xbee_time_to_deadline(uint32_t wait) {
+	uint64_t now = xbee_time_ms();
+	uint64_t next = timers.next_expiry();
+
+	if (next >= now + wait)
+		return wait;
+	return (next > now) ? next - now : 0;
+}
+
+/* arms a timer of the interface, the type and context tell
+ * xbee_timer_expired what to do once the timer expires */
+void XBee::xbee_arm_timer(XBee_Timer *timer, enum xbee_timer_type type, void *context,
+		uint64_t expires) {
+	timer->type = type;
+	timer->context = context;
+	timers.arm(timer, expires);
+}
+
+/* handles the timers that expired until now */
+void XBee::xbee_run_timers() {
+	uint64_t now = xbee_time_ms();
+	XBee_Timer *timer;
+
+	while ((timer = timers.expire(now)))
+		xbee_timer_expired(timer);
+}
+
+void XBee::xbee_timer_expired(XBee_Timer *timer) {
+	switch (timer->type) {
+	case TIMER_TX_STATUS: {
+		/* treat the part as failed, its tx status is ignored if it
+		 * still arrives */
+		XBee_Tx_Entry *entry = static_cast<XBee_Tx_Entry*>(timer->context);
+		tx_in_flight--;
+		if (entry->channel != XBEE_NO_CHANNEL && channels[entry->channel].in_flight > 0)
+			channels[entry->channel].in_flight--;
+		xbee_tx_failed(entry, 0xFF);	/* -> Unknown Tx Status */
+		break;
+	}
+	case TIMER_BACKOFF:
+		/* nothing to do, xbee_poll resumes the transmit queue */
+		break;
+	case TIMER_AT_RESPONSE: {
+		XBee_At_Request *req = static_cast<XBee_At_Request*>(timer->context);
+		/* commands with a response per node end with the timeout */
+		if (req->multi && req->response_cnt > 0)
+			xbee_at_complete(req, GBEE_NO_ERROR);
+		else
+			xbee_at_complete(req, GBEE_TIMEOUT_ERROR);
+		break;
+	}
+	case TIMER_RX_WAITER:
+		xbee_rx_waiter_complete(static_cast<XBee_Rx_Waiter*>(timer->context), NULL);
+		break;
+	case TIMER_REASSEMBLY: {
+		XBee_Message **partial = static_cast<XBee_Message**>(timer->context);
+		printf("Dropping incomplete message from %08x%08x: timeout\n",
+		(*partial)->source.addr64h, (*partial)->source.addr64l);
+		xbee_drop_partial(partial, timer);
+		break;
+	}
+	case TIMER_COALESCE: {
+		XBee_Coalesce_Buffer *buf = static_cast<XBee_Coalesce_Buffer*>(timer->context);
+		/* try again later if the transmit queue is full */
+		if (xbee_flush_coalesced(buf, false) != GBEE_NO_ERROR)
+			xbee_arm_timer(&buf->timer, TIMER_COALESCE, buf,
+			xbee_time_ms() + XBEE_COALESCE_RETRY);
+		break;
+	}
+	case TIMER_HELD_EXPIRY:
+		xbee_release_held(static_cast<XBee_Held_Message*>(timer->context),
+		GBEE_TIMEOUT_ERROR);
+		break;
+	case TIMER_WAIT:
+		xbee_wait_expired(static_cast<XBee_Wait_Entry*>(timer->context));
+		break;
+	case TIMER_DISCOVERY:
+		if (config.discovery_interval)
+			xbee_arm_timer(&discovery_timer, TIMER_DISCOVERY, NULL,
+			xbee_time_ms() + config.discovery_interval);
+		if (!discovery_running)
+			xbee_discover_nodes_async(xbee_small_cb([](uint8_t) {}));
+		break;
+	}
+}
+
+/* returns the frame id for the next frame, 0 is reserved to disable the
+ * response frame */
+uint8_t XBee::xbee_next_frame_id() {
+	uint8_t cur = tx_frame_id.load(std::memory_order_relaxed);
+	uint8_t next;
+
+	do {
+		next = (cur % 255) + 1;
+	} while (!tx_frame_id.compare_exchange_weak(cur, next, std::memory_order_relaxed));
+	return next;
+}
+
+/* handles frames that arrive while waiting for a different frame: transmit
+ * status and modem status frames are processed, received packets are kept
+ * in the backlog for xbee_receive_message */
+void XBee::xbee_handle_frame(GBeeFrameData *frame, uint16_t length) {
+	if (frame->ident == GBEE_TX_STATUS_NEW) {
+		GBeeTxStatusNew *tx_frame = (GBeeTxStatusNew*) frame;
+		xbee_tx_status(tx_frame->frameId, tx_frame->deliveryStatus, tx_frame->retryCount);
+		/* the window moved on, keep the transmit queue going */
+		xbee_transmit_queued();
+	} else if (frame->ident == GBEE_MODEM_STATUS) {
+		GBeeModemStatus *status_frame = (GBeeModemStatus*) frame;
+		printf("Received Modem status: %02x\n", status_frame->status);
+		/* 0x02 = joined network, 0x06 = coordinator started,
+		 * 0x00 = hardware reset, 0x01 = watchdog reset, 0x03 = disassociated */
+		if (status_frame->status == 0x02 || status_frame->status == 0x06)
+			network_up = true;
+		else if (status_frame->status <= 0x01 || status_frame->status == 0x03)
+			network_up = false;
+	} else if (frame->ident == XBEE_ROUTE_RECORD) {
+		xbee_route_record(frame->data, length);
+	} else if (frame->ident == XBEE_EXPLICIT_RX) {
+		xbee_explicit_rx(frame, length);
+	} else if (frame->ident == GBEE_AT_COMMAND_RESPONSE) {
+		if (!xbee_at_response((GBeeAtCommandResponse*) frame, length))
+			printf("Received unexpected AT response: frame id=%02x\n",
+			((GBeeAtCommandResponse*) frame)->frameId);
+	} else if (frame->ident == GBEE_REMOTE_AT_COMMAND_RESPONSE) {
+		if (!xbee_remote_at_response((GBeeRemoteAtCommandResponse*) frame, length))
+			printf("Received unexpected remote AT response: frame id=%02x\n",
+			((GBeeRemoteAtCommandResponse*) frame)->frameId);
+	} else if (frame->ident == GBEE_RX_PACKET) {
+		/* the decoder of a replay has no radio */
+		if (gbee_handle) {
+			XBee_Address source((GBeeRxPacket*) frame);
+			if (config.store_and_forward)
+				xbee_node_awake(&source);
+			xbee_query_rssi(&source);
+		}
+		/* xbee_poll doesn't read frames while the backlog is full */
+		if (rx_backlog_cnt >= XBEE_RX_BACKLOG_SIZE) {
+			printf("Error: receive backlog full, dropping frame\n");
+			return;
+		}
+		uint8_t pos = (rx_backlog_head + rx_backlog_cnt) % XBEE_RX_BACKLOG_SIZE;
+		memcpy(&rx_backlog[pos], frame, sizeof(GBeeFrameData));
+		rx_backlog_len[pos] = length;
+		rx_backlog_cnt++;
+	} else {
+		printf("Received unexpected message frame: ident=%02x\n", frame->ident);
+	}
+}
+
+/* reads the next frame, frames from the backlog are returned first */
+GBeeError XBee::xbee_read_frame(GBeeFrameData *frame, uint16_t *length, uint32_t *timeout) {
+	if (rx_backlog_cnt == 0)
+		return xbee_receive_frame(frame, length, timeout);
+
+	memcpy(frame, &rx_backlog[rx_backlog_head], sizeof(GBeeFrameData));
+	*length = rx_backlog_len[rx_backlog_head];
+	rx_backlog_head = (rx_backlog_head + 1) % XBEE_RX_BACKLOG_SIZE;
+	rx_backlog_cnt--;
+	return GBEE_NO_ERROR;
+}
+
+/* returns the store-and-forward state of the node with the 64-bit address.
+ * If create is set, unknown nodes take a free entry or the entry of an awake
+ * node without held messages. Returns NULL if there is none */
+XBee_Sleep_Node* XBee::xbee_sleep_node(const XBee_Address *addr, bool create) {
+	XBee_Sleep_Node *node = NULL;
+
+	for (int i = 0; i < XBEE_SLEEP_NODE_CNT; i++) {
+		if (sleep_nodes[i].used && sleep_nodes[i].addr.addr64h == addr->addr64h &&
+		sleep_nodes[i].addr.addr64l == addr->addr64l)
+			return &sleep_nodes[i];
+	}
+	if (!create)
+		return NULL;
+	for (int i = 0; i < XBEE_SLEEP_NODE_CNT && !node; i++) {
+		if (!sleep_nodes[i].used)
+			node = &sleep_nodes[i];
+	}
+	for (int i = 0; i < XBEE_SLEEP_NODE_CNT && !node; i++) {
+		if (!sleep_nodes[i].asleep && !xbee_has_held(&sleep_nodes[i]))
+			node = &sleep_nodes[i];
+	}
+	if (!node) {
+		printf("Error: too many sleeping nodes\n");
+		return NULL;
+	}
+	node->addr = *addr;
+	node->used = true;
+	node->asleep = false;
+	return node;
+}
+
+/* holds a copy of the message if the node is asleep, or while older held
+ * messages are forwarded. A held CONFIG message is replaced by a newer one,
+ * if all slots are taken the oldest message is dropped. Returns false if
+ * the message has to be sent right away */
+bool XBee::xbee_hold(const XBee_Message& msg, const XBee_Address *addr,
+		xbee_status_cb callback) {
+	XBee_Sleep_Node *node;
+	XBee_Held_Message *held = NULL;
+	XBee_Held_Message *oldest = NULL;
+
+	if (!config.store_and_forward)
+		return false;
+	node = xbee_sleep_node(addr, false);
+	if (!node || (!node->asleep && !xbee_has_held(node)))
+		return false;
+
+	for (int i = 0; i < XBEE_HELD_MSG_CNT; i++) {
+		XBee_Held_Message *cur = &node->held[i];
+		if (cur->msg && msg.type == CONFIG && cur->msg->type == CONFIG)
+			xbee_release_held(cur, XBEE_MSG_SUPERSEDED);
+		if (!cur->msg && !held)
+			held = cur;
+		if (cur->msg && (!oldest || cur->seq < oldest->seq))
+			oldest = cur;
+	}
+	if (!held) {
+		xbee_release_held(oldest, XBEE_TX_QUEUE_FULL);
+		held = oldest;
+	}
+
+	held->msg = new XBee_Message(msg);
+	if (!held->msg)
+		return false;
+	held->seq = held_seq++;
+	held->callback = callback;
+	if (config.hold_time)
+		xbee_arm_timer(&held->timer, TIMER_HELD_EXPIRY, held,
+		xbee_time_ms() + config.hold_time);
+	return true;
+}
+
+bool XBee::xbee_has_held(const XBee_Sleep_Node *node) {
+	for (int i = 0; i < XBEE_HELD_MSG_CNT; i++) {
+		if (node->held[i].msg)
+			return true;
+	}
+	return false;
+}
+
+/* frees the slot of a held message that is dropped, and reports the status */
+void XBee::xbee_release_held(XBee_Held_Message *held, uint8_t status) {
+	xbee_status_cb callback = held->callback;
+
+	timers.cancel(&held->timer);
+	if (!callback)
+		printf("Dropping held message of type %02x: %02x\n",
+		(uint8_t)held->msg->type, status);
+	delete held->msg;
+	held->msg = NULL;
+	held->callback = nullptr;
+	if (callback)
+		callback(status);
+}
+
+/* marks the node as asleep, and moves the queued messages for the node
+ * that weren't started yet into its held messages, oldest first */
+void XBee::xbee_node_asleep(XBee_Sleep_Node *node) {
+	XBee_Tx_Entry *entry;
+
+	node->asleep = true;
+	do {
+		entry = NULL;
+		for (int i = 0; i < XBEE_TX_QUEUE_SIZE; i++) {
+			XBee_Tx_Entry *cur = &tx_queue[i];
+			if (cur->state != TX_QUEUED || !cur->detached || cur->part != 1 ||
+			cur->addr.addr64h != node->addr.addr64h ||
+			cur->addr.addr64l != node->addr.addr64l)
+				continue;
+			if (!entry || cur->seq < entry->seq)
+				entry = cur;
+		}
+		if (entry && xbee_hold(*entry->msg, &entry->addr, entry->callback))
+			xbee_release(entry);
+		else
+			entry = NULL;
+	} while (entry);
+}
+
+/* marks the node that sent a frame as awake, and forwards its held
+ * messages */
+void XBee::xbee_node_awake(const XBee_Address *addr) {
+	XBee_Sleep_Node *node;
+	XBee_Destination *dest;
+
+	if (!config.store_and_forward)
+		return;
+	node = xbee_sleep_node(addr, false);
+	if (!node || !node->asleep)
+		return;
+
+	node->asleep = false;
+	/* the backoff of the failed attempts doesn't apply anymore */
+	dest = xbee_get_destination(&node->addr);
+	dest->failure_cnt = 0;
+	dest->backoff_until = 0;
+	timers.cancel(&dest->timer);
+	xbee_forward_held(node);
+}
+
+/* queues the held messages of an awake node in one burst, oldest first.
+ * Messages that don't fit into the transmit queue are forwarded by one of
+ * the following polls */
+void XBee::xbee_forward_held(XBee_Sleep_Node *node) {
+	XBee_Held_Message *held;
+	XBee_Tx_Entry *entry;
+
+	while (true) {
+		held = NULL;
+		for (int i = 0; i < XBEE_HELD_MSG_CNT; i++) {
+			if (node->held[i].msg && (!held || node->held[i].seq < held->seq))
+				held = &node->held[i];
+		}
+		if (!held || !(entry = xbee_enqueue(*held->msg, &node->addr, true)))
+			break;
+		entry->callback = held->callback;
+		timers.cancel(&held->timer);
+		delete held->msg;
+		held->msg = NULL;
+		held->callback = nullptr;
+	}
+}
+
+/* marks the node as asleep, messages for the node are held until it sends
+ * a frame. Returns false if store-and-forward is disabled, or the address of
+ * the node isn't cached */
+bool XBee::xbee_mark_sleeping(const xbee_string &node) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	XBee_Address addr;
+	XBee_Sleep_Node *sleep_node;
+
+	if (!config.store_and_forward)
+		return false;
+	if (!xbee_lookup_address(node, &addr))
+		return false;
+	sleep_node = xbee_sleep_node(&addr, true);
+	if (!sleep_node)
+		return false;
+	xbee_node_asleep(sleep_node);
+	return true;
+}
+
+/* adds a small single part message to the coalescing buffer of its
+ * destination. Returns true if the message was buffered, false if it has
+ * to be sent on its own. Buffered messages are queued for transmission when
+ * the buffer is full or the coalescing delay has elapsed. The function
+ * never waits, the callers keep two slots of the transmit queue free for
+ * the flushes. If a flush fails anyway, the message isn't buffered and the
+ * caller's attempt to queue it fails as well */
+bool XBee::xbee_coalesce(XBee_Message& msg, const XBee_Address *addr) {
+	XBee_Coalesce_Buffer *buf = NULL;
+	XBee_Coalesce_Buffer *oldest = &coalesce_cache[0];
+	uint8_t *record;
+
+	/* look up the buffer for the destination, remember the oldest one in
+	 * case all buffers are occupied by other destinations */
+	for (int i = 0; i < XBEE_COALESCE_CACHE_SIZE; i++) {
+		XBee_Coalesce_Buffer *cur = &coalesce_cache[i];
+		if (cur->msg_cnt > 0 && xbee_same_address(&cur->addr, addr)) {
+			buf = cur;
+			break;
+		}
+		if (cur->timer.expires < oldest->timer.expires)
+			oldest = cur;
+	}
+	/* the delay of the buffer elapsed, but it wasn't flushed yet. If the
+	 * queue is still full, the timer retries */
+	if (buf && buf->timer.expires <= xbee_time_ms())
+		xbee_flush_coalesced(buf, false);
+
+	/* messages that are too large for coalescing are sent on their own,
+	 * previously buffered messages are flushed first to keep the order */
+	if (!config.coalesce_delay || msg.message_part_cnt > 1 ||
+	msg.payload_len > COALESCE_MAX_PAYLOAD) {
+		if (buf)
+			xbee_flush_coalesced(buf, false);
+		return false;
+	}
+
+	/* no buffer assigned to the destination -> take a free one, or
+	 * flush the oldest buffer and reuse it */
+	if (!buf) {
+		for (int i = 0; i < XBEE_COALESCE_CACHE_SIZE && !buf; i++) {
+			if (coalesce_cache[i].msg_cnt == 0)
+				buf = &coalesce_cache[i];
+		}
+		if (!buf) {
+			if (xbee_flush_coalesced(oldest, false) != GBEE_NO_ERROR)
+				return false;
+			buf = oldest;
+		}
+	}
+	/* flush the buffer if the record doesn't fit anymore */
+	if (buf->length + COALESCE_SUB_HEADER_LENGTH + msg.payload_len >
+	XBEE_MSG_LENGTH - MSG_HEADER_LENGTH &&
+	xbee_flush_coalesced(buf, false) != GBEE_NO_ERROR)
+		return false;
+	/* first message in the buffer starts the delay */
+	if (buf->msg_cnt == 0) {
+		buf->addr = *addr;
+		xbee_arm_timer(&buf->timer, TIMER_COALESCE, buf,
+		xbee_time_ms() + config.coalesce_delay);
+	}
+
+	/* append the record: sub-header followed by the payload */
+	record = &buf->buffer[buf->length];
+	record[COALESCE_SUB_TYPE] = static_cast<uint8_t>(msg.type);
+	record[COALESCE_SUB_LENGTH] = msg.payload_len;
+	memcpy(&record[COALESCE_SUB_HEADER_LENGTH], msg.payload, msg.payload_len);
+	buf->length += COALESCE_SUB_HEADER_LENGTH + msg.payload_len;
+	buf->msg_cnt++;
+
+	/* no space left for another record -> send it right away, or when the
+	 * timer retries */
+	if (buf->length + COALESCE_SUB_HEADER_LENGTH >= XBEE_MSG_LENGTH - MSG_HEADER_LENGTH)
+		xbee_flush_coalesced(buf, false);
+
+	return true;
+}
+
+/* queues the records stored in the coalescing buffer as one message, and
+ * releases the buffer. If the transmit queue is full, the function waits
+ * for a free slot or returns XBEE_TX_QUEUE_FULL, depending on wait */
+uint8_t XBee::xbee_flush_coalesced(XBee_Coalesce_Buffer *buf, bool wait) {
+	if (buf->msg_cnt == 0)
+		return GBEE_NO_ERROR;
+
+	/* the records form the payload of a message with a reserved type */
+	XBee_Message msg(static_cast<xbee_msg_type>(MSG_TYPE_COALESCED), buf->buffer, buf->length);
+	while (!xbee_enqueue(msg, &buf->addr, true)) {
+		if (!wait)
+			return XBEE_TX_QUEUE_FULL;
+		xbee_poll(config.timeout);
+	}
+
+	buf->length = 0;
+	buf->msg_cnt = 0;
+	timers.cancel(&buf->timer);
+
+	return GBEE_NO_ERROR;
+}
+
+/* sends all messages that are held back in the coalescing buffers, and
+ * waits until the transmit queue is empty */
+uint8_t XBee::xbee_flush() {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	for (int i = 0; i < XBEE_COALESCE_CACHE_SIZE; i++)
+		xbee_flush_coalesced(&coalesce_cache[i], true);
+	while (tx_queue_cnt > 0)
+		xbee_poll(config.timeout);
+	return GBEE_NO_ERROR;
+}
+
+/* queues the messages buffered for the destination ahead of a message that
+ * isn't coalesced, waiting for a free slot in the transmit queue */
+void XBee::xbee_flush_destination(const XBee_Address *addr) {
+	for (int i = 0; i < XBEE_COALESCE_CACHE_SIZE; i++) {
+		if (coalesce_cache[i].msg_cnt > 0 && xbee_same_address(&coalesce_cache[i].addr, addr))
+			xbee_flush_coalesced(&coalesce_cache[i], true);
+	}
+}
+
+/* unpacks the records of a coalesced frame into single messages, and
+ * appends them to the queue of pending messages. length is the number of
+ * bytes of the frame from the message header on, no record may end behind
+ * it, whatever the payload length in the header claims */
+void XBee::xbee_split_coalesced(const uint8_t *data, uint16_t length,
+		const XBee_Address *source) {
+	uint16_t offset = MSG_HEADER_LENGTH;
+	uint16_t end = MSG_HEADER_LENGTH + data[MSG_PAYLOAD_LENGTH];
+	const uint8_t *record;
+	XBee_Message *msg;
+
+	if (length < MSG_HEADER_LENGTH || end > length) {
+		printf("Error: coalesced frame shorter than its payload\n");
+		end = (length < MSG_HEADER_LENGTH) ? 0 : length;
+	}
+
+	while (offset + COALESCE_SUB_HEADER_LENGTH <= end) {
+		record = &data[offset];
+		/* validate the record length against the frame length */
+		if (offset + COALESCE_SUB_HEADER_LENGTH + record[COALESCE_SUB_LENGTH] > end) {
+			printf("Error: malformed coalesced frame\n");
+			break;
+		}
+		msg = new XBee_Message(static_cast<xbee_msg_type>(record[COALESCE_SUB_TYPE]),
+			&record[COALESCE_SUB_HEADER_LENGTH], record[COALESCE_SUB_LENGTH]);
+		if (!msg)
+			break;
+		msg->source = *source;
+		xbee_push_pending(msg);
+		offset += COALESCE_SUB_HEADER_LENGTH + record[COALESCE_SUB_LENGTH];
+	}
+}
+
+/* appends a completed message to the queue of pending messages, messages
+ * of types with a worker pool are passed to the pool instead */
+void XBee::xbee_push_pending(XBee_Message *msg) {
+	if (msg->type < XBEE_RX_POOL_CNT && rx_pool_size[msg->type] > 0) {
+		xbee_push_worker(msg);
+		return;
+	}
+	if (rx_pending_cnt >= XBEE_RX_PENDING_SIZE) {
+		printf("Error: pending message queue full, dropping message\n");
+		delete msg;
+		return;
+	}
+	rx_pending[rx_pending_cnt++] = msg;
+}
+
+/* pushes the message into the ring of a worker of its pool. All messages of
+ * a source go to the same worker, which keeps them in order */
+void XBee::xbee_push_worker(XBee_Message *msg) {
+	uint32_t hash = msg->source.addr64h ^ msg->source.addr64l;
+	XBee_Rx_Worker *worker;
+	uint32_t depth;
+
+	hash ^= hash >> 16;
+	hash *= 0x45D9F3B;
+	hash ^= hash >> 16;
+	worker = &rx_workers[rx_pool_first[msg->type] + hash % rx_pool_size[msg->type]];
+
+	if (!worker->ring.push(msg)) {
+		worker->drops.fetch_add(1, std::memory_order_relaxed);
+		delete msg;
+		return;
+	}
+	depth = worker->ring.size();
+	if (depth > worker->max_depth.load(std::memory_order_relaxed))
+		worker->max_depth.store(depth, std::memory_order_relaxed);
+
+	/* wake up the worker if it's sleeping, see XBee_Rx_Worker::run */
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (worker->sleeping.load()) {
+		std::lock_guard<std::mutex> guard(worker->lock);
+		worker->wakeup.notify_one();
+	}
+}
+
+/* starts a pool of worker threads for the messages of the type. Completed
+ * messages of the type are passed to the handler by one of the workers, in
+ * the order they were received from each node, instead of being returned
+ * by xbee_receive_message. The handler takes ownership of the message and
+ * is called concurrently by the workers of the pool. The thread polling the
+ * interface only receives and reassembles messages; if a worker falls
+ * behind, messages for it are dropped and counted. Returns false if the
+ * type has a pool already, there are not enough workers left, or in the
+ * heap-free build */
+bool XBee::xbee_start_workers(enum xbee_msg_type type, uint8_t worker_cnt,
+		xbee_message_cb handler) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+
+#ifdef XBEE_STATIC_ALLOC
+	/* std::thread allocates the state of the thread on the heap */
+	printf("Error: worker pools are not available in the heap-free build\n");
+	return false;
+#endif
+	if (type >= XBEE_RX_POOL_CNT || worker_cnt == 0 || rx_pool_size[type] > 0 ||
+	rx_worker_cnt + worker_cnt > XBEE_RX_WORKER_MAX || rx_workers_stopping)
+		return false;
+
+	rx_pool_first[type] = rx_worker_cnt;
+	for (int i = 0; i < worker_cnt; i++) {
+		XBee_Rx_Worker *worker = &rx_workers[rx_worker_cnt++];
+		worker->handler = handler;
+		worker->running.store(true);
+		worker->thread = std::thread(&XBee_Rx_Worker::run, worker);
+	}
+	rx_pool_size[type] = worker_cnt;
+	return true;
+}
+
+/* stops all worker pools, the workers process the messages in their rings
+ * before they stop. The pools are closed under the lock, so new messages
+ * are queued as pending, but the workers are joined without it: a handler
+ * that calls into the interface would wait for the lock forever otherwise.
+ * Must not be called from a handler */
+void XBee::xbee_stop_workers() {
+	uint8_t worker_cnt;
+
+	{
+		XBee_Guard guard(io_lock, config.thread_safe);
+		if (rx_workers_stopping)
+			return;
+		for (int i = 0; i < XBEE_RX_POOL_CNT; i++)
+			rx_pool_size[i] = 0;
+		for (int i = 0; i < rx_worker_cnt; i++) {
+			std::lock_guard<std::mutex> lock(rx_workers[i].lock);
+			rx_workers[i].running.store(false);
+			rx_workers[i].wakeup.notify_one();
+		}
+		/* keeps xbee_start_workers off the workers until they're joined */
+		rx_workers_stopping = true;
+		worker_cnt = rx_worker_cnt;
+	}
+
+	for (int i = 0; i < worker_cnt; i++)
+		rx_workers[i].thread.join();
+
+	XBee_Guard guard(io_lock, config.thread_safe);
+	for (int i = 0; i < worker_cnt; i++)
+		rx_workers[i].handler = nullptr;
+	rx_worker_cnt = 0;
+	rx_workers_stopping = false;
+}
+
+/* copies the counters of a worker of the pool for the type, returns false
+ * if the worker doesn't exist */
+bool XBee::xbee_get_worker_stats(enum xbee_msg_type type, uint8_t worker,
+		XBee_Worker_Stats *stats) {
+	XBee_Rx_Worker *cur;
+
+	if (type >= XBEE_RX_POOL_CNT || worker >= rx_pool_size[type])
+		return false;
+	cur = &rx_workers[rx_pool_first[type] + worker];
+	stats->depth = cur->ring.size();
+	stats->max_depth = cur->max_depth.load(std::memory_order_relaxed);
+	stats->processed = cur->processed.load(std::memory_order_relaxed);
+	stats->drops = cur->drops.load(std::memory_order_relaxed);
+	return true;
+}
+
+/* binds a channel to the endpoint and cluster id, messages completed on
+ * the channel are passed to the handler from within xbee_poll, the handler
+ * takes ownership of the message. At most window frames of the channel
+ * are in flight, and messages on the channel are kept in order separately
+ * from other channels and the default stream. Returns the channel, or
+ * XBEE_NO_CHANNEL if the endpoint is reserved, taken, or no channel is
+ * left */
+uint8_t XBee::xbee_open_channel(uint8_t endpoint, uint16_t cluster, uint8_t window,
+		xbee_message_cb handler) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	uint8_t channel = XBEE_NO_CHANNEL;
+
+	/* endpoint 0 is the ZDO, 0xDC - 0xEE are reserved by Digi */
+	if (endpoint == 0 || (endpoint >= 0xDC && endpoint <= 0xEE) || !handler)
+		return XBEE_NO_CHANNEL;
+	for (int i = XBEE_CHANNEL_CNT - 1; i >= 0; i--) {
+		if (!channels[i].used)
+			channel = i;
+		else if (channels[i].endpoint == endpoint && channels[i].cluster == cluster)
+			return XBEE_NO_CHANNEL;
+	}
+	if (channel == XBEE_NO_CHANNEL)
+		return XBEE_NO_CHANNEL;
+
+	channels[channel].used = true;
+	channels[channel].endpoint = endpoint;
+	channels[channel].cluster = cluster;
+	channels[channel].window = (window == 0 || window > XBEE_TX_WINDOW) ? XBEE_TX_WINDOW : window;
+	channels[channel].in_flight = 0;
+	channels[channel].handler = handler;
+	channels[channel].drops = 0;
+	return channel;
+}
+
+/* closes the channel, unfinished and undelivered messages of the channel
+ * are dropped, queued messages fail when they are due */
+void XBee::xbee_close_channel(uint8_t channel) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	XBee_Channel *ch;
+
+	if (channel >= XBEE_CHANNEL_CNT || !channels[channel].used)
+		return;
+	ch = &channels[channel];
+	for (int i = 0; i < XBEE_CHANNEL_PARTIAL_SIZE; i++) {
+		if (ch->partial[i])
+			xbee_drop_partial(&ch->partial[i], &ch->partial_timer[i]);
+	}
+	for (; ch->pending_cnt > 0; ch->pending_cnt--) {
+		delete ch->pending[ch->pending_head];
+		ch->pending_head = (ch->pending_head + 1) % XBEE_CHANNEL_PENDING_SIZE;
+	}
+	ch->used = false;
+	ch->handler = nullptr;
+}
+
+/* sends the message to the endpoint of the channel on the node, and blocks
+ * until all parts are delivered. An empty node name selects the
+ * coordinator. Messages on channels are neither coalesced nor held for
+ * sleeping nodes */
+uint8_t XBee::xbee_send_on_channel(XBee_Message& msg, const xbee_string &node,
+		uint8_t channel) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	XBee_Address addr;
+	XBee_Tx_Entry *entry;
+	uint8_t tx_status;
+
+	if (channel >= XBEE_CHANNEL_CNT || !channels[channel].used)
+		return 0xFF;
+	if (node.empty())
+		addr.addr16 = 0xFFFE;
+	else if (!xbee_get_address(node, &addr))
+		return GBEE_TIMEOUT_ERROR;	/* node couldn't be found in network */
+
+	while (!(entry = xbee_enqueue(msg, &addr, false, channel)))
+		xbee_poll(config.timeout);
+	while (entry->state != TX_DONE)
+		xbee_poll(config.timeout);
+
+	tx_status = entry->tx_status;
+	xbee_release(entry);
+	return tx_status;
+}
+
+/* sends the message on the channel without blocking, the callback receives
+ * the transmission status, see xbee_send_on_channel */
+void XBee::xbee_send_on_channel_async(XBee_Message& msg, const xbee_string &node,
+		uint8_t channel, xbee_status_cb callback) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	XBee_Send_Request *req;
+
+	if (channel >= XBEE_CHANNEL_CNT || !channels[channel].used) {
+		callback(0xFF);
+		return;
+	}
+	if (node.empty()) {
+		XBee_Address coordinator;
+		coordinator.addr16 = 0xFFFE;
+		xbee_send_or_wait(msg, &coordinator, channel, callback);
+		return;
+	}
+	req = xbee_new_send_request(msg, channel, callback);
+	if (!req)
+		return;
+	xbee_get_address_async(node, xbee_small_cb([this, req](const XBee_Address *addr) {
+		xbee_send_resolved(req, addr);
+	}));
+}
+
+/* passes the completed messages of the channels to their handlers */
+void XBee::xbee_dispatch_channels() {
+	XBee_Message *msg;
+
+	for (int i = 0; i < XBEE_CHANNEL_CNT; i++) {
+		XBee_Channel *ch = &channels[i];
+
+		/* the handler may close the channel */
+		while (ch->used && ch->pending_cnt > 0) {
+			msg = ch->pending[ch->pending_head];
+			ch->pending_head = (ch->pending_head + 1) % XBEE_CHANNEL_PENDING_SIZE;
+			ch->pending_cnt--;
+			ch->handler(msg);
+		}
+	}
+}
+
+/* removes a message from the queue of pending messages */
+XBee_Message* XBee::xbee_remove_pending(uint8_t index) {
+	XBee_Message *msg = rx_pending[index];
+
+	rx_pending_cnt--;
+	memmove(&rx_pending[index], &rx_pending[index + 1],
+	(rx_pending_cnt - index) * sizeof(XBee_Message*));
+	return msg;
+}
+
+/* feeds a received frame into the reassembly of its source. Completed
+ * messages are appended to the queue of pending messages. Returns false if
+ * the frame doesn't continue the message of its source */
+bool XBee::xbee_assemble(GBeeRxPacket *rx_frame, uint16_t length) {
+	XBee_Address source(rx_frame);
+	XBee_Message *msg = NULL;
+	uint16_t header_len = rx_frame->data - (uint8_t*) rx_frame;
+
+	/* coalesced frames contain complete messages */
+	if (rx_frame->data[MSG_TYPE] == MSG_TYPE_COALESCED) {
+		rx_part_cnt++;
+		if (!xbee_duplicate(&source, rx_frame->data[MSG_SEQ] << 8 | rx_frame->data[MSG_SEQ + 1]))
+			xbee_split_coalesced(rx_frame->data,
+			(length > header_len) ? length - header_len : 0, &source);
+		return true;
+	}
+
+	if (!xbee_reassemble(rx_partial, rx_partial_timer, XBEE_REASSEMBLY_SIZE, &source,
+	rx_frame->data, &msg))
+		return false;
+	if (msg)
+		xbee_push_pending(msg);
+	return true;
+}
+
+/* feeds a part into a reassembly table with one slot per source, used by
+ * the default stream and the channels. A completed message is returned in
+ * complete, which is NULL otherwise. Returns false if the part doesn't
+ * continue the message of its source */
+bool XBee::xbee_reassemble(XBee_Message **partial, XBee_Timer *partial_timer, uint8_t size,
+		const XBee_Address *source, const uint8_t *data, XBee_Message **complete) {
+	int slot = -1;
+	int free_slot = -1;
+	XBee_Dedup *dedup_entry;
+
+	*complete = NULL;
+	XBee_Message part(data);
+	for (int i = 0; i < size; i++) {
+		if (partial[i] && partial[i]->source.addr64h == source->addr64h &&
+		partial[i]->source.addr64l == source->addr64l)
+			slot = i;
+		else if (!partial[i] && free_slot < 0)
+			free_slot = i;
+	}
+	/* a retransmitted part that was received already */
+	if (slot >= 0 && part.seq == partial[slot]->seq &&
+	partial[slot]->has_part(part.message_part))
+		return true;
+	/* a late retransmit of a message that was completed already, it
+	 * neither replaces the unfinished message of the source nor takes a
+	 * slot */
+	if (slot < 0 || part.seq != partial[slot]->seq) {
+		dedup_entry = xbee_find_dedup(source);
+		if (dedup_entry && dedup_entry->received(part.seq))
+			return true;
+	}
+	/* a part of the next message replaces an unfinished message */
+	if (slot >= 0 && part.seq != partial[slot]->seq) {
+		printf("Dropping incomplete message from %08x%08x\n", source->addr64h, source->addr64l);
+		xbee_drop_partial(&partial[slot], &partial_timer[slot]);
+		free_slot = slot;
+		slot = -1;
+	}
+	if (slot < 0) {
+		/* parts of multi part messages may arrive first, if the
+		 * parts before them were lost and are rebuilt later */
+		if (part.message_part != 1 && part.message_part_cnt < 2)
+			return false;
+		if (free_slot < 0) {
+			free_slot = xbee_idle_partial(partial_timer, size);
+			if (free_slot < 0) {
+				printf("Error: reassembly table full, dropping part\n");
+				return false;
+			}
+			printf("Error: reassembly table full, dropping incomplete message\n");
+			xbee_drop_partial(&partial[free_slot], &partial_timer[free_slot]);
+		}
+		slot = free_slot;
+		partial[slot] = new XBee_Message;
+		if (!partial[slot])
+			return false;
+		partial[slot]->source = *source;
+	}
+
+	if (!partial[slot]->add_part(part)) {
+		xbee_drop_partial(&partial[slot], &partial_timer[slot]);
+		return false;
+	}
+	rx_part_cnt++;
+	if (partial[slot]->is_complete()) {
+		timers.cancel(&partial_timer[slot]);
+		if (xbee_duplicate(source, partial[slot]->seq))
+			delete partial[slot];
+		else
+			*complete = partial[slot];
+		partial[slot] = NULL;
+	} else {
+		/* the next part has to arrive within the timeout */
+		xbee_arm_timer(&partial_timer[slot], TIMER_REASSEMBLY, &partial[slot],
+		xbee_time_ms() + config.timeout);
+	}
+	return true;
+}
+
+/* returns the numbers received from the source, or NULL if nothing was
+ * received from it yet */
+XBee_Dedup* XBee::xbee_find_dedup(const XBee_Address *source) {
+	for (int i = 0; i < XBEE_DEDUP_SIZE; i++) {
+		if (dedup[i].used && dedup[i].addr64h == source->addr64h &&
+		dedup[i].addr64l == source->addr64l)
+			return &dedup[i];
+	}
+	return NULL;
+}
+
+/* records the number of a message completed from the source. Returns true
+ * if the message was received before and has to be dropped */
+bool XBee::xbee_duplicate(const XBee_Address *source, uint16_t seq) {
+	XBee_Dedup *entry = xbee_find_dedup(source);
+
+	if (!entry) {
+		/* new sources take a free entry, or replace the entries in a
+		 * round robin manner */
+		for (int i = 0; i < XBEE_DEDUP_SIZE && !entry; i++) {
+			if (!dedup[i].used)
+				entry = &dedup[i];
+		}
+		if (!entry) {
+			entry = &dedup[dedup_next];
+			dedup_next = (dedup_next + 1) % XBEE_DEDUP_SIZE;
+		}
+		entry->used = true;
+		entry->addr64h = source->addr64h;
+		entry->addr64l = source->addr64l;
+		entry->last = seq & MSG_SEQ_MASK;
+		entry->window = 1;
+		entry->sync = (seq & MSG_SEQ_SYNC) ? 1 : 0;
+		return false;
+	}
+
+	return entry->duplicate(seq);
+}
+
+/* returns the slot of a full reassembly table whose source sent nothing for
+ * the longest time, or -1 if every source sent a part within the last half
+ * of the timeout. Those are still active and keep their slot */
+int XBee::xbee_idle_partial(const XBee_Timer *partial_timer, uint8_t size) {
+	uint64_t idle = xbee_time_ms() + config.timeout / 2;
+	int slot = -1;
+
+	/* the timer of a slot expires a timeout after the last part */
+	for (int i = 0; i < size; i++) {
+		if (partial_timer[i].expires <= idle &&
+		(slot < 0 || partial_timer[i].expires < partial_timer[slot].expires))
+			slot = i;
+	}
+	return slot;
+}
+
+/* deletes the unfinished message in a slot of a reassembly table */
+void XBee::xbee_drop_partial(XBee_Message **partial, XBee_Timer *timer) {
+	timers.cancel(timer);
+	delete *partial;
+	*partial = NULL;
+}
+
+/* reassembles the frames in the backlog, and hands the pending messages to
+ * the asynchronous receive operations waiting for them */
+void XBee::xbee_dispatch_received() {
+	GBeeFrameData frame;
+	uint16_t length;
+	uint32_t timeout = 0;
+	XBee_Rx_Waiter *waiter;
+	XBee_Message *msg;
+
+	while (rx_backlog_cnt > 0 && rx_pending_cnt < XBEE_RX_PENDING_SIZE) {
+		xbee_read_frame(&frame, &length, &timeout);
+		xbee_assemble((GBeeRxPacket*) &frame, length);
+	}
+	xbee_dispatch_channels();
+
+	for (int i = 0; i < rx_pending_cnt && rx_waiter_cnt > 0; ) {
+		msg = rx_pending[i];
+		waiter = NULL;
+		for (int j = 0; j < XBEE_RX_WAITER_SIZE && !waiter; j++) {
+			if (rx_waiters[j].used && (rx_waiters[j].any_source ||
+			(rx_waiters[j].source.addr64h == msg->source.addr64h &&
+			rx_waiters[j].source.addr64l == msg->source.addr64l)))
+				waiter = &rx_waiters[j];
+		}
+		if (!waiter) {
+			i++;
+			continue;
+		}
+		xbee_remove_pending(i);
+		xbee_rx_waiter_complete(waiter, msg);
+	}
+}
+
+/* frees the receive operation and passes the message, or NULL after the
+ * timeout, to its callback */
+void XBee::xbee_rx_waiter_complete(XBee_Rx_Waiter *waiter, XBee_Message *msg) {
+	xbee_message_cb callback = waiter->callback;
+
+	/* free the waiter before the callback, it may wait again */
+	timers.cancel(&waiter->timer);
+	waiter->used = false;
+	waiter->callback = nullptr;
+	rx_waiter_cnt--;
+	callback(msg);
+}
+
+/* returns true if a message is waiting to be received, either as data
+ * in the buffer of the serial device or unpacked from a coalesced frame */
+bool XBee::xbee_message_pending() {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	return rx_pending_cnt > 0 || rx_backlog_cnt > 0 || xbee_bytes_available() > 0;
+}
+
+/* receives the next frame from the device, and records it if a capture is
+ * running. All frames are received through this function */
+GBeeError XBee::xbee_receive_frame(GBeeFrameData *frame, uint16_t *length, uint32_t *timeout) {
+	GBeeError error_code = gbeeReceive(gbee_handle, frame, length, timeout);
+
+	if (capture_file && error_code == GBEE_NO_ERROR)
+		xbee_capture(XBEE_CAPTURE_RX, (const uint8_t*) frame, *length);
+	return error_code;
+}
+
+/* sends a ZigBee transmit request frame, and records it if a capture is
+ * running */
+GBeeError XBee::xbee_send_tx_request(uint8_t frame_id, const XBee_Address *addr,
+		uint8_t bcast_radius, uint8_t options, uint8_t *data, uint16_t length) {
+	uint8_t frame[XBEE_MSG_LENGTH + 14];
+
+	if (capture_file && length <= XBEE_MSG_LENGTH) {
+		/* reconstruct the frame data as the device receives it: frame type,
+		 * frame id, 64 and 16-bit address in big-endian, radius, options */
+		frame[0] = 0x10;
+		frame[1] = frame_id;
+		for (int i = 0; i <= 3; i++) {
+			frame[i+2] = addr->addr64h >> (3-i)*8;
+			frame[i+6] = addr->addr64l >> (3-i)*8;
+		}
+		frame[10] = addr->addr16 >> 8;
+		frame[11] = addr->addr16;
+		frame[12] = bcast_radius;
+		frame[13] = options;
+		memcpy(&frame[14], data, length);
+		xbee_capture(XBEE_CAPTURE_TX, frame, length + 14);
+	}
+	if (!gbee_handle)
+		return GBEE_RESPONSE_ERROR;
+	return gbeeSendTxRequest(gbee_handle, frame_id, addr->addr64h, addr->addr64l,
+		addr->addr16, bcast_radius, options, data, length);
+}
+
+/* sends an AT command frame, and records it if a capture is running */
+GBeeError XBee::xbee_send_at(uint8_t frame_id, const xbee_string &at_command,
+		uint8_t *data, uint16_t length) {
+	uint8_t at_cmd[2];
+	uint8_t frame[4 + 256];
+
+	if (capture_file && length <= 256) {
+		/* frame type, frame id, AT command and parameter value */
+		frame[0] = 0x08;
+		frame[1] = frame_id;
+		memcpy(&frame[2], at_command.c_str(), 2);
+		memcpy(&frame[4], data, length);
+		xbee_capture(XBEE_CAPTURE_TX, frame, length + 4);
+	}
+	/* not initialized, there is no radio to send to */
+	if (!gbee_handle)
+		return GBEE_RESPONSE_ERROR;
+	return gbeeSendAtCommand(gbee_handle, frame_id, at_cmd_str(at_command, at_cmd),
+		data, length);
+}
+
+/* sends a remote AT command request: frame id, 64 and 16-bit destination
+ * address, command options, AT command and parameter value */
+GBeeError XBee::xbee_send_remote_at(uint8_t frame_id, const XBee_Address *addr,
+		uint8_t options, const xbee_string &at_command, uint8_t *data, uint16_t length) {
+	uint8_t at_cmd[2];
+	uint8_t frame[15 + 256];
+
+	if (capture_file && length <= 256) {
+		frame[0] = 0x17;
+		frame[1] = frame_id;
+		for (int i = 0; i < 4; i++) {
+			frame[2 + i] = addr->addr64h >> (3 - i) * 8;
+			frame[6 + i] = addr->addr64l >> (3 - i) * 8;
+		}
+		frame[10] = addr->addr16 >> 8;
+		frame[11] = addr->addr16 & 0xFF;
+		frame[12] = options;
+		memcpy(&frame[13], at_command.c_str(), 2);
+		memcpy(&frame[15], data, length);
+		xbee_capture(XBEE_CAPTURE_TX, frame, length + 15);
+	}
+	if (!gbee_handle)
+		return GBEE_RESPONSE_ERROR;
+	return gbeeSendRemoteAtCommand(gbee_handle, frame_id, addr->addr64h, addr->addr64l,
+		addr->addr16, options, at_cmd_str(at_command, at_cmd), data, length);
+}
+
+/* writes an API frame to the device, for frame types libgbee has no
+ * function for. The data starts with the frame type, the start delimiter,
+ * length and checksum are added. In API mode 2 special bytes are escaped */
+GBeeError XBee::xbee_send_frame(const uint8_t *data, uint16_t length) {
+	uint8_t frame[2 * (GBEE_MAX_FRAME_SIZE + 3) + 1];
+	uint8_t raw[GBEE_MAX_FRAME_SIZE + 3];
+	uint8_t checksum = 0xFF;
+	uint16_t pos = 0;
+	ssize_t written;
+
+	if (length > GBEE_MAX_FRAME_SIZE)
+		return GBEE_FRAME_SIZE_ERROR;
+	if (capture_file)
+		xbee_capture(XBEE_CAPTURE_TX, data, length);
+	/* not initialized, there is no radio to send to */
+	if (!gbee_handle)
+		return GBEE_RESPONSE_ERROR;
+
+	/* length in big-endian, frame data and checksum */
+	raw[0] = length >> 8;
+	raw[1] = length;
+	memcpy(&raw[2], data, length);
+	for (int i = 0; i < length; i++)
+		checksum -= data[i];
+	raw[length + 2] = checksum;
+
+	frame[pos++] = 0x7E;	/* start delimiter */
+	for (int i = 0; i < length + 3; i++) {
+		if (api_escaped && (raw[i] == 0x7E || raw[i] == 0x7D ||
+		raw[i] == 0x11 || raw[i] == 0x13)) {
+			frame[pos++] = 0x7D;
+			frame[pos++] = raw[i] ^ 0x20;
+		} else {
+			frame[pos++] = raw[i];
+		}
+	}
+
+	for (uint16_t offset = 0; offset < pos; offset += written) {
+		written = write(gbee_handle->serialDevice, &frame[offset], pos - offset);
+		if (written < 0) {
+			printf("Error writing frame: %s\n", strerror(errno));
+			return GBEE_RESPONSE_ERROR;
+		}
+	}
+	return GBEE_NO_ERROR;
+}
+
+/* stores the route of a route record indicator frame, see
+ * XBee_Route::parse_record */
+void XBee::xbee_route_record(const uint8_t *data, uint16_t length) {
+	XBee_Address addr;
+	XBee_Route record;
+	XBee_Route *route;
+
+	if (!record.parse_record(data, length)) {
+		printf("Error: malformed route record\n");
+		return;
+	}
+	addr.addr64h = record.addr64h;
+	addr.addr64l = record.addr64l;
+	addr.addr16 = record.addr16;
+	/* the node just sent a frame, so it's awake */
+	xbee_node_awake(&addr);
+
+	route = xbee_lookup_route(&addr);
+	if (record.hop_cnt > XBEE_ROUTE_MAX_HOPS) {
+		/* too long for a source route, leave it to route discovery */
+		if (route)
+			route->used = false;
+		return;
+	}
+	/* new nodes take a free entry, or replace the entries in a round
+	 * robin manner */
+	for (int i = 0; i < XBEE_ROUTE_CACHE_SIZE && !route; i++) {
+		if (!route_cache[i].used)
+			route = &route_cache[i];
+	}
+	if (!route) {
+		route = &route_cache[route_cache_next];
+		route_cache_next = (route_cache_next + 1) % XBEE_ROUTE_CACHE_SIZE;
+	}
+	/* an unchanged route is already known to the device */
+	if (route->used && route->same_route(record))
+		return;
+	*route = record;
+	route->used = true;
+	route->sent = false;
+}
+
+/* handles an explicit rx indicator frame: 64 and 16-bit source address,
+ * source and destination endpoint, cluster id, profile id and options, all
+ * in big-endian, followed by the message. Frames for the data endpoint of
+ * the default stream are passed on as regular rx packets */
+void XBee::xbee_explicit_rx(GBeeFrameData *frame, uint16_t length) {
+	const uint8_t *data = frame->data;
+	XBee_Address source;
+	XBee_Channel *ch = NULL;
+	XBee_Message *msg;
+	uint16_t cluster;
+
+	/* the length includes the frame type */
+	if (length < 1 + XBEE_EXPLICIT_RX_HEADER + MSG_HEADER_LENGTH) {
+		printf("Error: malformed explicit rx frame\n");
+		return;
+	}
+	cluster = data[12] << 8 | data[13];
+
+	if (data[11] == XBEE_DATA_ENDPOINT && cluster == XBEE_DATA_CLUSTER) {
+		GBeeFrameData rx;
+		/* same addresses, the options follow them directly */
+		rx.ident = GBEE_RX_PACKET;
+		memcpy(rx.data, data, 10);
+		rx.data[10] = data[16];
+		memcpy(&rx.data[11], &data[XBEE_EXPLICIT_RX_HEADER], length - 1 - XBEE_EXPLICIT_RX_HEADER);
+		xbee_handle_frame(&rx, length - (XBEE_EXPLICIT_RX_HEADER - 11));
+		return;
+	}
+
+	for (int i = 0; i < XBEE_CHANNEL_CNT && !ch; i++) {
+		if (channels[i].used && channels[i].endpoint == data[11] &&
+		channels[i].cluster == cluster)
+			ch = &channels[i];
+	}
+	if (!ch) {
+		printf("Received frame for unknown channel: endpoint=%02x cluster=%04x\n",
+		data[11], cluster);
+		return;
+	}
+
+	for (int i = 0; i <= 3; i++) {
+		source.addr64h |= (uint32_t)data[i] << (3-i)*8;
+		source.addr64l |= (uint32_t)data[i+4] << (3-i)*8;
+	}
+	source.addr16 = data[8] << 8 | data[9];
+	if (config.store_and_forward)
+		xbee_node_awake(&source);
+	xbee_query_rssi(&source);
+
+	if (!xbee_reassemble(ch->partial, ch->partial_timer, XBEE_CHANNEL_PARTIAL_SIZE,
+	&source, &data[XBEE_EXPLICIT_RX_HEADER], &msg) || !msg)
+		return;
+	if (ch->pending_cnt >= XBEE_CHANNEL_PENDING_SIZE) {
+		ch->drops++;
+		delete msg;
+		return;
+	}
+	ch->pending[(ch->pending_head + ch->pending_cnt) % XBEE_CHANNEL_PENDING_SIZE] = msg;
+	ch->pending_cnt++;
+}
+
+/* sends an explicit addressing command frame: frame id, 64 and 16-bit
+ * destination address, source and destination endpoint, cluster id,
+ * profile id, radius and options, followed by the message part */
+GBeeError XBee::xbee_send_explicit(uint8_t frame_id, const XBee_Address *addr,
+		const XBee_Channel *channel, const uint8_t *data, uint16_t length) {
+	uint8_t frame[20 + XBEE_MSG_LENGTH];
+
+	if (length > XBEE_MSG_LENGTH)
+		return GBEE_FRAME_SIZE_ERROR;
+	frame[0] = XBEE_EXPLICIT_TX;
+	frame[1] = frame_id;
+	for (int i = 0; i <= 3; i++) {
+		frame[i+2] = addr->addr64h >> (3-i)*8;
+		frame[i+6] = addr->addr64l >> (3-i)*8;
+	}
+	frame[10] = addr->addr16 >> 8;
+	frame[11] = addr->addr16;
+	frame[12] = channel->endpoint;	/* the same endpoint on both sides */
+	frame[13] = channel->endpoint;
+	frame[14] = channel->cluster >> 8;
+	frame[15] = channel->cluster;
+	frame[16] = XBEE_DIGI_PROFILE >> 8;
+	frame[17] = XBEE_DIGI_PROFILE & 0xFF;
+	frame[18] = 0x00;	/* max hops */
+	frame[19] = 0x00;	/* options */
+	memcpy(&frame[20], data, length);
+	return xbee_send_frame(frame, 20 + length);
+}
+
+/* returns the cached route to the node with the 64-bit address, or NULL */
+XBee_Route* XBee::xbee_lookup_route(const XBee_Address *addr) {
+	for (int i = 0; i < XBEE_ROUTE_CACHE_SIZE; i++) {
+		if (route_cache[i].used && route_cache[i].addr64h == addr->addr64h &&
+		route_cache[i].addr64l == addr->addr64l)
+			return &route_cache[i];
+	}
+	return NULL;
+}
+
+/* sends a create source route frame, see XBee_Route::get_frame */
+GBeeError XBee::xbee_send_source_route(const XBee_Route *route) {
+	uint8_t frame[XBEE_SOURCE_ROUTE_LENGTH];
+
+	return xbee_send_frame(frame, route->get_frame(frame));
+}
+
+/* starts recording all frames sent and received to a capture file. The
+ * frames are appended, if the file exists already. Returns false if the
+ * file couldn't be opened */
+bool XBee::xbee_capture_start(const xbee_path &path) {
+	XBee_Guard guard(io_lock, config.thread_safe);
+	XBee_Capture_Header header;
+
+	xbee_capture_stop();
+	capture_file = fopen(path.c_str(), "ab");
+	if (!capture_file) {
+		printf("Error opening capture file %s\n", path.c_str());
+		return false;
+	}
+	/* records are collected in a large buffer, to keep the overhead of
+	 * the capture low */
+	setvbuf(capture_file, NULL, _IOFBF, XBEE_CAPTURE_BUFFER_SIZE);
+
+	/* new files start with a header */
+	if (ftell(capture_file) == 0) {
+		memcpy(header.magic, XBEE_CAPTURE_MAGIC, 4);
+		header.version = XBEE_CAPTURE_VERSION;
+		header.record_header_len = sizeof(XBee_Capture_Record);
+		header.start = xbee_time_ns();
+		fwrite(&header, sizeof(header), 1, capture_file);
+	}
+	return true;
+}
+
+/* stops recording frames and writes the buffered records to the file */
+void XBee::xbee_capture_stop() {
+	XBee_Guard guard(io_lock, config.thread_safe);
+
+	if (!capture_file)
+		return;
+	fclose(capture_file);
+	capture_file = NULL;
+}
+
+/* appends a frame to the capture file */
+void XBee::xbee_capture(uint8_t direction, const uint8_t *data, uint16_t length) {
+	XBee_Capture_Record record;
+
+	record.timestamp = xbee_time_ns();
+	record.length = length;
+	record.direction = direction;
+	record.reserved = 0;
+	fwrite(&record, sizeof(record), 1, capture_file);
+	fwrite(data, 1, length, capture_file);
+}
+
+/* the decoder of xbee_replay_capture lives in static memory, it is too
+ * large for the stack and aligned beyond what new guarantees. One capture
+ * is replayed at a time */
+static std::aligned_storage<sizeof(XBee), alignof(XBee)>::type xbee_replay_store;
+static std::atomic<bool> xbee_replay_busy(false);
+
+/* feeds the received frames of a capture file through the receive,
+ * reassembly and dispatch code as fast as possible. The file is mapped into
+ * memory, so reading it costs close to nothing. Completed messages are
+ * passed to the handler, which takes ownership of them; without a handler
+ * they are deleted. Frames other than received packets, explicit rx
+ * frames, transmit status, modem status and route records are skipped.
+ * The frames are decoded by a detached interface with the same
+ * configuration and without a radio, which starts with empty state. This
+ * interface is left alone: it sends no "DB" queries, doesn't forward held
+ * messages, and keeps its routes, transmit queue and duplicate detection.
+ * It doesn't need to be initialized for a replay. Messages on its channels
+ * are passed to the handler as well, not to the channel handlers. Returns
+ * the number of replayed frames, or -1 if the file isn't a valid capture or
+ * another capture is replayed */
+int XBee::xbee_replay_capture(const xbee_path &path, xbee_message_cb handler,
+		XBee_Replay_Stats *stats) {
+	XBee_Config replay_config(config);
+	XBee *decoder;
+	const XBee_Capture_Header *header;
+	const XBee_Capture_Record *record;
+	const uint8_t *data;
+	GBeeFrameData frame;
+	struct stat file_stat;
+	size_t offset;
+	int frames = 0;
+	int fd;
+
+	fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0 || fstat(fd, &file_stat) < 0 ||
+	(size_t)file_stat.st_size < sizeof(XBee_Capture_Header)) {
+		printf("Error opening capture file %s\n", path.c_str());
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	data = (const uint8_t*) mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		printf("Error mapping capture file %s\n", path.c_str());
+		return -1;
+	}
+	/* the file is read sequentially */
+	madvise((void*) data, file_stat.st_size, MADV_SEQUENTIAL);
+
+	header = (const XBee_Capture_Header*) data;
+	if (memcmp(header->magic, XBEE_CAPTURE_MAGIC, 4) ||
+	header->version != XBEE_CAPTURE_VERSION) {
+		printf("Error: %s is not a capture file\n", path.c_str());
+		munmap((void*) data, file_stat.st_size);
+		return -1;
+	}
+
+	replay_config.thread_safe = false;
+	replay_config.store_and_forward = false;
+	replay_config.discovery_interval = 0;
+	if (xbee_replay_busy.exchange(true)) {
+		printf("Error: another capture is replayed\n");
+		munmap((void*) data, file_stat.st_size);
+		return -1;
+	}
+	decoder = new (&xbee_replay_store) XBee(replay_config);
+
+	/* the channels of the interface are opened on the decoder, their
+	 * messages are passed to the handler like the others */
+	xbee_message_cb deliver = [stats, &handler](XBee_Message *msg) {
+		if (stats) {
+			stats->messages++;
+			stats->payload_bytes += msg->payload_len;
+		}
+		if (handler)
+			handler(msg);
+		else
+			delete msg;
+	};
+	{
+		XBee_Guard guard(io_lock, config.thread_safe);
+		for (int i = 0; i < XBEE_CHANNEL_CNT; i++) {
+			if (channels[i].used)
+				decoder->xbee_open_channel(channels[i].endpoint, channels[i].cluster,
+				channels[i].window, deliver);
+		}
+	}
+
+	offset = sizeof(XBee_Capture_Header);
+	while (offset + header->record_header_len <= (size_t)file_stat.st_size) {
+		record = (const XBee_Capture_Record*) &data[offset];
+		offset += header->record_header_len;
+		/* stop at a record that was cut off while writing */
+		if (offset + record->length > (size_t)file_stat.st_size)
+			break;
+		if (stats)
+			stats->frames++;
+		if (record->direction != XBEE_CAPTURE_RX || record->length > sizeof(frame) ||
+		(data[offset] != GBEE_RX_PACKET && data[offset] != GBEE_TX_STATUS_NEW &&
+		data[offset] != GBEE_MODEM_STATUS && data[offset] != XBEE_ROUTE_RECORD &&
+		data[offset] != XBEE_EXPLICIT_RX)) {
+			if (stats)
+				stats->skipped++;
+			offset += record->length;
+			continue;
+		}
+		memcpy(&frame, &data[offset], record->length);
+		offset += record->length;
+		frames++;
+
+		/* the same path frames take when received from the device */
+		decoder->xbee_handle_frame(&frame, record->length);
+		decoder->xbee_dispatch_received();
+		while (decoder->rx_pending_cnt > 0)
+			deliver(decoder->xbee_remove_pending(0));
+	}
+
+	decoder->~XBee();
+	xbee_replay_busy = false;
+	munmap((void*) data, file_stat.st_size);
+	return frames;
 }
 
-/* converts a std::string into a ASCII coded byte array - the length of
- * the byte array is fixed to a length of an AT command (2 chars) */
-uint8_t* XBee::at_cmd_str(const std::string at_cmd_str) {
-	static uint8_t at_cmd[2];
+/* converts a string into a ASCII coded byte array - the length of
+ * the byte array is fixed to a length of an AT command (2 chars). The
+ * caller provides the memory for the byte array */
+uint8_t* XBee::at_cmd_str(const xbee_string &at_cmd_str, uint8_t *at_cmd) {
 	memcpy(at_cmd, at_cmd_str.c_str(), 2);
-	return &at_cmd[0];
+	return at_cmd;
 }
 
 
@@ -21,17 +21,210 @@
 
 #include <gbee.h>
 #include <string>
+#include <functional>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <type_traits>
 #include <inttypes.h>
+#include "xbee_queue.h"
+#include "xbee_timer.h"
+
+/* heap-free build: all containers have a fixed capacity, and the objects
+ * the interface creates at runtime are taken from pools in static memory.
+ * The capacities can be overridden on the command line */
+#ifdef XBEE_STATIC_ALLOC
+#include "xbee_static.h"
+#define XBEE_NODE_ID_LENGTH 20	/* "NI" has at most 20 characters */
+#define XBEE_PATH_LENGTH 64	/* serial port and capture files */
+#ifndef XBEE_STATIC_PAYLOAD_SIZE
+#define XBEE_STATIC_PAYLOAD_SIZE 1024	/* largest message */
+#endif
+#ifndef XBEE_AT_DATA_SIZE
+#define XBEE_AT_DATA_SIZE 64	/* largest AT parameter or response */
+#endif
+#ifndef XBEE_MSG_POOL_SIZE
+#define XBEE_MSG_POOL_SIZE 64	/* messages queued, reassembled, held and
+				 * not yet deleted by the application */
+#endif
+#ifndef XBEE_AT_POOL_SIZE
+#define XBEE_AT_POOL_SIZE 8	/* AT commands issued by the interface */
+#endif
+#ifndef XBEE_SUBMISSION_POOL_SIZE
+#define XBEE_SUBMISSION_POOL_SIZE 32
+#endif
+#ifndef XBEE_WAIT_POOL_SIZE
+#define XBEE_WAIT_POOL_SIZE 32	/* requests waiting for a free slot */
+#endif
+#ifndef XBEE_LOOKUP_POOL_SIZE
+#define XBEE_LOOKUP_POOL_SIZE 8	/* address lookups running at once */
+#endif
+#ifndef XBEE_SEND_POOL_SIZE
+#define XBEE_SEND_POOL_SIZE 8	/* sends waiting for an address lookup */
+#endif
+typedef XBee_Fixed_String<XBEE_NODE_ID_LENGTH> xbee_string;
+typedef XBee_Fixed_String<XBEE_PATH_LENGTH> xbee_path;
+#else
+typedef std::string xbee_string;
+typedef std::string xbee_path;
+#endif
 
 #define XBEE_MSG_LENGTH 84
-#define XBEE_ADDR_CACHE_SIZE 4
+#define XBEE_ADDR_CACHE_SIZE 64
 
-#define MSG_HEADER_LENGTH 4
+#define MSG_HEADER_LENGTH 6
 /* define position of values in the header */
 #define MSG_TYPE 0x00
 #define MSG_PART 0x01
 #define MSG_PART_CNT 0x02
 #define MSG_PAYLOAD_LENGTH 0x03
+#define MSG_SEQ 0x04		/* 2 bytes, big-endian */
+
+/* messages are numbered per destination, retransmitted parts keep the
+ * number of their message. The receiver keeps a window of the numbers it
+ * received from each source and drops repeated messages. The sync flag is
+ * set until a message of the sender was delivered, it lets the receiver
+ * restart its window after the sender lost its numbering */
+#define MSG_SEQ_MASK 0x7FFF
+#define MSG_SEQ_SYNC 0x8000
+#define XBEE_DEDUP_WINDOW 64	/* bits of the window */
+#define XBEE_DEDUP_SIZE 32	/* sources */
+
+/* multi part messages can be followed by parity parts, which let the
+ * receiver rebuild a lost part without a retransmission. The data parts
+ * are split into groups of XBee_Config::fec_group parts, and each group
+ * gets fec_parity parity parts. Parity part j of a group is the XOR of
+ * every fec_parity-th data part of the group starting with part j, so a
+ * burst of up to fec_parity lost parts can be rebuilt. Parity parts are
+ * numbered after the data parts, the part count in the header only counts
+ * the data parts. Their payload starts with a sub-header */
+#define FEC_HEADER_LENGTH 3
+/* define position of values in the sub-header */
+#define FEC_GROUP 0x00		/* data parts per group */
+#define FEC_PARITY 0x01		/* parity parts per group */
+#define FEC_LENGTH 0x02		/* XOR of the lengths of the covered parts */
+#define FEC_MAX_PART_SIZE (XBEE_MSG_LENGTH - MSG_HEADER_LENGTH - FEC_HEADER_LENGTH)
+#define FEC_MASK_WORDS 4	/* 64-bit words of a bitmap of 255 parts */
+
+/* coalesced frames carry several small messages for the same destination.
+ * They use the regular header with a reserved message type, followed by
+ * records that consist of a sub-header and the payload of one message */
+#define MSG_TYPE_COALESCED 0xFF
+#define COALESCE_SUB_HEADER_LENGTH 2
+/* define position of values in the sub-header */
+#define COALESCE_SUB_TYPE 0x00
+#define COALESCE_SUB_LENGTH 0x01
+/* only messages that leave room for at least one more record are coalesced */
+#define COALESCE_MAX_PAYLOAD ((XBEE_MSG_LENGTH - MSG_HEADER_LENGTH) / 2 - COALESCE_SUB_HEADER_LENGTH)
+#define XBEE_COALESCE_CACHE_SIZE 4
+#define XBEE_COALESCE_RETRY 10	/* ms, flush retry if the transmit queue is full */
+/* completed messages waiting to be received, at least the number of
+ * messages that can be unpacked from one coalesced frame */
+#define XBEE_RX_PENDING_SIZE ((XBEE_MSG_LENGTH - MSG_HEADER_LENGTH) / COALESCE_SUB_HEADER_LENGTH)
+/* number of sources that can send multi part messages at the same time */
+#define XBEE_REASSEMBLY_SIZE 4
+
+/* transmit flow control */
+#define XBEE_TX_QUEUE_SIZE 16	/* messages waiting for transmission */
+#define XBEE_TX_WINDOW 4	/* frames in flight, limited by the radio buffer */
+#define XBEE_TX_RETRIES 3	/* retransmissions of a part before giving up */
+#define XBEE_BACKOFF_BASE 50	/* ms, doubled with each delivery failure */
+#define XBEE_BACKOFF_MAX 5000	/* ms */
+/* one destination per known node. Destinations with messages in the
+ * transmit queue are never replaced, so the cache has to be larger than it */
+#define XBEE_DEST_CACHE_SIZE XBEE_ADDR_CACHE_SIZE
+
+/* link quality of the destinations: the delivery rate is a moving average
+ * of the delivered parts in per mille, the retries a moving average of the
+ * MAC retries reported by the transmit status in 1/16, the RSSI is the
+ * signal strength of the last packet received from the node in -dBm */
+#define XBEE_LINK_GOOD_RATE 950
+#define XBEE_LINK_POOR_RATE 700
+#define XBEE_LINK_GOOD_RETRIES 16
+#define XBEE_LINK_POOR_RETRIES 48
+#define XBEE_LINK_GOOD_RSSI 80
+#define XBEE_LINK_POOR_RSSI 90
+#define XBEE_RSSI_INTERVAL 5000	/* ms between RSSI queries per destination */
+/* frames received while waiting for other frames */
+#define XBEE_RX_BACKLOG_SIZE 8
+/* status returned by the non-blocking send functions if the queue is full */
+#define XBEE_TX_QUEUE_FULL 0xFC
+/* status returned if a network discovery is started while one is running */
+#define XBEE_DISCOVERY_RUNNING 0xFB
+/* status returned by xbee_try_send_to_node if the message waits for the
+ * lookup of the node */
+#define XBEE_ADDRESS_UNKNOWN 0xF8
+
+/* store-and-forward for sleeping end devices */
+#define XBEE_SLEEP_NODE_CNT 16	/* nodes that messages can be held for */
+#define XBEE_HELD_MSG_CNT 8	/* messages held per node */
+/* status returned if the message is held until the node wakes up */
+#define XBEE_MSG_HELD 0xFA
+/* status of a held CONFIG message that was replaced by a newer one */
+#define XBEE_MSG_SUPERSEDED 0xF9
+
+/* receive worker pools */
+#define XBEE_RX_POOL_CNT 3	/* one pool per xbee_msg_type */
+#define XBEE_RX_WORKER_MAX 16	/* worker threads of all pools */
+#define XBEE_RX_RING_SIZE 256	/* messages queued per worker, power of two */
+
+/* node discovery ("ND") responses: 16-bit address, 64-bit address, the node
+ * identifier terminated by a NUL, followed by the parent address, device
+ * type, status, profile id and manufacturer id */
+#define ND_NODE_ID 10		/* position of the node identifier */
+#define ND_MIN_LENGTH (ND_NODE_ID + 1)
+#define XBEE_DEFAULT_NT 6000	/* ms, discovery time if "NT" can't be read */
+
+/* source routing: the coordinator sends many-to-one route broadcasts, the
+ * nodes answer with route records that are used to address them with
+ * source routes. libgbee has no functions for these frame types */
+#define XBEE_ROUTE_RECORD 0xA1		/* route record indicator frame */
+#define XBEE_CREATE_SOURCE_ROUTE 0x21	/* create source route frame */
+#define XBEE_ROUTE_CACHE_SIZE XBEE_ADDR_CACHE_SIZE
+#define XBEE_ROUTE_MAX_HOPS 11
+#define XBEE_SOURCE_ROUTE_LENGTH (14 + 2 * XBEE_ROUTE_MAX_HOPS)
+/* transmit status values that indicate a broken route */
+#define TX_STATUS_NETWORK_ACK_FAILURE 0x21
+#define TX_STATUS_ROUTE_NOT_FOUND 0x25
+
+/* logical channels: messages on a channel are sent with explicit addressing
+ * frames to an endpoint and cluster id of the node. The regular transmit
+ * request uses the data endpoint and cluster of Digi, which is the default
+ * stream. Receiving explicit frames requires "AO" = 1 */
+#define XBEE_EXPLICIT_TX 0x11		/* explicit addressing command frame */
+#define XBEE_EXPLICIT_RX 0x91		/* explicit rx indicator frame */
+#define XBEE_EXPLICIT_RX_HEADER 17	/* addresses, endpoints, cluster id,
+					 * profile id and options */
+#define XBEE_DATA_ENDPOINT 0xE8
+#define XBEE_DATA_CLUSTER 0x0011
+#define XBEE_DIGI_PROFILE 0xC105
+#define XBEE_CHANNEL_CNT 8
+#define XBEE_CHANNEL_PARTIAL_SIZE 2	/* sources sending multi part messages */
+#define XBEE_CHANNEL_PENDING_SIZE 16	/* completed messages per channel */
+#define XBEE_NO_CHANNEL 0xFF		/* default stream */
+
+/* frame capture files: a header, followed by a record header and the frame
+ * data (starting with the frame type) for each frame. Values are stored in
+ * host byte order */
+#define XBEE_CAPTURE_MAGIC "XBCP"
+#define XBEE_CAPTURE_VERSION 2	/* 2: message header with sequence number */
+#define XBEE_CAPTURE_RX 0x00	/* frame received from the device */
+#define XBEE_CAPTURE_TX 0x01	/* frame sent to the device */
+#define XBEE_CAPTURE_BUFFER_SIZE 65536
+
+/* asynchronous operations */
+#ifndef XBEE_AT_PENDING_SIZE
+#define XBEE_AT_PENDING_SIZE 16	/* AT commands waiting for a response */
+#endif
+#define XBEE_RX_WAITER_SIZE 128	/* callbacks waiting for a message */
+
+/* remote AT commands, see XBee::xbee_send_remote_at_commands. A batch takes
+ * one round trip per window, e.g. 5 for 40 nodes with the default window */
+#define XBEE_REMOTE_AT_WINDOW 8		/* default of XBee_Config::remote_at_window */
+#define XBEE_REMOTE_AT_APPLY 0x02	/* option: apply the change right away */
+#define XBEE_AT_TX_FAILURE 0x04		/* status: the command didn't reach the
+					 * node, or its response got lost */
 
 enum xbee_msg_type {
 	CONFIG,
@@ -39,6 +232,45 @@ enum xbee_msg_type {
 	DATA
 };
 
+enum xbee_tx_state {
+	TX_FREE,
+	TX_QUEUED,
+	TX_IN_FLIGHT,
+	TX_DONE
+};
+
+enum xbee_submission_type {
+	SUBMIT_TO_COORDINATOR,
+	SUBMIT_TO_NODE,
+	SUBMIT_AT_COMMAND
+};
+
+/* requests that wait for a free slot, see XBee_Config::queue_timeout */
+enum xbee_wait_type {
+	WAIT_SEND,		/* slot in the transmit queue */
+	WAIT_AT_COMMAND,	/* slot in the table of pending AT commands */
+	WAIT_RECEIVE		/* slot in the table of receive operations */
+};
+
+/* the transmission parameters of a destination follow its link class */
+enum xbee_link_class {
+	LINK_GOOD,
+	LINK_FAIR,
+	LINK_POOR
+};
+
+enum xbee_timer_type {
+	TIMER_TX_STATUS,	/* transmit status of a part in flight */
+	TIMER_BACKOFF,		/* end of the backoff of a destination */
+	TIMER_AT_RESPONSE,	/* response to an AT command */
+	TIMER_RX_WAITER,	/* asynchronous receive operation */
+	TIMER_REASSEMBLY,	/* next part of a multi part message */
+	TIMER_COALESCE,		/* coalescing delay of a buffer */
+	TIMER_DISCOVERY,	/* next background network discovery */
+	TIMER_HELD_EXPIRY,	/* end of the hold time of a held message */
+	TIMER_WAIT		/* end of the wait of a request for a slot */
+};
+
 enum xbee_baud_rate {
 	B1200 = 0,
 	B2400,
@@ -51,15 +283,49 @@ enum xbee_baud_rate {
 };
 
 class XBee_Message;
+class XBee_Address;
+
+struct XBee_Capture_Header {
+	char magic[4];
+	uint16_t version;
+	uint16_t record_header_len;
+	uint64_t start;		/* monotonic time in ns the file was created */
+} __attribute__((packed));
+
+struct XBee_Capture_Record {
+	uint64_t timestamp;	/* monotonic time in ns */
+	uint16_t length;	/* length of the frame data */
+	uint8_t direction;	/* XBEE_CAPTURE_RX or XBEE_CAPTURE_TX */
+	uint8_t reserved;
+} __attribute__((packed));
+
+/* completion callbacks of the asynchronous operations, they are called
+ * exactly once, either right away or from within XBee::xbee_poll. The
+ * address passed to an xbee_address_cb is only valid during the call */
+typedef std::function<void(uint8_t status)> xbee_status_cb;
+typedef std::function<void(XBee_Message *msg)> xbee_message_cb;
+typedef std::function<void(const XBee_Address *addr)> xbee_address_cb;
+typedef std::function<void(const uint8_t *data, uint16_t length)> xbee_data_cb;
+
+/* the callbacks the interface creates internally capture at most two
+ * pointers, usually this and the request they complete. std::function keeps
+ * such callables in its small buffer instead of allocating them, which
+ * bounds the memory of the heap-free build */
+template <typename F>
+inline F xbee_small_cb(F callback) {
+	static_assert(sizeof(F) <= 2 * sizeof(void*) && std::is_trivially_copyable<F>::value,
+		"callback doesn't fit the small buffer of std::function");
+	return callback;
+}
 
 class XBee_Address {
 public:
 	XBee_Address();
-	XBee_Address(const std::string &node, uint16_t addr16, uint32_t addr64h, uint32_t addr64l);
+	XBee_Address(const xbee_string &node, uint16_t addr16, uint32_t addr64h, uint32_t addr64l);
 	XBee_Address(const GBeeRxPacket *rx);
-	XBee_Address(const std::string &node, const uint8_t *payload);
+	XBee_Address(const xbee_string &node, const uint8_t *payload);
 
-	std::string node;
+	xbee_string node;
 	uint16_t addr16;
 	uint32_t addr64h;
 	uint32_t addr64l;
@@ -67,25 +333,68 @@ public:
 
 class XBee_Config {
 public:
-	XBee_Config(const std::string &port, const std::string &node, bool mode, 
+	XBee_Config(const xbee_path &port, const xbee_string &node, bool mode, 
 		uint8_t unique_id, const uint8_t *pan, uint32_t timeout, 
 		enum xbee_baud_rate baud, uint8_t max_unicast_hops);
 
-	const std::string serial_port;
-	const std::string node;
+	const xbee_path serial_port;
+	const xbee_string node;
 	const bool coordinator_mode;
 	const uint8_t unique_id;
 	uint8_t pan_id[8];
 	const uint32_t timeout;
 	const enum xbee_baud_rate baud;
 	const uint8_t max_unicast_hops;
+	/* time in ms that small messages are held back to be coalesced with
+	 * following messages for the same destination, 0 disables coalescing.
+	 * Only the try and async sends are coalesced, and they report success
+	 * once the message is buffered. The blocking sends flush the buffer of
+	 * the destination and return the status of their own frame */
+	uint32_t coalesce_delay;
+	/* hold back transmissions while the radio deasserts CTS, requires
+	 * the flow control lines of the serial port to be connected */
+	bool hw_flow_control;
+	/* allow the interface to be used from multiple threads: public
+	 * functions are serialized and the xbee_submit functions can be
+	 * called from any thread without locking */
+	bool thread_safe;
+	/* time in ms between network discoveries that refresh the address
+	 * cache from within xbee_poll, 0 disables them */
+	uint32_t discovery_interval;
+	/* time between many-to-one route broadcasts of the coordinator ("AR")
+	 * in units of 10 s, 0 = one broadcast at startup, 0xFF disables them */
+	uint8_t many_to_one_interval;
+	/* hold messages for nodes that are asleep, and forward them once
+	 * a frame from the node shows that it is awake */
+	bool store_and_forward;
+	/* time in ms after which held messages are dropped, 0 = never */
+	uint32_t hold_time;
+	/* receive explicit rx indicator frames ("AO" = 1), required for
+	 * messages on channels, see XBee::xbee_open_channel */
+	bool explicit_rx;
+	/* data parts per group of a multi part message that are protected
+	 * by parity parts, 0 disables parity parts */
+	uint8_t fec_group;
+	/* parity parts per group, a lost part is rebuilt by the receiver
+	 * as long as no other part of its parity class was lost */
+	uint8_t fec_parity;
+	/* time in ms that asynchronous requests wait for a free slot in the
+	 * transmit queue, the AT command table or the receive operation table.
+	 * Sends and AT commands fail with XBEE_TX_QUEUE_FULL after it,
+	 * receive operations with NULL */
+	uint32_t queue_timeout;
+	/* remote AT commands a batch keeps in flight, at most one less than
+	 * the XBEE_AT_PENDING_SIZE slots of the AT command table, the last
+	 * one is left to local commands. Raise XBEE_AT_PENDING_SIZE for larger
+	 * windows, the frame ids allow up to 255 */
+	uint8_t remote_at_window;
 };
 
 class XBee_At_Command {
 public:
-	XBee_At_Command(const std::string &command, const uint8_t *cmd_data, uint8_t length);
-	XBee_At_Command(const std::string &command, const std::string &cmd_data);
-	XBee_At_Command(const std::string &command);
+	XBee_At_Command(const xbee_string &command, const uint8_t *cmd_data, uint8_t length);
+	XBee_At_Command(const xbee_string &command, const xbee_string &cmd_data);
+	XBee_At_Command(const xbee_string &command);
 	XBee_At_Command(const XBee_At_Command &cmd);
 	XBee_At_Command& operator=(const XBee_At_Command &cmd);
 	~XBee_At_Command();
@@ -93,12 +402,335 @@ public:
 	void set_data(const uint8_t *data, uint8_t length, uint8_t status);
 	void append_data(const uint8_t *data, uint8_t length, uint8_t status);
 	
-	std::string at_command;
+	xbee_string at_command;
 	uint8_t *data;
 	uint8_t length;
 	uint8_t status;
+#ifdef XBEE_STATIC_ALLOC
+	static void* operator new(size_t size) noexcept;
+	static void operator delete(void *ptr);
+#endif
 private:
+	uint8_t* allocate_data(uint8_t *length);
+	void free_data();
+#ifdef XBEE_STATIC_ALLOC
+	uint8_t data_store[XBEE_AT_DATA_SIZE];
+#endif
+};
+
+class XBee_Coalesce_Buffer {
+public:
+	XBee_Coalesce_Buffer();
+
+	XBee_Address addr;
+	uint8_t buffer[XBEE_MSG_LENGTH - MSG_HEADER_LENGTH];
+	uint8_t length;		/* used bytes in buffer */
+	uint8_t msg_cnt;	/* number of messages packed into the buffer */
+	XBee_Timer timer;	/* flushes the buffer */
+};
+
+class XBee_Tx_Entry {
+public:
+	XBee_Tx_Entry();
+
+	XBee_Message *msg;
+	XBee_Address addr;
+	enum xbee_tx_state state;
+	uint32_t seq;		/* enqueue order, keeps messages in order */
+	uint16_t part;		/* part of the message that is sent next */
+	uint8_t frame_id;	/* frame id of the part in flight */
+	uint8_t retry_cnt;
+	uint8_t tx_status;
+	bool detached;		/* slot is released on completion */
+	uint8_t channel;	/* XBEE_NO_CHANNEL for the default stream */
+	uint64_t fec_lost[FEC_MASK_WORDS];	/* parity parts that are needed,
+					 * because a data part was lost */
+	XBee_Timer timer;	/* fails the part without tx status */
+	xbee_status_cb callback;	/* called on completion of detached entries */
+};
+
+class XBee_At_Request {
+public:
+	XBee_At_Request();
+
+	bool used;
+	XBee_At_Command *cmd;	/* receives the response, owned by the caller */
+	uint8_t frame_id;
+	bool multi;		/* the command has a response per node */
+	bool remote;		/* the command was sent to another node */
+	uint16_t response_cnt;
+	XBee_Timer timer;	/* completes the request without response */
+	xbee_data_cb response_cb;	/* receives the responses of multi
+					 * response commands one by one */
+	xbee_status_cb callback;
+};
+
+class XBee_Rx_Waiter {
+public:
+	XBee_Rx_Waiter();
+
+	bool used;
+	bool any_source;	/* accept messages from all nodes */
+	XBee_Address source;	/* otherwise match the 64-bit source address */
+	XBee_Timer timer;	/* gives up, not armed if waiting forever */
+	xbee_message_cb callback;
+};
+
+/* asynchronous request that waits for a free slot. It holds the arguments
+ * of the call until it is started by XBee::xbee_poll */
+class XBee_Wait_Entry : public XBee_List_Node {
+public:
+	XBee_Wait_Entry(enum xbee_wait_type type);
+	~XBee_Wait_Entry();
+
+	enum xbee_wait_type type;
+	XBee_Timer timer;	/* fails the request after the queue timeout */
+	XBee_Message *msg;	/* copy of the message, owned by the entry */
+	XBee_Address addr;	/* destination, or source of a receive */
+	bool any_addr;		/* local AT command or receive from all nodes */
+	uint8_t channel;
+	XBee_At_Command *cmd;	/* owned by the caller */
+	uint8_t options;	/* of a remote AT command */
+	uint32_t timeout;	/* of the response or the receive operation */
+	xbee_data_cb response_cb;
+	xbee_status_cb callback;
+	xbee_message_cb msg_callback;	/* of a receive operation */
+#ifdef XBEE_STATIC_ALLOC
+	static void* operator new(size_t size) noexcept;
+	static void operator delete(void *ptr);
+#endif
+};
+
+/* destination node lookup of XBee::xbee_get_address_async, it holds the
+ * command and the callback until the response arrives */
+class XBee_Address_Lookup {
+public:
+	XBee_Address_Lookup(const xbee_string &node, xbee_address_cb callback);
+
+	XBee_At_Command cmd;	/* "DN" with the node identifier */
+	xbee_string node;
+	xbee_address_cb callback;
+#ifdef XBEE_STATIC_ALLOC
+	static void* operator new(size_t size) noexcept;
+	static void operator delete(void *ptr);
+#endif
+};
 
+/* message that is sent once the address of its destination node is known,
+ * see XBee::xbee_send_resolved */
+class XBee_Send_Request {
+public:
+	XBee_Send_Request(uint8_t channel, xbee_status_cb callback);
+	~XBee_Send_Request();
+
+	XBee_Message *msg;	/* copy of the message, owned by the request */
+	uint8_t channel;
+	xbee_status_cb callback;
+#ifdef XBEE_STATIC_ALLOC
+	static void* operator new(size_t size) noexcept;
+	static void operator delete(void *ptr);
+#endif
+};
+
+/* state of XBee::xbee_send_remote_at_commands, shared by the callbacks of
+ * the commands in flight */
+class XBee_At_Batch {
+public:
+	XBee_At_Batch(XBee_At_Command *cmds, const XBee_Address *addrs, uint16_t cnt);
+
+	void fail_node(uint16_t node);
+
+	XBee_At_Command *cmds;
+	const XBee_Address *addrs;
+	uint16_t cnt;
+	uint16_t in_flight;
+	uint16_t done;
+};
+
+/* "AC" that applies the staged changes of a node of a batch */
+class XBee_Apply_Request {
+public:
+	XBee_Apply_Request(XBee_At_Batch *batch, uint16_t node);
+
+	XBee_At_Command cmd;
+	XBee_At_Batch *batch;
+	uint16_t node;		/* index of the first command for the node */
+#ifdef XBEE_STATIC_ALLOC
+	static void* operator new(size_t size) noexcept;
+	static void operator delete(void *ptr);
+#endif
+};
+
+/* request submitted by a producer thread, it is started by the thread
+ * that polls the interface */
+class XBee_Submission : public XBee_Queue_Node {
+public:
+	XBee_Submission(enum xbee_submission_type type);
+	~XBee_Submission();
+
+	enum xbee_submission_type type;
+	XBee_Message *msg;	/* copy of the message, owned by the submission */
+	xbee_string node;
+	XBee_At_Command *cmd;
+	xbee_status_cb callback;
+#ifdef XBEE_STATIC_ALLOC
+	static void* operator new(size_t size) noexcept;
+	static void operator delete(void *ptr);
+#endif
+};
+
+class XBee_Replay_Stats {
+public:
+	XBee_Replay_Stats();
+
+	uint32_t frames;	/* records in the capture file */
+	uint32_t skipped;	/* sent frames and frames of other types */
+	uint32_t messages;	/* completed messages */
+	uint64_t payload_bytes;	/* payload of the completed messages */
+};
+
+class XBee_Destination {
+public:
+	XBee_Destination();
+
+	XBee_Address addr;
+	bool used;
+	uint32_t last_used;	/* dest_clock at the last use, for the replacement */
+	uint8_t failure_cnt;	/* consecutive delivery failures */
+	uint64_t backoff_until;	/* time in ms before the next transmission */
+	XBee_Timer timer;	/* wakes up the transmit queue after the backoff */
+	/* link quality estimates */
+	enum xbee_link_class link_class;
+	uint8_t rssi;		/* -dBm, 0 if unknown */
+	uint16_t delivery_rate;	/* per mille */
+	uint16_t retries;	/* in 1/16 */
+	uint64_t rssi_time;	/* time in ms of the last RSSI query */
+	/* transmission parameters adapted to the link quality */
+	uint8_t retry_budget;	/* retransmissions of a part */
+	uint16_t backoff_base;	/* ms, doubled with each delivery failure */
+	uint8_t part_size;	/* payload bytes per part */
+	uint8_t window;		/* only sent while fewer frames are in flight */
+	uint16_t tx_seq;	/* number of the next message */
+	bool seq_synced;	/* a message was delivered */
+};
+
+/* numbers of the messages received from a source */
+class XBee_Dedup {
+public:
+	XBee_Dedup();
+
+	bool received(uint16_t seq) const;
+	bool duplicate(uint16_t seq);
+
+	bool used;
+	uint32_t addr64h;
+	uint32_t addr64l;
+	uint16_t last;		/* highest number received */
+	uint64_t window;	/* bit n is set if message last - n was received */
+	uint64_t sync;		/* bit n is set if message last - n had the sync flag */
+};
+
+class XBee_Link_Quality {
+public:
+	XBee_Link_Quality();
+
+	enum xbee_link_class link_class;
+	uint8_t rssi;		/* -dBm of the last received packet, 0 if unknown */
+	uint16_t delivery_rate;	/* delivered parts in per mille */
+	uint16_t retries;	/* average MAC retries in 1/16 */
+	uint8_t retry_budget;
+	uint16_t backoff_base;	/* ms */
+	uint8_t part_size;	/* payload bytes per part */
+	uint8_t window;		/* frames in flight */
+};
+
+/* logical channel, bound to an endpoint and cluster id. Each channel has its
+ * own reassembly table, queue of completed messages and transmit window */
+class XBee_Channel {
+public:
+	XBee_Channel();
+
+	bool used;
+	uint8_t endpoint;
+	uint16_t cluster;
+	uint8_t window;		/* frames in flight on the channel */
+	uint8_t in_flight;
+	xbee_message_cb handler;	/* takes ownership of the messages */
+	XBee_Message *partial[XBEE_CHANNEL_PARTIAL_SIZE];
+	XBee_Timer partial_timer[XBEE_CHANNEL_PARTIAL_SIZE];
+	XBee_Message *pending[XBEE_CHANNEL_PENDING_SIZE];
+	uint8_t pending_head;
+	uint8_t pending_cnt;
+	uint32_t drops;		/* messages dropped while the queue was full */
+};
+
+class XBee_Route {
+public:
+	XBee_Route();
+	bool parse_record(const uint8_t *data, uint16_t length);
+	bool same_route(const XBee_Route &route) const;
+	uint16_t get_frame(uint8_t *frame) const;
+
+	bool used;
+	uint32_t addr64h;	/* node the route leads to */
+	uint32_t addr64l;
+	uint16_t addr16;
+	uint8_t hop_cnt;	/* may exceed XBEE_ROUTE_MAX_HOPS in a
+				 * parsed record, see parse_record */
+	uint16_t hops[XBEE_ROUTE_MAX_HOPS];	/* 16-bit addresses of the
+						 * intermediate hops */
+	bool sent;	/* the device holds the route, it's sent again only
+			 * after it changed */
+};
+
+class XBee_Held_Message {
+public:
+	XBee_Held_Message();
+
+	XBee_Message *msg;	/* NULL if the slot is free */
+	uint32_t seq;		/* keeps the messages in order */
+	XBee_Timer timer;	/* drops the message after the hold time */
+	xbee_status_cb callback;	/* called once the message is sent */
+};
+
+class XBee_Sleep_Node {
+public:
+	XBee_Sleep_Node();
+
+	XBee_Address addr;
+	bool used;
+	bool asleep;
+	XBee_Held_Message held[XBEE_HELD_MSG_CNT];
+};
+
+/* worker thread of a receive pool, it consumes the completed messages the
+ * thread polling the interface pushes into its ring */
+class XBee_Rx_Worker {
+public:
+	XBee_Rx_Worker();
+
+	void run();
+
+	XBee_Spsc_Ring<XBee_Message*, XBEE_RX_RING_SIZE> ring;
+	std::thread thread;
+	std::mutex lock;		/* protects the sleep of the worker */
+	std::condition_variable wakeup;
+	std::atomic<bool> sleeping;
+	std::atomic<bool> running;
+	xbee_message_cb handler;	/* takes ownership of the messages */
+	std::atomic<uint32_t> processed;
+	std::atomic<uint32_t> drops;	/* messages dropped while the ring was full */
+	std::atomic<uint32_t> max_depth;
+};
+
+class XBee_Worker_Stats {
+public:
+	XBee_Worker_Stats();
+
+	uint32_t depth;		/* messages in the ring */
+	uint32_t max_depth;
+	uint32_t processed;
+	uint32_t drops;
 };
 
 class XBee {
@@ -109,9 +741,52 @@ public:
 	uint8_t xbee_status();
 	uint8_t xbee_send_at_command(XBee_At_Command& cmd);
 	uint8_t xbee_send_to_coordinator(XBee_Message& msg);
-	uint8_t xbee_send_to_node(XBee_Message& msg, const std::string &node);
+	uint8_t xbee_send_to_node(XBee_Message& msg, const xbee_string &node);
 	XBee_Message* xbee_receive_message();
-	const XBee_Address* xbee_get_address(const std::string &node);
+	uint8_t xbee_try_send_to_coordinator(XBee_Message& msg);
+	uint8_t xbee_try_send_to_node(XBee_Message& msg, const xbee_string &node,
+		xbee_status_cb callback = nullptr);
+	void xbee_send_to_coordinator_async(XBee_Message& msg, xbee_status_cb callback);
+	void xbee_send_to_node_async(XBee_Message& msg, const xbee_string &node,
+		xbee_status_cb callback);
+	void xbee_send_at_command_async(XBee_At_Command& cmd, xbee_status_cb callback);
+	uint8_t xbee_send_remote_at_command(XBee_At_Command& cmd, const xbee_string &node,
+		bool apply);
+	void xbee_send_remote_at_command_async(XBee_At_Command& cmd, const XBee_Address *addr,
+		bool apply, xbee_status_cb callback);
+	uint16_t xbee_send_remote_at_commands(XBee_At_Command *cmds, const XBee_Address *addrs,
+		uint16_t cnt, bool apply);
+	void xbee_receive_message_async(const XBee_Address *source, uint32_t timeout,
+		xbee_message_cb callback);
+	void xbee_get_address_async(const xbee_string &node, xbee_address_cb callback);
+	uint8_t xbee_discover_nodes();
+	bool xbee_mark_sleeping(const xbee_string &node);
+	bool xbee_start_workers(enum xbee_msg_type type, uint8_t worker_cnt,
+		xbee_message_cb handler);
+	void xbee_stop_workers();
+	bool xbee_get_worker_stats(enum xbee_msg_type type, uint8_t worker,
+		XBee_Worker_Stats *stats);
+	bool xbee_get_link_quality(const xbee_string &node, XBee_Link_Quality *quality);
+	uint8_t xbee_open_channel(uint8_t endpoint, uint16_t cluster, uint8_t window,
+		xbee_message_cb handler);
+	void xbee_close_channel(uint8_t channel);
+	uint8_t xbee_send_on_channel(XBee_Message& msg, const xbee_string &node,
+		uint8_t channel);
+	void xbee_send_on_channel_async(XBee_Message& msg, const xbee_string &node,
+		uint8_t channel, xbee_status_cb callback);
+	void xbee_discover_nodes_async(xbee_status_cb callback);
+	void xbee_submit_to_coordinator(XBee_Message& msg, xbee_status_cb callback);
+	void xbee_submit_to_node(XBee_Message& msg, const xbee_string &node,
+		xbee_status_cb callback);
+	void xbee_submit_at_command(XBee_At_Command& cmd, xbee_status_cb callback);
+	uint8_t xbee_poll(uint32_t wait);
+	bool xbee_capture_start(const xbee_path &path);
+	void xbee_capture_stop();
+	int xbee_replay_capture(const xbee_path &path, xbee_message_cb handler,
+		XBee_Replay_Stats *stats);
+	uint8_t xbee_flush();
+	bool xbee_message_pending();
+	bool xbee_get_address(const xbee_string &node, XBee_Address *addr);
 	int xbee_bytes_available();
 	void xbee_test_msg();
 private:
@@ -121,11 +796,172 @@ private:
 	uint8_t xbee_send_ackn(const XBee_Address *addr);
 	uint8_t xbee_receive_acknowledge();
 	uint8_t xbee_configure_device();
-	uint8_t* at_cmd_str(const std::string at_cmd_str);
+	uint8_t xbee_try_send(XBee_Message& msg, const XBee_Address *addr);
+	void xbee_send_async(XBee_Message& msg, const XBee_Address *addr,
+		xbee_status_cb callback);
+	void xbee_submit(XBee_Submission *sub);
+	void xbee_wakeup();
+	void xbee_notify_producers();
+	void xbee_drain_submissions();
+	XBee_Submission* xbee_new_submission(enum xbee_submission_type type,
+		const XBee_Message *msg);
+	XBee_Send_Request* xbee_new_send_request(XBee_Message& msg, uint8_t channel,
+		xbee_status_cb callback);
+	void xbee_send_resolved(XBee_Send_Request *req, const XBee_Address *addr);
+	void xbee_send_or_wait(XBee_Message& msg, const XBee_Address *addr, uint8_t channel,
+		xbee_status_cb callback);
+	void xbee_start_send(XBee_Message& msg, const XBee_Address *addr, uint8_t channel,
+		xbee_status_cb callback);
+	void xbee_queue_at_command(XBee_At_Command& cmd, uint32_t timeout,
+		xbee_data_cb response_cb, xbee_status_cb callback);
+	void xbee_request_at(XBee_At_Command& cmd, const XBee_Address *addr, uint8_t options,
+		uint32_t timeout, xbee_data_cb response_cb, xbee_status_cb callback);
+	void xbee_start_at(XBee_At_Request *req, XBee_At_Command& cmd, const XBee_Address *addr,
+		uint8_t options, uint32_t timeout, xbee_data_cb response_cb, xbee_status_cb callback);
+	XBee_At_Request* xbee_free_at_request();
+	void xbee_start_receive(XBee_Rx_Waiter *waiter, const XBee_Address *source,
+		uint32_t timeout, xbee_message_cb callback);
+	XBee_Rx_Waiter* xbee_free_rx_waiter();
+	XBee_List<XBee_Wait_Entry>* xbee_wait_list(enum xbee_wait_type type);
+	void xbee_wait_for_slot(XBee_Wait_Entry *wait);
+	void xbee_resume_waiting();
+	void xbee_wait_expired(XBee_Wait_Entry *wait);
+	bool xbee_at_response(GBeeAtCommandResponse *at_frame, uint16_t length);
+	bool xbee_remote_at_response(GBeeRemoteAtCommandResponse *at_frame, uint16_t length);
+	void xbee_at_complete(XBee_At_Request *req, uint8_t status);
+	bool xbee_assemble(GBeeRxPacket *rx_frame, uint16_t length);
+	bool xbee_reassemble(XBee_Message **partial, XBee_Timer *partial_timer, uint8_t size,
+		const XBee_Address *source, const uint8_t *data, XBee_Message **complete);
+	int xbee_idle_partial(const XBee_Timer *partial_timer, uint8_t size);
+	void xbee_drop_partial(XBee_Message **partial, XBee_Timer *timer);
+	XBee_Dedup* xbee_find_dedup(const XBee_Address *source);
+	bool xbee_duplicate(const XBee_Address *source, uint16_t seq);
+	void xbee_explicit_rx(GBeeFrameData *frame, uint16_t length);
+	void xbee_dispatch_channels();
+	GBeeError xbee_send_explicit(uint8_t frame_id, const XBee_Address *addr,
+		const XBee_Channel *channel, const uint8_t *data, uint16_t length);
+	void xbee_dispatch_received();
+	void xbee_rx_waiter_complete(XBee_Rx_Waiter *waiter, XBee_Message *msg);
+	bool xbee_lookup_address(const xbee_string &node, XBee_Address *addr);
+	void xbee_cache_address(const XBee_Address &addr);
+	void xbee_discovered_node(const uint8_t *data, uint16_t length);
+	XBee_Tx_Entry* xbee_enqueue(const XBee_Message& msg, const XBee_Address *addr,
+		bool detached, uint8_t channel = XBEE_NO_CHANNEL);
+	void xbee_release(XBee_Tx_Entry *entry);
+	void xbee_transmit_queued();
+	void xbee_tx_status(uint8_t frame_id, uint8_t status, uint8_t retries);
+	void xbee_tx_failed(XBee_Tx_Entry *entry, uint8_t status);
+	bool xbee_fec_skip(XBee_Tx_Entry *entry);
+	void xbee_next_part(XBee_Tx_Entry *entry, uint8_t status);
+	void xbee_tx_complete(XBee_Tx_Entry *entry, uint8_t status);
+	bool xbee_hold_unreachable(XBee_Tx_Entry *entry);
+	XBee_Sleep_Node* xbee_sleep_node(const XBee_Address *addr, bool create);
+	bool xbee_hold(const XBee_Message& msg, const XBee_Address *addr,
+		xbee_status_cb callback);
+	bool xbee_has_held(const XBee_Sleep_Node *node);
+	void xbee_release_held(XBee_Held_Message *held, uint8_t status);
+	void xbee_node_asleep(XBee_Sleep_Node *node);
+	void xbee_node_awake(const XBee_Address *addr);
+	void xbee_forward_held(XBee_Sleep_Node *node);
+	bool xbee_radio_ready();
+	XBee_Destination* xbee_get_destination(const XBee_Address *addr);
+	bool xbee_destination_busy(const XBee_Destination *dest);
+	XBee_Destination* xbee_find_destination(const XBee_Address *addr);
+	void xbee_link_update(XBee_Destination *dest, int8_t delivered, int16_t retries);
+	void xbee_query_rssi(const XBee_Address *source);
+	uint32_t xbee_time_to_deadline(uint32_t wait);
+	void xbee_arm_timer(XBee_Timer *timer, enum xbee_timer_type type, void *context,
+		uint64_t expires);
+	void xbee_run_timers();
+	void xbee_timer_expired(XBee_Timer *timer);
+	uint8_t xbee_next_frame_id();
+	void xbee_handle_frame(GBeeFrameData *frame, uint16_t length);
+	GBeeError xbee_read_frame(GBeeFrameData *frame, uint16_t *length, uint32_t *timeout);
+	GBeeError xbee_receive_frame(GBeeFrameData *frame, uint16_t *length, uint32_t *timeout);
+	GBeeError xbee_send_tx_request(uint8_t frame_id, const XBee_Address *addr,
+		uint8_t bcast_radius, uint8_t options, uint8_t *data, uint16_t length);
+	GBeeError xbee_send_at(uint8_t frame_id, const xbee_string &at_command,
+		uint8_t *data, uint16_t length);
+	GBeeError xbee_send_remote_at(uint8_t frame_id, const XBee_Address *addr,
+		uint8_t options, const xbee_string &at_command, uint8_t *data, uint16_t length);
+	GBeeError xbee_send_frame(const uint8_t *data, uint16_t length);
+	void xbee_capture(uint8_t direction, const uint8_t *data, uint16_t length);
+	void xbee_route_record(const uint8_t *data, uint16_t length);
+	XBee_Route* xbee_lookup_route(const XBee_Address *addr);
+	GBeeError xbee_send_source_route(const XBee_Route *route);
+	bool xbee_coalesce(XBee_Message& msg, const XBee_Address *addr);
+	uint8_t xbee_flush_coalesced(XBee_Coalesce_Buffer *buf, bool wait);
+	void xbee_flush_destination(const XBee_Address *addr);
+	void xbee_split_coalesced(const uint8_t *data, uint16_t length,
+			const XBee_Address *source);
+	void xbee_push_pending(XBee_Message *msg);
+	void xbee_push_worker(XBee_Message *msg);
+	XBee_Message* xbee_remove_pending(uint8_t index);
+	uint8_t* at_cmd_str(const xbee_string &at_cmd_str, uint8_t *at_cmd);
 	
 	XBee_Config config;
-	XBee_Address *address_cache[XBEE_ADDR_CACHE_SIZE];
+	XBee_Timer_Wheel timers;	/* all deadlines of the interface */
+	XBee_Address address_cache[XBEE_ADDR_CACHE_SIZE];
 	uint8_t address_cache_size;
+	uint8_t address_cache_next;	/* entry that is replaced if the cache is full */
+	std::mutex address_cache_lock;
+	XBee_Timer discovery_timer;
+	bool discovery_running;
+	uint8_t discovered_cnt;		/* nodes found by the running discovery */
+	XBee_At_Command discovery_cmd;	/* "NT", then "ND" */
+	xbee_status_cb discovery_cb;
+	std::recursive_mutex io_lock;	/* serializes the public functions */
+	XBee_Mpsc_Queue<XBee_Submission> submissions;
+	int wakeup_pipe[2];
+#ifdef XBEE_STATIC_ALLOC
+	/* producers waiting for the poll thread to release pool slots */
+	std::mutex submit_lock;
+	std::condition_variable submit_freed;
+	std::atomic<uint32_t> submit_waiters;
+#endif
+	XBee_Coalesce_Buffer coalesce_cache[XBEE_COALESCE_CACHE_SIZE];
+	XBee_Message *rx_pending[XBEE_RX_PENDING_SIZE];
+	uint8_t rx_pending_cnt;
+	XBee_Rx_Worker rx_workers[XBEE_RX_WORKER_MAX];
+	uint8_t rx_worker_cnt;
+	bool rx_workers_stopping;	/* the workers are being joined */
+	uint8_t rx_pool_first[XBEE_RX_POOL_CNT];	/* first worker of the pool */
+	uint8_t rx_pool_size[XBEE_RX_POOL_CNT];
+	XBee_Message *rx_partial[XBEE_REASSEMBLY_SIZE];
+	XBee_Timer rx_partial_timer[XBEE_REASSEMBLY_SIZE];
+	uint32_t rx_part_cnt;		/* received parts, to detect progress */
+	XBee_Channel channels[XBEE_CHANNEL_CNT];
+	XBee_Dedup dedup[XBEE_DEDUP_SIZE];
+	uint8_t dedup_next;		/* entry that is replaced if the table is full */
+	XBee_At_Request at_pending[XBEE_AT_PENDING_SIZE];
+	XBee_Rx_Waiter rx_waiters[XBEE_RX_WAITER_SIZE];
+	uint8_t rx_waiter_cnt;
+	/* requests waiting for a free slot, oldest first */
+	XBee_List<XBee_Wait_Entry> tx_waiting;
+	XBee_List<XBee_Wait_Entry> at_waiting;
+	XBee_List<XBee_Wait_Entry> rx_waiting;
+	XBee_Tx_Entry tx_queue[XBEE_TX_QUEUE_SIZE];
+	uint8_t tx_queue_cnt;
+	uint8_t tx_in_flight;
+	uint32_t tx_seq;
+	std::atomic<uint8_t> tx_frame_id;
+	uint64_t tx_blocked_since;	/* time in ms the radio stopped accepting frames */
+	bool network_up;		/* updated from modem status frames */
+	XBee_Destination dest_cache[XBEE_DEST_CACHE_SIZE];
+	uint32_t dest_clock;	/* counts the uses of the destinations */
+	bool rssi_pending;	/* a "DB" query is running */
+	XBee_At_Command rssi_cmd;
+	XBee_Address rssi_addr;		/* destination the query is for */
+	XBee_Route route_cache[XBEE_ROUTE_CACHE_SIZE];
+	uint8_t route_cache_next;	/* entry that is replaced if the cache is full */
+	bool api_escaped;		/* device runs in API mode 2 */
+	XBee_Sleep_Node sleep_nodes[XBEE_SLEEP_NODE_CNT];
+	uint32_t held_seq;
+	GBeeFrameData rx_backlog[XBEE_RX_BACKLOG_SIZE];
+	uint16_t rx_backlog_len[XBEE_RX_BACKLOG_SIZE];
+	uint8_t rx_backlog_head;
+	uint8_t rx_backlog_cnt;
+	FILE *capture_file;
 	GBee *gbee_handle;
 };
 
@@ -133,13 +969,19 @@ class XBee_Message {
 friend class XBee;
 public:
 	XBee_Message(enum xbee_msg_type type, const uint8_t *payload, uint16_t length);
+	XBee_Message(enum xbee_msg_type type, uint16_t length);
 	XBee_Message(const uint8_t *message);
 	XBee_Message();
 	XBee_Message(const XBee_Message& msg);
 	XBee_Message& operator=(const XBee_Message &msg);
 	~XBee_Message();
+#ifdef XBEE_STATIC_ALLOC
+	static void* operator new(size_t size) noexcept;
+	static void operator delete(void *ptr);
+#endif
 	uint8_t* get_payload(uint16_t *length);
 	enum xbee_msg_type get_type();
+	const XBee_Address* get_source();
 	bool is_complete();
 private:
 	bool append_msg(const XBee_Message &msg);
@@ -147,6 +989,20 @@ private:
 	uint8_t* get_msg(uint16_t part);
 	uint16_t get_msg_len(uint16_t part);
 	uint8_t* allocate_msg_buffer(uint16_t payload_length);
+	uint8_t* allocate_payload(uint16_t *length);
+	void free_buffers();
+	void set_part_size(uint8_t size);
+	void set_fec(uint8_t group, uint8_t parity);
+	uint16_t get_part_total();
+	uint16_t get_parity_part(uint16_t part);
+	uint16_t get_part_len(uint16_t part);
+	bool has_part(uint16_t part);
+	bool add_part(const XBee_Message &part);
+	bool start_gaps(const XBee_Message &part);
+	bool set_stride(uint16_t size);
+	bool insert_part(const XBee_Message &part);
+	bool rebuild_part(const XBee_Message &parity);
+	void set_received(uint16_t part);
 
 	uint8_t *message_buffer;
 	uint8_t *payload;
@@ -154,7 +1010,23 @@ private:
 	uint16_t payload_len;
 	uint8_t message_part;
 	uint16_t message_part_cnt;
+	uint8_t part_size;	/* payload bytes per part */
+	uint16_t seq;		/* number and sync flag, see MSG_SEQ */
+	uint8_t fec_group;	/* data parts per parity group, 0 = none */
+	uint8_t fec_parity;	/* parity parts per group */
 	bool message_complete;
+	XBee_Address source;	/* sender of received messages */
+	/* reassembly of parts that arrive out of order, see insert_part */
+	bool gaps;
+	uint16_t received_cnt;
+	uint64_t received[FEC_MASK_WORDS];
+	uint8_t last_len;	/* length of the last data part */
+#ifdef XBEE_STATIC_ALLOC
+	/* one more part for the padding of a last part that is rebuilt from
+	 * a parity part during reassembly */
+	uint8_t payload_store[XBEE_STATIC_PAYLOAD_SIZE + XBEE_MSG_LENGTH - MSG_HEADER_LENGTH];
+	uint8_t buffer_store[XBEE_MSG_LENGTH];
+#endif
 };
 
 
@@ -0,0 +1,218 @@
+/* This file is part of Equine Monitor
+ *
+ * Equine Monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Equine Monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Equine Monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Konke Radlow <koradlow@gmail.com>
+ */
+
+#ifndef XBEE_QUEUE
+#define XBEE_QUEUE
+
+#include <atomic>
+#include <stddef.h>
+#include <inttypes.h>
+
+#define XBEE_CACHE_LINE 64
+
+/* element of a XBee_Mpsc_Queue, queued objects derive from this class */
+class XBee_Queue_Node {
+public:
+	XBee_Queue_Node() : next(NULL) {}
+
+	std::atomic<XBee_Queue_Node*> next;
+};
+
+/* unbounded lock-free queue for multiple producers and a single consumer.
+ * Producers link their nodes in with one atomic exchange and never wait
+ * for each other or the consumer. The consumer may see the queue as empty
+ * for a moment while a producer is between the exchange and the link, the
+ * node is returned by one of the following calls to pop */
+template <typename T>
+class XBee_Mpsc_Queue {
+public:
+	XBee_Mpsc_Queue() :
+		head(&stub),
+		tail(&stub)
+	{}
+
+	/* can be called from any thread */
+	void push(T *node) {
+		push_node(node);
+	}
+
+	/* must only be called by the consumer, returns NULL if the queue is empty */
+	T* pop() {
+		XBee_Queue_Node *cur = tail;
+		XBee_Queue_Node *next = cur->next.load(std::memory_order_acquire);
+
+		/* skip the stub node */
+		if (cur == &stub) {
+			if (!next)
+				return NULL;
+			tail = next;
+			cur = next;
+			next = next->next.load(std::memory_order_acquire);
+		}
+		if (next) {
+			tail = next;
+			return static_cast<T*>(cur);
+		}
+		/* a producer is linking in a node right now */
+		if (cur != head.load(std::memory_order_acquire))
+			return NULL;
+		/* cur is the last node, requeue the stub to be able to remove it */
+		push_node(&stub);
+		next = cur->next.load(std::memory_order_acquire);
+		if (next) {
+			tail = next;
+			return static_cast<T*>(cur);
+		}
+		return NULL;
+	}
+
+private:
+	XBee_Mpsc_Queue(const XBee_Mpsc_Queue&);
+	XBee_Mpsc_Queue& operator=(const XBee_Mpsc_Queue&);
+
+	void push_node(XBee_Queue_Node *node) {
+		XBee_Queue_Node *prev;
+
+		node->next.store(NULL, std::memory_order_relaxed);
+		prev = head.exchange(node, std::memory_order_acq_rel);
+		prev->next.store(node, std::memory_order_release);
+	}
+
+	std::atomic<XBee_Queue_Node*> head;	/* last node, producers append here */
+	XBee_Queue_Node *tail;			/* first node, owned by the consumer */
+	XBee_Queue_Node stub;
+};
+
+/* element of a XBee_List, listed objects derive from this class */
+class XBee_List_Node {
+public:
+	XBee_List_Node() : prev(NULL), next(NULL) {}
+
+	XBee_List_Node *prev;
+	XBee_List_Node *next;
+};
+
+/* doubly linked list for the thread that polls the interface. Nodes are
+ * appended at the end and removed from anywhere in O(1), it isn't
+ * thread-safe */
+template <typename T>
+class XBee_List {
+public:
+	XBee_List() :
+		head(NULL),
+		tail(NULL)
+	{}
+
+	bool empty() const { return head == NULL; }
+	/* returns NULL if the list is empty */
+	T* front() const { return static_cast<T*>(head); }
+
+	void push_back(T *node) {
+		node->prev = tail;
+		node->next = NULL;
+		if (tail)
+			tail->next = node;
+		else
+			head = node;
+		tail = node;
+	}
+
+	void remove(T *node) {
+		if (node->prev)
+			node->prev->next = node->next;
+		else
+			head = node->next;
+		if (node->next)
+			node->next->prev = node->prev;
+		else
+			tail = node->prev;
+		node->prev = NULL;
+		node->next = NULL;
+	}
+
+private:
+	XBee_List(const XBee_List&);
+	XBee_List& operator=(const XBee_List&);
+
+	XBee_List_Node *head;
+	XBee_List_Node *tail;
+};
+
+/* bounded lock-free ring for one producer and one consumer thread, SIZE has
+ * to be a power of two. Each side keeps a copy of the other side's index,
+ * and only reads the shared index when the copy says the ring is full or
+ * empty. The indices are kept on separate cache lines */
+template <typename T, uint32_t SIZE>
+class XBee_Spsc_Ring {
+public:
+	XBee_Spsc_Ring() :
+		head(0),
+		cached_tail(0),
+		tail(0),
+		cached_head(0)
+	{
+		static_assert((SIZE & (SIZE - 1)) == 0, "ring size must be a power of two");
+	}
+
+	/* must only be called by the producer, returns false if the ring is full */
+	bool push(const T &item) {
+		uint32_t cur = tail.load(std::memory_order_relaxed);
+
+		if (cur - cached_head == SIZE) {
+			cached_head = head.load(std::memory_order_acquire);
+			if (cur - cached_head == SIZE)
+				return false;
+		}
+		slots[cur & (SIZE - 1)] = item;
+		tail.store(cur + 1, std::memory_order_release);
+		return true;
+	}
+
+	/* must only be called by the consumer, returns false if the ring is empty */
+	bool pop(T *item) {
+		uint32_t cur = head.load(std::memory_order_relaxed);
+
+		if (cur == cached_tail) {
+			cached_tail = tail.load(std::memory_order_acquire);
+			if (cur == cached_tail)
+				return false;
+		}
+		*item = slots[cur & (SIZE - 1)];
+		head.store(cur + 1, std::memory_order_release);
+		return true;
+	}
+
+	/* number of queued items, can be called from any thread */
+	uint32_t size() const {
+		return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+	}
+
+private:
+	XBee_Spsc_Ring(const XBee_Spsc_Ring&);
+	XBee_Spsc_Ring& operator=(const XBee_Spsc_Ring&);
+
+	/* consumer side */
+	std::atomic<uint32_t> head __attribute__((aligned(XBEE_CACHE_LINE)));
+	uint32_t cached_tail;
+	/* producer side */
+	std::atomic<uint32_t> tail __attribute__((aligned(XBEE_CACHE_LINE)));
+	uint32_t cached_head;
+	T slots[SIZE] __attribute__((aligned(XBEE_CACHE_LINE)));
+};
+
+#endif
@@ -0,0 +1,206 @@
+/* This file is part of Equine Monitor
+ *
+ * Equine Monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Equine Monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Equine Monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Konke Radlow <koradlow@gmail.com>
+ */
+
+/* typed message layouts. A schema lists the field types of a message, the
+ * size of the payload and the offsets of the fields are computed at compile
+ * time. The number of parts isn't, it depends on the part size the
+ * interface picks for the link quality of the destination and on the
+ * parity parts:
+ *
+ *	typedef XBee_Schema<DATA, uint32_t, int16_t, int16_t, uint8_t> Vitals;
+ *
+ *	XBee_Writer<Vitals> writer;
+ *	writer.set<0>(timestamp);
+ *	writer.set<1>(heart_rate);
+ *	...
+ *	xbee.xbee_send_to_coordinator(writer.message());
+ *
+ *	XBee_View<Vitals> view(msg);
+ *	if (view.valid())
+ *		timestamp = view.get<0>();
+ *
+ * Fields are written into the payload of the message and read from the
+ * payload of the received message, without temporary buffers. Sending
+ * copies the message once, like any other message, when it is queued for
+ * transmission. Integer and floating point fields are stored in
+ * little-endian, all other field types (structs, arrays wrapped in structs)
+ * are copied as they are, so a schema with a single record struct costs
+ * one memcpy to build the message */
+
+#ifndef XBEE_SCHEMA
+#define XBEE_SCHEMA
+
+#include "xbee_if.h"
+#include <type_traits>
+#include <algorithm>
+
+/* total size of the field types */
+template <typename... FIELDS>
+struct xbee_size_of;
+
+template <>
+struct xbee_size_of<> {
+	static constexpr uint32_t value = 0;
+};
+
+template <typename T, typename... REST>
+struct xbee_size_of<T, REST...> {
+	static_assert(std::is_trivially_copyable<T>::value,
+		"message fields have to be trivially copyable");
+	static constexpr uint32_t value = sizeof(T) + xbee_size_of<REST...>::value;
+};
+
+/* type and offset of field I */
+template <uint16_t I, typename... FIELDS>
+struct xbee_field_at;
+
+template <typename T, typename... REST>
+struct xbee_field_at<0, T, REST...> {
+	typedef T type;
+	static constexpr uint16_t offset = 0;
+};
+
+template <uint16_t I, typename T, typename... REST>
+struct xbee_field_at<I, T, REST...> {
+	typedef typename xbee_field_at<I - 1, REST...>::type type;
+	static constexpr uint16_t offset = sizeof(T) + xbee_field_at<I - 1, REST...>::offset;
+};
+
+/* copies a field into the payload */
+template <typename T>
+inline void xbee_store(uint8_t *dst, const T &value) {
+	memcpy(dst, &value, sizeof(T));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	if (std::is_arithmetic<T>::value)
+		std::reverse(dst, dst + sizeof(T));
+#endif
+}
+
+/* copies a field out of the payload, the payload doesn't have to be aligned */
+template <typename T>
+inline T xbee_load(const uint8_t *src) {
+	T value;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	uint8_t tmp[sizeof(T)];
+	memcpy(tmp, src, sizeof(T));
+	if (std::is_arithmetic<T>::value)
+		std::reverse(tmp, tmp + sizeof(T));
+	src = tmp;
+#endif
+	memcpy(&value, src, sizeof(T));
+	return value;
+}
+
+template <enum xbee_msg_type TYPE, typename... FIELDS>
+class XBee_Schema {
+public:
+	static constexpr enum xbee_msg_type type = TYPE;
+	static constexpr uint16_t field_cnt = sizeof...(FIELDS);
+	static constexpr uint32_t size = xbee_size_of<FIELDS...>::value;
+
+	template <uint16_t I>
+	struct field {
+		static_assert(I < sizeof...(FIELDS), "field index out of range");
+		typedef typename xbee_field_at<I, FIELDS...>::type type;
+		static constexpr uint16_t offset = xbee_field_at<I, FIELDS...>::offset;
+	};
+
+	/* the limit of the XBee_Message constructor, which splits the payload
+	 * into parts of the full size. Smaller parts for poor links and parity
+	 * parts are left out for messages that would need more than 255 */
+	static_assert(size <= 255 * (XBEE_MSG_LENGTH - MSG_HEADER_LENGTH),
+		"message size > 20kB not supported");
+#ifdef XBEE_STATIC_ALLOC
+	/* the payload would be cut off when the message is built */
+	static_assert(size <= XBEE_STATIC_PAYLOAD_SIZE,
+		"message size exceeds XBEE_STATIC_PAYLOAD_SIZE");
+#endif
+};
+
+template <enum xbee_msg_type TYPE, typename... FIELDS>
+constexpr enum xbee_msg_type XBee_Schema<TYPE, FIELDS...>::type;
+template <enum xbee_msg_type TYPE, typename... FIELDS>
+constexpr uint16_t XBee_Schema<TYPE, FIELDS...>::field_cnt;
+template <enum xbee_msg_type TYPE, typename... FIELDS>
+constexpr uint32_t XBee_Schema<TYPE, FIELDS...>::size;
+
+/* builds a message of the schema, the fields are written into the payload
+ * of the message that is sent. All fields have to be set before the message
+ * is sent, the payload isn't initialized */
+template <typename SCHEMA>
+class XBee_Writer {
+public:
+	XBee_Writer() :
+		msg(SCHEMA::type, SCHEMA::size)
+	{
+		uint16_t length;
+		payload = msg.get_payload(&length);
+	}
+
+	template <uint16_t I>
+	void set(const typename SCHEMA::template field<I>::type &value) {
+		xbee_store(&payload[SCHEMA::template field<I>::offset], value);
+	}
+
+	XBee_Message& message() { return msg; }
+
+private:
+	XBee_Writer(const XBee_Writer&);
+	XBee_Writer& operator=(const XBee_Writer&);
+
+	XBee_Message msg;
+	uint8_t *payload;
+};
+
+/* reads the fields of a received message of the schema in place. The view
+ * is only valid as long as the message exists */
+template <typename SCHEMA>
+class XBee_View {
+public:
+	XBee_View(XBee_Message *msg) :
+		payload(NULL),
+		length(0)
+	{
+		if (msg && msg->is_complete() && msg->get_type() == SCHEMA::type)
+			payload = msg->get_payload(&length);
+	}
+
+	/* the message has the type of the schema and contains all fields */
+	bool valid() const {
+		return payload && length >= SCHEMA::size;
+	}
+
+	template <uint16_t I>
+	typename SCHEMA::template field<I>::type get() const {
+		return xbee_load<typename SCHEMA::template field<I>::type>(
+			&payload[SCHEMA::template field<I>::offset]);
+	}
+
+	/* address of the field in the payload, for fields that are read in
+	 * place, e.g. byte arrays */
+	template <uint16_t I>
+	const uint8_t* ptr() const {
+		return &payload[SCHEMA::template field<I>::offset];
+	}
+
+private:
+	const uint8_t *payload;
+	uint16_t length;
+};
+
+#endif
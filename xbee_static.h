@@ -0,0 +1,153 @@
+/* This file is part of Equine Monitor
+ *
+ * Equine Monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Equine Monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Equine Monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Konke Radlow <koradlow@gmail.com>
+ */
+
+/* containers of the heap-free build (XBEE_STATIC_ALLOC): strings with an
+ * inline buffer, and pools with a fixed number of slots that back the
+ * objects the interface creates at runtime */
+
+#ifndef XBEE_STATIC
+#define XBEE_STATIC
+
+#include <stddef.h>
+#include <inttypes.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <type_traits>
+
+/* string with an inline buffer of SIZE characters, longer strings are cut
+ * off. It covers the part of the std::string interface the interface uses */
+template <uint16_t SIZE>
+class XBee_Fixed_String {
+public:
+	XBee_Fixed_String() :
+		len(0)
+	{
+		buffer[0] = '\0';
+	}
+
+	XBee_Fixed_String(const char *str) {
+		assign(str, strlen(str));
+	}
+
+	XBee_Fixed_String(const char *str, size_t length) {
+		assign(str, length);
+	}
+
+	/* lets applications pass their strings, no memory is allocated */
+	XBee_Fixed_String(const std::string &str) {
+		assign(str.c_str(), str.length());
+	}
+
+	const char* c_str() const { return buffer; }
+	size_t length() const { return len; }
+	bool empty() const { return len == 0; }
+
+	bool operator==(const XBee_Fixed_String &str) const {
+		return len == str.len && !memcmp(buffer, str.buffer, len);
+	}
+
+	bool operator!=(const XBee_Fixed_String &str) const {
+		return !(*this == str);
+	}
+
+private:
+	void assign(const char *str, size_t length) {
+		len = (length > SIZE) ? SIZE : length;
+		memcpy(buffer, str, len);
+		buffer[len] = '\0';
+	}
+
+	char buffer[SIZE + 1];
+	uint16_t len;
+};
+
+/* SIZE slots for objects of type T, used by the class specific operator new
+ * of the heap-free build. Returns NULL if all slots are taken. Objects are
+ * released by the worker threads as well, so the free list is protected by
+ * a spin lock */
+template <typename T, uint32_t SIZE>
+class XBee_Pool {
+public:
+	XBee_Pool() :
+		free_head(0),
+		used(0),
+		max_used(0)
+	{
+		for (uint32_t i = 0; i < SIZE; i++)
+			next[i] = i + 1;
+		lock.clear();
+	}
+
+	void* alloc() {
+		void *ptr = NULL;
+
+		while (lock.test_and_set(std::memory_order_acquire))
+			;
+		if (free_head < SIZE) {
+			ptr = &slots[free_head];
+			free_head = next[free_head];
+			if (++used > max_used)
+				max_used = used;
+		}
+		lock.clear(std::memory_order_release);
+		return ptr;
+	}
+
+	void release(void *ptr) {
+		uint32_t index;
+
+		if (!ptr)
+			return;
+		index = static_cast<Slot*>(ptr) - slots;
+		while (lock.test_and_set(std::memory_order_acquire))
+			;
+		next[index] = free_head;
+		free_head = index;
+		used--;
+		lock.clear(std::memory_order_release);
+	}
+
+	uint32_t in_use() const { return used; }
+	/* a hint for callers that wait for a free slot, alloc decides */
+	bool full() {
+		bool result;
+
+		while (lock.test_and_set(std::memory_order_acquire))
+			;
+		result = (used == SIZE);
+		lock.clear(std::memory_order_release);
+		return result;
+	}
+	uint32_t peak() const { return max_used; }
+
+private:
+	XBee_Pool(const XBee_Pool&);
+	XBee_Pool& operator=(const XBee_Pool&);
+
+	typedef typename std::aligned_storage<sizeof(T), alignof(T)>::type Slot;
+
+	Slot slots[SIZE];
+	uint32_t next[SIZE];	/* free list, SIZE terminates it */
+	uint32_t free_head;
+	uint32_t used;
+	uint32_t max_used;
+	std::atomic_flag lock;
+};
+
+#endif
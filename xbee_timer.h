@@ -0,0 +1,195 @@
+/* This file is part of Equine Monitor
+ *
+ * Equine Monitor is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Equine Monitor is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Equine Monitor.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Konke Radlow <koradlow@gmail.com>
+ */
+
+#ifndef XBEE_TIMER
+#define XBEE_TIMER
+
+#include <stddef.h>
+#include <inttypes.h>
+
+/* the wheel has 4 levels with 64 slots each. Level 0 has a resolution of
+ * 1 ms, every further level is 64 times coarser, which covers deadlines up
+ * to 4.6 hours in the future */
+#define XBEE_WHEEL_LEVELS 4
+#define XBEE_WHEEL_BITS 6
+#define XBEE_WHEEL_SLOTS (1 << XBEE_WHEEL_BITS)
+#define XBEE_WHEEL_MASK (XBEE_WHEEL_SLOTS - 1)
+#define XBEE_WHEEL_RANGE ((uint64_t)1 << (XBEE_WHEEL_LEVELS * XBEE_WHEEL_BITS))
+
+/* a timer is embedded in the object it belongs to, type and context tell
+ * the owner of the wheel what to do when it expires */
+class XBee_Timer {
+public:
+	XBee_Timer() :
+		prev(NULL),
+		next(NULL),
+		expires(0),
+		type(0),
+		context(NULL)
+	{}
+
+	bool armed() const { return next != NULL; }
+
+	XBee_Timer *prev;
+	XBee_Timer *next;
+	uint64_t expires;	/* absolute deadline in ms */
+	uint8_t type;
+	void *context;
+};
+
+/* hierarchical timer wheel, timers are armed and cancelled in O(1). Timers
+ * on the higher levels are moved down a level each time the lower level
+ * wraps around, until they reach level 0 and expire */
+class XBee_Timer_Wheel {
+public:
+	XBee_Timer_Wheel(uint64_t now) :
+		current(now),
+		count(0)
+	{
+		for (int level = 0; level < XBEE_WHEEL_LEVELS; level++) {
+			for (int slot = 0; slot < XBEE_WHEEL_SLOTS; slot++) {
+				slots[level][slot].prev = &slots[level][slot];
+				slots[level][slot].next = &slots[level][slot];
+			}
+		}
+	}
+
+	/* (re)arms the timer for the absolute deadline in ms */
+	void arm(XBee_Timer *timer, uint64_t expires) {
+		cancel(timer);
+		timer->expires = expires;
+		insert(timer);
+		count++;
+	}
+
+	void cancel(XBee_Timer *timer) {
+		if (!timer->armed())
+			return;
+		unlink(timer);
+		count--;
+	}
+
+	/* returns the next timer that expired until now, and removes it from
+	 * the wheel. Returns NULL if there is none left */
+	XBee_Timer* expire(uint64_t now) {
+		XBee_Timer *head;
+		XBee_Timer *timer;
+
+		/* nothing to move down the levels on an empty wheel */
+		if (count == 0) {
+			if (now >= current)
+				current = now + 1;
+			return NULL;
+		}
+		while (current <= now) {
+			head = &slots[0][current & XBEE_WHEEL_MASK];
+			if (head->next != head) {
+				timer = head->next;
+				unlink(timer);
+				count--;
+				return timer;
+			}
+			current++;
+			if ((current & XBEE_WHEEL_MASK) == 0)
+				cascade(1);
+		}
+		return NULL;
+	}
+
+	/* returns the time in ms of the next expiry, or a time before it if the
+	 * timer is still on a higher level. Returns UINT64_MAX if no timer is
+	 * armed */
+	uint64_t next_expiry() const {
+		uint64_t base;
+
+		if (count == 0)
+			return UINT64_MAX;
+		for (int i = 0; i < XBEE_WHEEL_SLOTS; i++) {
+			const XBee_Timer *head = &slots[0][(current + i) & XBEE_WHEEL_MASK];
+			if (head->next != head)
+				return current + i;
+		}
+		/* timers on the higher levels are at least one slot ahead of
+		 * the cursor, so the slot of the cursor holds timers of the next
+		 * round, at base + XBEE_WHEEL_SLOTS */
+		for (int level = 1; level < XBEE_WHEEL_LEVELS; level++) {
+			base = current >> (level * XBEE_WHEEL_BITS);
+			for (int i = 1; i <= XBEE_WHEEL_SLOTS; i++) {
+				const XBee_Timer *head = &slots[level][(base + i) & XBEE_WHEEL_MASK];
+				if (head->next != head)
+					return (base + i) << (level * XBEE_WHEEL_BITS);
+			}
+		}
+		return current;
+	}
+
+private:
+	XBee_Timer_Wheel(const XBee_Timer_Wheel&);
+	XBee_Timer_Wheel& operator=(const XBee_Timer_Wheel&);
+
+	/* puts the timer into the slot that matches its distance to the
+	 * current time */
+	void insert(XBee_Timer *timer) {
+		XBee_Timer *head;
+		uint64_t delta;
+		int level = 0;
+
+		if (timer->expires < current)
+			timer->expires = current;
+		if (timer->expires - current >= XBEE_WHEEL_RANGE)
+			timer->expires = current + XBEE_WHEEL_RANGE - 1;
+		delta = timer->expires - current;
+		while (level < XBEE_WHEEL_LEVELS - 1 &&
+		delta >= ((uint64_t)XBEE_WHEEL_SLOTS << (level * XBEE_WHEEL_BITS)))
+			level++;
+
+		head = &slots[level][(timer->expires >> (level * XBEE_WHEEL_BITS)) & XBEE_WHEEL_MASK];
+		timer->prev = head->prev;
+		timer->next = head;
+		head->prev->next = timer;
+		head->prev = timer;
+	}
+
+	void unlink(XBee_Timer *timer) {
+		timer->prev->next = timer->next;
+		timer->next->prev = timer->prev;
+		timer->prev = NULL;
+		timer->next = NULL;
+	}
+
+	/* moves the timers of the slot that is due on the level down */
+	void cascade(int level) {
+		int slot = (current >> (level * XBEE_WHEEL_BITS)) & XBEE_WHEEL_MASK;
+		XBee_Timer *head = &slots[level][slot];
+		XBee_Timer *timer;
+
+		if (slot == 0 && level + 1 < XBEE_WHEEL_LEVELS)
+			cascade(level + 1);
+		while (head->next != head) {
+			timer = head->next;
+			unlink(timer);
+			insert(timer);
+		}
+	}
+
+	XBee_Timer slots[XBEE_WHEEL_LEVELS][XBEE_WHEEL_SLOTS];
+	uint64_t current;	/* next ms to process */
+	uint32_t count;		/* armed timers */
+};
+
+#endif